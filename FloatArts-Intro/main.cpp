@@ -15,565 +15,8091 @@
 */
 #include <iostream>
 #include <tuple>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <type_traits>
+#include <string>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <climits>
+#include <cfloat>
+#include <emmintrin.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h> // Before glad, which only defines APIENTRY when windows.h has not.
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <stb/stb_image.h>
+#ifdef __linux__
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 
 #define GLM_FORCE_RADIANS // [https://stackoverflow.com/questions/79054516/fps-camera-system-cant-look-up-or-down]
 #include <glm/glm.hpp>
 
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include <glm/gtx/rotate_vector.hpp>
 #include <glm/gtx/vector_angle.hpp>
 
 #define SCREEN_WIDTH 1920
 #define SCREEN_HEIGHT 1080
 
+#define FRAME_CONSTANTS_BINDING 0
+#define DRAW_CONSTANTS_BINDING 1
+
+#define MESH_FILE_MAGIC "FAMS"
+#define MESH_FILE_VERSION 3
+#define MESH_FILE_ALIGNMENT 64 // Vertex and index blobs start on a cache line.
+#define MESH_MAX_ATTRIBUTES 8
+#define IMPORT_CHUNK_SIZE (1024 * 1024) // Bytes of OBJ text per parse task.
+#define IMPORT_MAX_CHUNKS 256
+
+#define VERTEX_CACHE_SIZE 16 // FIFO entries of the simulated post-transform cache.
+#define OPTIMIZE_BATCH_TRIANGLES 65536 // Triangles reordered per task.
+
+#define INSTANCE_ATTRIBUTE 4 // mat4, takes locations 4 to 7.
+
+#define JOB_DEQUE_SIZE 4096 // Jobs per thread, a power of two. A thread with a full deque runs new jobs inline.
+#define JOB_SPIN_COUNT 64 // Failed searches before an idle worker sleeps.
+#define JOB_BENCH_OBJECTS (1 << 18) // Nodes, boxes and spheres of --bench-jobs.
+#define JOB_BENCH_RUNS 5 // The fastest run is reported.
+#define JOB_BENCH_JOBS 1024 // Empty jobs submitted per wait.
+
+#define SCENE_BATCH_NODES 16384 // Nodes per task when a level is updated on several threads.
+#define CULL_CHUNK_SIZE 16384 // Spheres per task of frustumCull(), a multiple of 4.
+
+#define BVH_LEAF_SIZE 4 // Slots per leaf, tested with one SSE iteration.
+#define BVH_BINS 16 // SAH candidate planes per axis.
+#define BVH_TASK_OBJECTS 4096 // Subtrees below this size are built by one task.
+#define BVH_MEDIAN_DEPTH 64 // Deeper nodes are split at the median.
+#define BVH_MAX_DEPTH 96 // Traversal stack size.
+
+#define OCCLUSION_WIDTH 256 // Depth buffer of the occlusion culler.
+#define OCCLUSION_HEIGHT 144
+#define OCCLUSION_OCCLUDERS 32 // Nearest instances rasterized as occluders.
+
+#define SIMULATION_HZ 60 // Fixed timestep of the update thread.
+#define SIMULATION_MAX_LAG 5 // Ticks the simulation can fall behind before it drops them.
+#define SIMULATION_FRESH 4 // Flag of Simulation::latest, set until the render thread takes the slot.
+
+#define SOFTWARE_TILE_SIZE 64
+#define SOFTWARE_BLOCK_SIZE 8 // Granularity of the hierarchical depth test.
+#define SOFTWARE_CHUNK_TRIANGLES 4096
+#define SOFTWARE_VARYINGS 8 // crnt_pos, texCoord, normals
+
+#define HEADLESS_READBACK_BUFFERS 3
+#define HEADLESS_QUEUE_FRAMES 8
+
+#define PROFILER_FRAMES 4 // Frames in flight before a timer query is read back.
+#define PROFILER_HISTORY 120 // Frames in the rolling average.
+
+#define TRACE_MAX_THREADS 64
+#define TRACE_GPU_TRACK TRACE_MAX_THREADS // Thread id of the GPU passes in the trace.
+#define TRACE_BUFFER_EVENTS 16384 // Per thread, power of two.
+#define TRACE_FLUSH_MS 100
+
+#define RENDER_BUFFERS 2 // Command buffers, one is recorded while the render thread replays the other.
+
+#define STREAM_BUFFER_SIZE (1024 * 1024) // Initial bytes of the ring, it grows to hold STREAM_FRAMES frames of data.
+#define STREAM_FRAMES 3 // Frames the GPU may still be reading while the CPU writes the next one.
+#define STREAM_VERTEX_ALIGNMENT 16
+
+#define HEAP_SECOND_LEVEL_BITS 3 // Free list bins per power of two are 1 << this.
+#define HEAP_FIRST_LEVELS 32
+#define HEAP_BINS (HEAP_FIRST_LEVELS << HEAP_SECOND_LEVEL_BITS)
+#define GEOMETRY_VERTICES (64 * 1024) // Initial capacity of the vertex buffer of each vertex format.
+#define GEOMETRY_INDICES (256 * 1024)
+
+#define TEXTURE_UPLOAD_BUDGET (4 * 1024 * 1024) // Bytes of texels copied to PBOs per frame.
+#define TEXTURE_UPLOAD_PBOS 2
+#define TEXTURE_CACHE_VERSION 1 // Bump when the cooker output changes, it is part of the cache key.
+
+// EXT_texture_compression_s3tc
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+
+#define DEBUG_RING_MESSAGES 64 // Power of two.
+#define DEBUG_MESSAGE_LENGTH 256
+
+// KHR_debug, glad is generated for 3.3 core without extensions.
+#define GL_DEBUG_OUTPUT 0x92E0
+#define GL_DEBUG_SOURCE_SHADER_COMPILER 0x8248
+#define GL_DEBUG_TYPE_ERROR 0x824C
+#define GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR 0x824D
+#define GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR 0x824E
+#define GL_DEBUG_TYPE_PORTABILITY 0x824F
+#define GL_DEBUG_TYPE_PERFORMANCE 0x8250
+#define GL_DEBUG_SEVERITY_NOTIFICATION 0x826B
+typedef void (APIENTRYP PFNGLDEBUGMESSAGECALLBACKPROC)(GLDEBUGPROC callback, const void* userParam);
+typedef void (APIENTRYP PFNGLDEBUGMESSAGECONTROLPROC)(GLenum source, GLenum type, GLenum severity, GLsizei count, 
+	const GLuint* ids, GLboolean enabled);
+
+// ARB_buffer_storage, core in 4.4.
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+typedef void (APIENTRYP PFNGLBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+
 float FOV = glm::radians(45.0f);
 float NEAR_PLANE = 0.1f;
 float FAR_PLANE = 400.0f;
 
+// Counts a GL/GLFW call into the current frame statistics.
+#define DRIVER_CALL(call) (frameStats.driverCalls++, call)
+
+// glGetError polling is only compiled into debug builds, release builds just report the KHR_debug messages.
+#ifdef NDEBUG
+#define CHECK_GL_ERRORS() debugOutputFlush()
+#else
+#define CHECK_GL_ERRORS() checkOpenGLError()
+#endif
+
 // Structs
+struct VertexAttribute
+{
+	GLuint location;
+	GLint components;
+	GLenum type;
+	GLuint normalized;
+	GLuint offset;
+};
+
+// Interleaved vertex format, one glVertexAttribPointer per attribute.
+struct VertexLayout
+{
+	GLuint stride;
+	GLuint attributeCount;
+	VertexAttribute attributes[MESH_MAX_ATTRIBUTES];
+};
+
+// Stored vertex formats of meshes in vertexLayoutFull.
+enum VertexFormat
+{
+	VERTEX_FORMAT_FLOAT, // 44 bytes, as declared.
+	VERTEX_FORMAT_PACKED, // 24 bytes: float position, RGBA8 color, half UV, octahedral normal.
+	VERTEX_FORMAT_PACKED16 // 20 bytes: the same with 16-bit positions relative to the bounds.
+};
+
 struct ObjectData
 {
 	const void* vertices;
 	size_t verticesSize;
-	const void* indices;
+	const void* indices; // GLuint
 	size_t indicesSize;
+	VertexLayout layout;
+	glm::vec3 boundsMin; // Object space, set by loadMesh() and packVertices().
+	glm::vec3 boundsMax;
 };
 
-// Functions
-void display(GLFWwindow* window, GLuint lightShader, GLuint program, GLuint VAO, GLuint LVAO, double currentTime, 
-	GLuint uniformCamMatrix);
+// Mesh file header, the vertex and index blobs follow at MESH_FILE_ALIGNMENT.
+struct MeshFileHeader
+{
+	char magic[4];
+	GLuint version;
+	VertexLayout layout;
+	GLenum indexType;
+	GLuint vertexCount;
+	GLuint indexCount;
+	float boundsMin[3];
+	float boundsMax[3];
+	unsigned long long vertexOffset;
+	unsigned long long vertexSize;
+	unsigned long long indexOffset;
+	unsigned long long indexSize;
+};
+static_assert(sizeof(MeshFileHeader) == 248, "the mesh file header layout changed, bump MESH_FILE_VERSION");
 
-GLuint programInit(const char* vertexShaderCode, const char* fragmentShaderCode);
-void terminateProgram(GLuint program);
+struct MappedFile
+{
+	const unsigned char* data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int descriptor;
+#endif
+};
 
-std::tuple<GLuint, GLuint, GLuint> createObject(ObjectData object, int layers, int length);
-void terminateObject(GLuint VAO, GLuint VBO, GLuint EBO);
+// ObjectData pointing into a mapped mesh file.
+struct Mesh
+{
+	MappedFile file;
+	ObjectData object;
+	std::vector<unsigned char> vertices; // Hold the data of object when no file is mapped.
+	std::vector<GLuint> indices;
+};
 
-void inputs(GLFWwindow* window);
+// Face corner of an OBJ chunk, the attribute counts resolve relative indices once all chunks are parsed.
+struct ObjCorner
+{
+	int position;
+	int texCoord;
+	int normal;
+	int positionsSeen;
+	int texCoordsSeen;
+	int normalsSeen;
+};
 
-void checkShaderCompileErrors(GLuint shader);
-void checkProgramLinkErrors(GLuint program);
-const char* getGLErrorString(GLenum err);
-void checkOpenGLError(void);
-void errorLog(std::string category, std::string type, std::string massage, std::string comment="");
+struct ObjCornerKey
+{
+	int position;
+	int texCoord; // -1 when missing.
+	int normal; // -1 when missing.
+};
 
-// Global Variables
-glm::mat4 model = glm::mat4(1.0f);
-glm::mat4 lModel = glm::mat4(1.0f);
-glm::vec3 camPos = glm::vec3(0.0f, 0.0f, 2.0f);
-glm::vec3 orientation = glm::vec3(0.0f, 0.0f, -1.0f);
-glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f);
+struct ObjChunk
+{
+	std::vector<float> positions;
+	std::vector<float> colors;
+	std::vector<float> texCoords;
+	std::vector<float> normals;
+	std::vector<ObjCorner> corners; // Triangles.
+	int malformed; // Vertex lines with fewer than 3 coordinates.
+};
 
-glm::vec4 lightColor = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
-glm::vec3 lightPos = glm::vec3(1.0f, 1.0f, 2.0f);
-glm::mat4 lightModel = glm::mat4(1.0f);
+// Import result in the layout of vertexLayoutFull.
+struct ImportedMesh
+{
+	std::vector<float> vertices;
+	std::vector<GLuint> indices;
+	size_t corners; // Face corners before de-duplication.
+};
 
-glm::vec3 cubePos = glm::vec3(0.0f, 0.0f, 0.0f);
-glm::mat4 cubeModel = glm::mat4(1.0f);
+enum JsonType
+{
+	JSON_NULL,
+	JSON_BOOL,
+	JSON_NUMBER,
+	JSON_STRING,
+	JSON_ARRAY,
+	JSON_OBJECT
+};
 
-float rotation = 0.0f;
-float rotatingSpeed = 2.0f;
-float camSpeed = 0.1;
-float sensitivity = 100.0;
-bool firstClick = true;
+struct JsonValue
+{
+	JsonType type;
+	bool boolean;
+	double number;
+	std::string string;
+	std::vector<std::string> keys; // Objects only, parallel to items.
+	std::vector<JsonValue> items;
+};
 
-double startTime = glfwGetTime();
-double lastTime = startTime;
+struct GltfModel
+{
+	JsonValue json;
+	std::vector<std::vector<unsigned char>> buffers;
+};
 
-GLuint textureFloatArts;
-GLfloat scale = 1.0f;
+struct GltfAccessor
+{
+	const unsigned char* data;
+	size_t count;
+	size_t stride;
+	int components;
+	int componentType;
+	bool normalized;
+};
 
-float screenColor[4] = { 0.1f, 0.2f, 0.3f, 1.f };
+struct GltfDraw
+{
+	const JsonValue* primitive;
+	glm::mat4 world; // Node transform, baked into the vertices.
+};
 
-const char* vertexShaderCode =
-"#version 330 core\n"
-"layout (location = 0) in vec3 aPos;\n"
-"layout (location = 1) in vec3 aColor;\n"
-"layout (location = 2) in vec2 aTex;\n"
-"layout (location = 3) in vec3 aNormals;\n"
-"uniform mat4 camMatrix;\n"
-"uniform mat4 model;\n"
-"out vec3 color;\n"
-"out vec2 texCoord;\n"
-"out vec3 crnt_pos;\n"
-"out vec3 normals;\n"
-"void main()\n"
-"{\n"
-"   crnt_pos = vec3(model * vec4(aPos, 1.0f));\n"
-"	gl_Position = camMatrix * vec4(crnt_pos, 1.0f);\n"
-"	color = aColor;\n"
-"	texCoord = aTex;\n"
-"   normals = aNormals;\n"
-"}\0;"
-;
-const char* fragmentShaderCode =
-"#version 330 core\n"
-"out vec4 FragColor;\n"
-"in vec3 color;\n"
-"in vec2 texCoord;\n"
-"in vec3 crnt_pos;\n"
-"in vec3 normals;\n"
-"uniform sampler2D tex0;\n"
-"uniform vec4 lightColor;\n"
-"uniform vec3 lightPos;\n"
-"uniform vec3 cam_pos;\n"
-"void main()\n"
-"{\n"
-"   float ambient = 0.20;\n"
+// Run of triangles that tipsify emitted without a cache flush, the unit of the overdraw ordering.
+struct MeshCluster
+{
+	size_t first; // Triangle
+	size_t count;
+	glm::vec3 centroid; // Area weighted sum.
+	glm::vec3 normal; // Unnormalized sum.
+	float area;
+	float sortKey;
+};
 
-"   vec3 normal = normalize(normals);\n"
-"   vec3 lightDirection = normalize(lightPos - crnt_pos);\n"
-"   float diffuse = max(dot(normal, lightDirection), 0.0f);\n"
+// Every uniform the shaders use, locations are looked up once per program in programReflect().
+enum UniformKey
+{
+	UNIFORM_TEX0,
+	UNIFORM_POSITION_SCALE,
+	UNIFORM_POSITION_OFFSET,
+	UNIFORM_COUNT
+};
 
-"   float specularLight = 0.50f;\n"
-"   vec3 viewDirection = normalize(cam_pos - crnt_pos);\n"
-"   vec3 reflectionDirection = reflect(-lightDirection, normal);\n"
-"   float specAmount = pow(max(dot(viewDirection, reflectionDirection), 0.0f), 8);\n"
-"   float specular = specAmount * specularLight;\n"
+// Per-frame data shared by all programs, mirrors the std140 FrameConstants block in the shaders.
+struct FrameConstants
+{
+	glm::mat4 camMatrix;
+	glm::vec4 camPos; // w unused
+	glm::vec4 lightColor;
+	glm::vec4 lightPos; // w unused
+};
 
-"	FragColor = texture(tex0, texCoord) * lightColor  * (diffuse + ambient + specular);\n"
-"}\n\0;"
-;
+// Per-draw data, mirrors the std140 DrawConstants block. Every draw gets its own range of the stream buffer.
+struct DrawConstants
+{
+	glm::mat4 model;
+};
 
-const char* vertexShaderLightCode =
-"#version 330 core\n"
-"layout (location = 0) in vec3 aPos;\n"
-"uniform mat4 model;\n"
-"uniform mat4 camMatrix;\n"
-"void main()\n"
-"{\n"
-"	gl_Position = camMatrix * model * vec4(aPos, 1.0);\n"
-"}\n\0;"
-;
-const char* fragmentShaderLightCode =
-"#version 330 core\n"
-"out vec4 FragColor;\n"
-"uniform vec4 lightColor;\n"
-"void main()\n"
-"{\n"
-"	FragColor = lightColor;\n"
-"}\n\0;"
-;
+struct ProgramInfo
+{
+	GLuint id;
+	GLint locations[UNIFORM_COUNT]; // -1 when the program doesn't use the uniform.
+};
 
-GLfloat objectFloatArtsvertices[] = {
-	// Positions          // Colors               // Texture Coordinates           // Normals
-	// Back Face
-	-0.5f * scale, -0.5f * scale, -0.5f * scale,  1.0f, 0.0f, 0.0f,    1.0f, 0.0f,  0.0f, 0.0f, -1.0f,  // Back-left-bottom
-	 0.5f * scale, -0.5f * scale, -0.5f * scale,  1.0f, 0.0f, 0.0f,     0.0f, 0.0f,  0.0f, 0.0f, -1.0f,  // Back-right-bottom
-	 0.5f * scale,  0.5f * scale, -0.5f * scale,  1.0f, 0.0f, 0.0f,     0.0f, 1.0f,  0.0f, 0.0f, -1.0f,  // Back-right-top
-	-0.5f * scale,  0.5f * scale, -0.5f * scale,  1.0f, 0.0f, 0.0f,    1.0f, 1.0f,  0.0f, 0.0f, -1.0f,  // Back-left-top
+struct AppOptions
+{
+	int instances; // --instances N: pyramids drawn in a grid.
+	bool benchInstances; // --bench-instances: frames/sec for 1 to 100k instances.
+	bool software; // --software: render on the CPU without a window and write software.ppm.
+	int frames; // --frames N: frames rendered by the windowless modes.
+	bool headless; // --headless: render offscreen with a scripted camera and write every frame.
+	const char* outPrefix; // --out PREFIX: path prefix of the written frames.
+	bool rawFrames; // --raw: write RGBA8 .rgba files instead of PNG.
+	const char* benchmarkPath; // --benchmark PATH|orbit: replay a camera path with vsync off and report frame times.
+	const char* recordPath; // --record PATH: save the camera of every frame for --benchmark.
+	int warmupFrames; // --warmup N: frames rendered before measuring.
+	const char* jsonPath; // --json PATH: benchmark report.
+	const char* tracePath; // --trace PATH: chrome://tracing JSON of the CPU and GPU timelines.
+	const char* cookPath; // --cook PATH: write the compressed texture cache of an image and exit.
+	const char* modelPath; // --model PATH: .obj, .gltf or .glb drawn instead of the pyramid.
+	VertexFormat vertexFormat; // --vertex-format float|packed|packed16: how meshes are stored and uploaded.
+	int sceneNodes; // --bench-scene N: time scene graph updates of N nodes and exit.
+	bool noCull; // --no-cull: draw every instance, also the ones outside the view.
+	int bvhObjects; // --bench-bvh N: time hierarchy queries over N objects and exit.
+	bool noOcclusion; // --no-occlusion: draw the instances hidden behind nearer ones too.
+	int threads; // --threads N: threads of the job system, the main thread included.
+	bool benchJobs; // --bench-jobs: time the parallel passes on 1 to --threads threads and exit.
+	bool noRenderThread; // --no-render-thread: replay the GL commands on the main thread.
+	bool noBufferStorage; // --no-buffer-storage: stream through orphaned buffers even when ARB_buffer_storage is there.
+	int heapAllocations; // --bench-heap N: time N allocations of the geometry heap allocator and exit.
+};
 
-	// Front Face
-	-0.5f * scale, -0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 1.0f,    0.0f, 0.0f,  0.0f, 0.0f,  1.0f,  // Front-left-bottom
-	 0.5f * scale, -0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 1.0f,     1.0f, 0.0f,  0.0f, 0.0f,  1.0f,  // Front-right-bottom
-	 0.5f * scale,  0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 1.0f,     1.0f, 1.0f,  0.0f, 0.0f,  1.0f,  // Front-right-top
-	-0.5f * scale,  0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 1.0f,    0.0f, 1.0f,  0.0f, 0.0f,  1.0f,  // Front-left-top
+struct JobCounter
+{
+	std::atomic<int> pending; // Submitted jobs that haven't finished.
 
-	// Left Face (no texture)
-	-0.5f * scale, -0.5f * scale, -0.5f * scale,  0.0f, 1.0f, 0.0f,    0.0f, 0.0f,  -1.0f, 0.0f, 0.0f,  // Back-left-bottom
-	-0.5f * scale, -0.5f * scale,  0.5f * scale,  0.0f, 1.0f, 0.0f,    0.0f, 0.0f,  -1.0f, 0.0f, 0.0f,  // Front-left-bottom
-	-0.5f * scale,  0.5f * scale,  0.5f * scale,  0.0f, 1.0f, 0.0f,    0.0f, 0.0f,  -1.0f, 0.0f, 0.0f,  // Front-left-top
-	-0.5f * scale,  0.5f * scale, -0.5f * scale,  0.0f, 1.0f, 0.0f,    0.0f, 0.0f,  -1.0f, 0.0f, 0.0f,  // Back-left-top
+	JobCounter() : pending(0) {}
+};
 
-	// Right Face (no texture)
-	 0.5f * scale, -0.5f * scale, -0.5f * scale,  0.0f, 0.0f, 1.0f,    0.0f, 0.0f,   1.0f, 0.0f, 0.0f,  // Back-right-bottom
-	 0.5f * scale, -0.5f * scale,  0.5f * scale,  0.0f, 0.0f, 1.0f,    0.0f, 0.0f,   1.0f, 0.0f, 0.0f,  // Front-right-bottom
-	 0.5f * scale,  0.5f * scale,  0.5f * scale,  0.0f, 0.0f, 1.0f,    0.0f, 0.0f,   1.0f, 0.0f, 0.0f,  // Front-right-top
-	 0.5f * scale,  0.5f * scale, -0.5f * scale,  0.0f, 0.0f, 1.0f,    0.0f, 0.0f,   1.0f, 0.0f, 0.0f,  // Back-right-top
+struct Job
+{
+	std::function<void()> function;
+	JobCounter* counter; // May be NULL.
+	const JobCounter* dependency; // Waited for before the function runs, may be NULL.
+};
 
-	 // Top Face (no texture)
-	  -0.5f * scale,  0.5f * scale, -0.5f * scale,  1.0f, 1.0f, 0.0f,    0.0f, 0.0f,   0.0f, 1.0f, 0.0f,  // Back-left-top
-	   0.5f * scale,  0.5f * scale, -0.5f * scale,  1.0f, 1.0f, 0.0f,    0.0f, 0.0f,   0.0f, 1.0f, 0.0f,  // Back-right-top
-	   0.5f * scale,  0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 0.0f,    0.0f, 0.0f,   0.0f, 1.0f, 0.0f,  // Front-right-top
-	  -0.5f * scale,  0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 0.0f,    0.0f, 0.0f,   0.0f, 1.0f, 0.0f,  // Front-left-top
+// Chase-Lev deque of one thread. The owner pushes and pops at the bottom, the other threads steal from the top.
+struct JobDeque
+{
+	std::atomic<long long> top;
+	char padding[64 - sizeof(std::atomic<long long>)]; // Thieves and the owner write different cache lines.
+	std::atomic<long long> bottom;
+	std::atomic<Job*> jobs[JOB_DEQUE_SIZE];
+};
 
-	  // Bottom Face (no texture)
-	   -0.5f * scale, -0.5f * scale, -0.5f * scale,  0.5f, 0.5f, 0.5f,    0.0f, 0.0f,   0.0f, -1.0f, 0.0f,  // Back-left-bottom
-		0.5f * scale, -0.5f * scale, -0.5f * scale,  0.5f, 0.5f, 0.5f,    0.0f, 0.0f,   0.0f, -1.0f, 0.0f,  // Back-right-bottom
-		0.5f * scale, -0.5f * scale,  0.5f * scale,  0.5f, 0.5f, 0.5f,    0.0f, 0.0f,   0.0f, -1.0f, 0.0f,  // Front-right-bottom
-	   -0.5f * scale, -0.5f * scale,  0.5f * scale,  0.5f, 0.5f, 0.5
+// Fixed pool of worker threads, thread 0 is the one that called jobSystemInit(). It runs jobs while it waits for them.
+struct JobSystem
+{
+	std::vector<std::thread> threads;
+	std::vector<std::unique_ptr<JobDeque>> deques; // Per thread
+	int threadCount;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<Job*> background; // Long jobs (file decoding), only taken by the workers when they have nothing else.
+	std::atomic<int> available; // Queued jobs, an idle worker sleeps while there are none.
+	std::atomic<int> sleeping;
+	std::atomic<bool> finished;
 };
 
-GLfloat objectCubeVerticesFull[] = {
-	// Positions          // Colors               // Texture Coordinates      // Normals
-	// Back Face
-	-0.5f * scale, -0.5f * scale, -0.5f * scale,  1.0f, 0.0f, 0.0f,    1.0f, 0.0f,  0.0f, 0.0f, -1.0f,  // Back-left-bottom
-	 0.5f * scale, -0.5f * scale, -0.5f * scale,  1.0f, 0.0f, 0.0f,     0.0f, 0.0f,  0.0f, 0.0f, -1.0f,  // Back-right-bottom
-	 0.5f * scale,  0.5f * scale, -0.5f * scale,  1.0f, 0.0f, 0.0f,     0.0f, 1.0f,  0.0f, 0.0f, -1.0f,  // Back-right-top
-	-0.5f * scale,  0.5f * scale, -0.5f * scale,  1.0f, 0.0f, 0.0f,    1.0f, 1.0f,  0.0f, 0.0f, -1.0f,  // Back-left-top
+// Bounding spheres in structure-of-arrays, padded to a multiple of 4 for the SSE loop of cullRange().
+struct CullSpheres
+{
+	std::vector<float> x;
+	std::vector<float> y;
+	std::vector<float> z;
+	std::vector<float> radius;
+};
 
-	// Front Face
-	-0.5f * scale, -0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 1.0f,    0.0f, 0.0f,  0.0f, 0.0f,  1.0f,  // Front-left-bottom
-	 0.5f * scale, -0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 1.0f,    1.0f, 0.0f,  0.0f, 0.0f,  1.0f,  // Front-right-bottom
-	 0.5f * scale,  0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 1.0f,    1.0f, 1.0f,  0.0f, 0.0f,  1.0f,  // Front-right-top
-	-0.5f * scale,  0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 1.0f,    0.0f, 1.0f,  0.0f, 0.0f,  1.0f,  // Front-left-top
+// 32 bytes, two per cache line.
+struct BvhNode
+{
+	float boundsMin[3];
+	int index; // Inner nodes: the right child, the left child follows its parent. Leaves: the first slot.
+	float boundsMax[3];
+	int count; // Objects of a leaf, 0 for inner nodes.
+};
 
-	// Left Face
-	-0.5f * scale, -0.5f * scale, -0.5f * scale,  0.0f, 1.0f, 0.0f,    0.0f, 0.0f,  -1.0f, 0.0f, 0.0f,  // Back-left-bottom
-	-0.5f * scale, -0.5f * scale,  0.5f * scale,  0.0f, 1.0f, 0.0f,    1.0f, 0.0f,  -1.0f, 0.0f, 0.0f,  // Front-left-bottom
-	-0.5f * scale,  0.5f * scale,  0.5f * scale,  0.0f, 1.0f, 0.0f,    1.0f, 1.0f,  -1.0f, 0.0f, 0.0f,  // Front-left-top
-	-0.5f * scale,  0.5f * scale, -0.5f * scale,  0.0f, 1.0f, 0.0f,    0.0f, 1.0f,  -1.0f, 0.0f, 0.0f,  // Back-left-top
+// Bounding volume hierarchy with the nodes in depth-first order. Every leaf owns BVH_LEAF_SIZE consecutive slots, so the objects
+// of a subtree are a contiguous slot range.
+struct Bvh
+{
+	std::vector<BvhNode> nodes;
+	std::vector<int> objects; // Object per slot, -1 for padding.
+	std::vector<int> slots; // Slot per object.
+	std::vector<glm::vec3> boundsMin; // Per slot
+	std::vector<glm::vec3> boundsMax;
+	CullSpheres spheres; // Per slot, around the bounds.
+};
 
-	// Right Face
-	 0.5f * scale, -0.5f * scale, -0.5f * scale,  0.0f, 0.0f, 1.0f,    0.0f, 0.0f,   1.0f, 0.0f, 0.0f,  // Back-right-bottom
-	 0.5f * scale, -0.5f * scale,  0.5f * scale,  0.0f, 0.0f, 1.0f,    1.0f, 0.0f,   1.0f, 0.0f, 0.0f,  // Front-right-bottom
-	 0.5f * scale,  0.5f * scale,  0.5f * scale,  0.0f, 0.0f, 1.0f,    1.0f, 1.0f,   1.0f, 0.0f, 0.0f,  // Front-right-top
-	 0.5f * scale,  0.5f * scale, -0.5f * scale,  0.0f, 0.0f, 1.0f,    0.0f, 1.0f,   1.0f, 0.0f, 0.0f,  // Back-right-top
+struct BvhReference
+{
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
+	glm::vec3 centroid;
+	int object;
+};
 
-	 // Top Face
-	 -0.5f * scale,  0.5f * scale, -0.5f * scale,  1.0f, 1.0f, 0.0f,    0.0f, 0.0f,   0.0f, 1.0f, 0.0f,  // Back-left-top
-	  0.5f * scale,  0.5f * scale, -0.5f * scale,  1.0f, 1.0f, 0.0f,    1.0f, 0.0f,   0.0f, 1.0f, 0.0f,  // Back-right-top
-	  0.5f * scale,  0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 0.0f,    1.0f, 1.0f,   0.0f, 1.0f, 0.0f,  // Front-right-top
-	 -0.5f * scale,  0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 0.0f,    0.0f, 1.0f,   0.0f, 1.0f, 0.0f,  // Front-left-top
+// Node above the subtrees built by tasks.
+struct BvhBuildNode
+{
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
+	int left;
+	int right;
+	int task; // -1 for inner nodes.
+};
 
-	 // Bottom Face
-	 -0.5f * scale, -0.5f * scale, -0.5f * scale,  0.5f, 0.5f, 0.5f,    0.0f, 1.0f,   0.0f, -1.0f, 0.0f,  // Back-left-bottom
-	  0.5f * scale, -0.5f * scale, -0.5f * scale,  0.5f, 0.5f, 0.5f,    1.0f, 1.0f,   0.0f, -1.0f, 0.0f,  // Back-right-bottom
-	  0.5f * scale, -0.5f * scale,  0.5f * scale,  0.5f, 0.5f, 0.5f,    1.0f, 0.0f,   0.0f, -1.0f, 0.0f,  // Front-right-bottom
-	 -0.5f * scale, -0.5f * scale,  0.5f * scale,  0.5f, 0.5f
+struct BvhTask
+{
+	int begin;
+	int end;
+	int depth;
+	std::vector<BvhNode> nodes;
+};
+
+struct BvhBuild
+{
+	std::vector<BvhReference> references;
+	std::vector<BvhBuildNode> top;
+	std::vector<BvhTask> tasks;
+};
+
+// One frame for the occlusion culler, the pointed to instances don't change while it runs.
+struct OcclusionJob
+{
+	glm::mat4 camMatrix;
+	glm::mat4 model;
+	glm::mat4 lightModel;
+	glm::vec3 camPos;
+	std::vector<int> candidates; // Instances inside the frustum.
+	bool lightCandidate;
+	const std::vector<glm::mat4>* transforms;
+	const Bvh* bvh;
+};
+
+// Rasterizes the nearest instances into a small depth buffer in a job and tests the other candidates against its Hi-Z
+// pyramid. display() applies the result to the next frame.
+struct OcclusionCuller
+{
+	JobCounter pending; // The job of the last frame, the other members belong to it while it runs.
+	OcclusionJob job;
+	std::vector<unsigned char> occluded; // Per instance, result of the last job.
+	bool lightOccluded;
+
+	std::vector<glm::vec3> occluderVertices; // Object space
+	std::vector<GLuint> occluderIndices;
+	glm::vec3 lightBoundsMin;
+	glm::vec3 lightBoundsMax;
+	std::vector<std::vector<float>> levels; // Hi-Z pyramid, level 0 is the depth buffer.
+	std::vector<int> levelWidth;
+	std::vector<int> levelHeight;
+};
+
+// Input sampled by the main thread, applied on the next tick.
+struct SimulationInput
+{
+	glm::vec3 move; // Camera space (x right, y up, z forward), -1, 0 or 1 per axis.
+	bool fast;
+	float lookX; // Degrees accumulated since the last tick.
+	float lookY;
+};
+
+// State after a tick, never changed once published.
+struct SimulationSnapshot
+{
+	long long tick;
+	std::chrono::steady_clock::time_point time; // When the tick was due.
+	glm::vec3 camPos;
+	glm::vec3 orientation;
+	float turntableAngle; // Degrees
+};
+
+// Fixed-timestep update thread. Snapshots go through a triple buffer: the simulation writes one slot, the render thread reads
+// another and the third holds the newest, the simulation swaps it in with one atomic exchange and the render thread out.
+struct Simulation
+{
+	std::thread thread;
+	std::atomic<bool> finished;
+	bool running;
+	std::mutex mutex;
+	SimulationInput input;
+	SimulationSnapshot slots[3];
+	std::atomic<int> latest; // Slot of the newest snapshot, with SIMULATION_FRESH until the render thread takes it.
+	int writing; // Simulation thread only.
+
+	// Render thread only.
+	int reading;
+	SimulationSnapshot previous; // Interpolated between.
+	SimulationSnapshot current;
+};
+
+// Transform hierarchy in structure-of-arrays. Slots are sorted by depth and the children of a slot are adjacent, node
+// handles stay valid across sorts.
+struct SceneGraph
+{
+	std::vector<glm::mat4> local; // Per slot
+	std::vector<glm::mat4> world;
+	std::vector<int> parent; // Slot, -1 for roots.
+	std::vector<int> depth;
+	std::vector<int> firstChild; // Slot
+	std::vector<int> childCount;
+	std::vector<unsigned char> dirty;
+	std::vector<int> node; // Slot to node handle.
+	std::vector<int> slot; // Node handle to slot.
+	std::vector<int> levelStart; // First slot of every depth, then the slot count.
+	std::vector<int> dirtySlots;
+	std::vector<std::vector<int>> levelSeeds; // Dirty slots of every depth, scratch of sceneUpdate().
+	bool sorted;
+};
+
+struct CameraKey
+{
+	glm::vec3 position;
+	glm::vec3 orientation;
+};
+
+struct OffscreenTarget
+{
+	GLuint FBO;
+	GLuint colorBuffer;
+	GLuint depthBuffer;
+};
+
+struct OutputFrame
+{
+	int index;
+	std::vector<unsigned char> pixels; // RGBA8, bottom row first as read by glReadPixels.
 };
 
-GLuint objectCubeIndices[] = {
-	// Back face
-	0, 1, 2,
-	0, 2, 3,
-	// Front face
-	4, 5, 6,
-	4, 6, 7,
-	// Left face
-	8, 9, 10,
-	8, 10, 11,
-	// Right face
-	12, 13, 14,
-	12, 14, 15,
-	// Top face
-	16, 17, 18,
-	16, 18, 19,
-	// Bottom face
-	20, 21, 22,
-	20, 22, 23
-};
+// Background thread writing the frames of the headless mode to disk.
+struct FrameWriter
+{
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<OutputFrame> queue;
+	bool finished;
+	std::string prefix;
+	bool raw;
+	int width;
+	int height;
+};
+
+// CPU backend for machines without a GPU, follows the GL path draw for draw.
+enum SoftwareShader
+{
+	SOFTWARE_SHADER_PHONG, // fragmentShaderCode
+	SOFTWARE_SHADER_LIGHT // fragmentShaderLightCode
+};
+
+struct SoftwareTexture
+{
+	int width;
+	int height;
+	std::vector<unsigned char> pixels; // RGBA8, bottom row first like glTexImage2D.
+};
+
+struct SoftwareDraw
+{
+	ObjectData object;
+	glm::mat4 model;
+	const glm::mat4* instances; // NULL draws the object once.
+	int instanceCount;
+	SoftwareShader shader;
+};
+
+struct SoftwareVertex
+{
+	glm::vec4 clip;
+	float varyings[SOFTWARE_VARYINGS];
+};
+
+struct SoftwareTriangle
+{
+	float x[3], y[3], z[3], invW[3];
+	float varyings[3][SOFTWARE_VARYINGS];
+	float edgeA[3], edgeB[3], edgeC[3];
+	bool topLeft[3];
+	float zPlane[3];
+	float zMin;
+	float invArea;
+	int minX, minY, maxX, maxY;
+	SoftwareShader shader;
+};
+
+struct SoftwareChunk
+{
+	int draw;
+	int firstInstance;
+	int instanceCount;
+	std::vector<SoftwareTriangle> triangles;
+	std::vector<std::vector<unsigned int>> bins; // Triangle indices per tile.
+};
+
+struct SoftwareRenderer
+{
+	int width;
+	int height;
+	int pitch; // Width and height padded to SOFTWARE_BLOCK_SIZE.
+	int paddedHeight;
+	int tilesX;
+	int tilesY;
+	std::vector<unsigned int> color; // RGBA8, top row first.
+	std::vector<float> depth;
+	std::vector<const SoftwareTriangle*> visible; // Nearest triangle per pixel, shaded once the tile is done.
+	std::vector<float> blockMaxDepth;
+	std::vector<SoftwareChunk> chunks;
+	int activeChunks;
+	FrameConstants constants;
+	const SoftwareTexture* texture;
+};
+
+struct FrameStats
+{
+	unsigned int driverCalls;
+	unsigned int uniformCalls;
+	unsigned int drawCalls;
+	unsigned int culledObjects;
+	unsigned int occludedObjects;
+	unsigned int avoidedStateChanges; // Binds and uniforms the state cache skipped.
+	unsigned int streamStalls; // Stream buffer writes that waited for the GPU.
+};
+
+// Passes of display() timed by the profiler, they never nest (one GL_TIME_ELAPSED query can be active).
+enum ProfileScope
+{
+	PROFILE_CLEAR,
+	PROFILE_SETUP,
+	PROFILE_CULL,
+	PROFILE_PYRAMID,
+	PROFILE_LIGHT,
+	PROFILE_SWAP,
+	PROFILE_COUNT
+};
+
+struct ProfileSample
+{
+	double cpu[PROFILE_COUNT];
+	double gpu[PROFILE_COUNT];
+};
+
+struct Profiler
+{
+	GLuint queries[PROFILER_FRAMES][PROFILE_COUNT];
+	bool issued[PROFILER_FRAMES][PROFILE_COUNT];
+	double cpu[PROFILER_FRAMES][PROFILE_COUNT];
+	std::chrono::steady_clock::time_point begin[PROFILER_FRAMES][PROFILE_COUNT];
+	int frame;
+	int slot;
+
+	ProfileSample history[PROFILER_HISTORY];
+	int historyCount;
+	int historyNext;
+	int dropped;
+};
+
+// Bindings last made through the cache, they start out as the GL defaults.
+struct GLStateCache
+{
+	GLuint program;
+	GLuint vertexArray;
+	GLuint texture; // GL_TEXTURE_2D of unit 0, the only unit in use.
+	glm::mat4 model; // DrawConstants bound at drawConstants.
+	GLintptr drawConstants; // Offset in streamBuffer, -1 until a draw of the frame binds one.
+};
+
+// Block of an OffsetHeap, linked to its neighbours by offset and, while free, to the other free blocks of its bin.
+struct HeapNode
+{
+	GLuint offset;
+	GLuint size;
+	int prevPhysical;
+	int nextPhysical;
+	int prevFree;
+	int nextFree;
+	bool used;
+};
+
+// Two-level segregated fit allocator over a range of units, it only keeps the bookkeeping. Allocations are node indices,
+// which stay valid until they are freed, also across heapCompact().
+struct OffsetHeap
+{
+	std::vector<HeapNode> nodes;
+	std::vector<int> spare; // Unused entries of nodes.
+	unsigned int firstLevel; // Bit per first level with a non-empty bin.
+	unsigned int secondLevel[HEAP_FIRST_LEVELS]; // Bit per non-empty bin.
+	int freeHeads[HEAP_BINS];
+	int first; // Physical order
+	int last;
+	GLuint capacity;
+	GLuint freeUnits;
+};
+
+struct HeapMove
+{
+	GLuint from;
+	GLuint to;
+	GLuint size;
+};
+
+// Vertex buffer and vertex array shared by every mesh of one vertex format, heap units are vertices.
+struct GeometryPool
+{
+	VertexLayout layout;
+	GLuint vertexArray;
+	GLuint buffer;
+	OffsetHeap heap;
+};
+
+struct GpuMesh
+{
+	int pool; // -1 once removed.
+	int vertices; // Allocation in the heap of the pool, its offset is the base vertex.
+	int indices; // Allocation in the index heap, its offset is the first index.
+	GLsizei indexCount;
+};
+
+// Meshes suballocated from a few large buffers: one vertex buffer per vertex format and one index buffer for all. Meshes are
+// added before the render thread starts, the offsets are looked up when the draws are replayed.
+struct Geometry
+{
+	std::vector<GeometryPool> pools;
+	GLuint indexBuffer;
+	OffsetHeap indexHeap; // Units are GLuint indices.
+	std::vector<GpuMesh> meshes; // Indexed by handle.
+};
+
+// Frame of stream buffer data the GPU may still read. end < begin when the frame wrapped around.
+struct StreamRegion
+{
+	size_t begin;
+	size_t end;
+	GLsync fence;
+};
+
+// Ring for data written once per frame or per draw. With ARB_buffer_storage it stays mapped and fences tell which frames
+// the GPU is done with, otherwise every write maps its range unsynchronized and the buffer is orphaned when it wraps at the
+// start of a frame.
+struct StreamBuffer
+{
+	GLuint buffer;
+	size_t size;
+	bool persistent;
+	unsigned char* mapped; // Persistent mapping of the whole buffer.
+	GLint uniformAlignment; // GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+	PFNGLBUFFERSTORAGEPROC bufferStorage;
+
+	size_t head; // Next free byte.
+	size_t frameBegin; // Where the data of the current frame starts.
+	size_t frameBytes; // Written by the current frame, alignment and skipped tails included.
+	size_t lastFrameBytes;
+	std::deque<StreamRegion> regions; // Oldest first.
+	std::vector<GLuint> retired; // Outgrown buffers, still bound until the frame ends.
+	GLuint vertexArray; // Sources streamed draws, pointed at the ring by each of them.
+	GLuint enabledAttributes; // Bit per attribute location enabled on vertexArray.
+};
+
+enum RenderPass
+{
+	RENDER_PASS_OPAQUE
+};
+
+struct DrawItem
+{
+	unsigned long long key;
+	const ProgramInfo* program;
+	GLuint vertexArray;
+	int texture; // Streamed texture handle, resolved when the draw is replayed. -1 when the program samples none.
+	int mesh; // Geometry handle, resolved when the draw is replayed.
+	GLsizei instances; // 0 draws without instancing.
+	glm::mat4 model;
+	ProfileScope scope;
+};
+
+struct RenderQueue
+{
+	std::vector<DrawItem> items;
+};
+
+enum CommandType
+{
+	COMMAND_CLEAR,
+	COMMAND_USE_PROGRAM,
+	COMMAND_BIND_TEXTURE,
+	COMMAND_BIND_VERTEX_ARRAY,
+	COMMAND_SET_MODEL,
+	COMMAND_DRAW,
+	COMMAND_DRAW_STREAMED,
+	COMMAND_UPDATE_BUFFER,
+	COMMAND_BIND_CONSTANTS,
+	COMMAND_PROFILE_BEGIN,
+	COMMAND_PROFILE_END,
+	COMMAND_CALLBACK,
+	COMMAND_SWAP
+};
+
+struct CommandHeader
+{
+	CommandType type;
+	unsigned int size; // Bytes to the next command.
+};
+
+struct ClearCommand
+{
+	float color[4];
+	GLbitfield mask;
+};
+
+struct ProgramCommand
+{
+	const ProgramInfo* program;
+};
+
+struct TextureCommand
+{
+	int texture; // Streamed texture handle
+};
+
+struct VertexArrayCommand
+{
+	GLuint vertexArray;
+};
+
+struct ModelCommand
+{
+	float model[16]; // Column major, glm::mat4 isn't trivially copyable.
+};
+
+struct DrawCommand
+{
+	int mesh;
+	GLsizei instances; // 0 draws without instancing.
+};
+
+// Followed by vertexBytes of vertices in layout and indexCount GLuint indices, which are streamed and drawn in place.
+struct StreamedDrawCommand
+{
+	const VertexLayout* layout;
+	GLenum mode;
+	GLsizeiptr vertexBytes;
+	GLsizei indexCount;
+};
+
+// Followed by size bytes of data, which are staged in the stream buffer and copied into buffer.
+struct BufferCommand
+{
+	GLuint buffer;
+	GLsizeiptr size;
+};
+
+// Followed by size bytes of data, which are streamed and bound as the uniform block at binding.
+struct ConstantsCommand
+{
+	GLuint binding;
+	GLsizeiptr size;
+};
+
+struct ProfileCommand
+{
+	ProfileScope scope;
+};
+
+// GL work that isn't worth a command of its own, runs on the GL thread during the replay.
+struct CallbackCommand
+{
+	void (*function)(void* data);
+	void* data;
+};
+
+struct SwapCommand
+{
+	GLFWwindow* window;
+};
+
+// GL work of one frame as POD commands in one linear allocation. Anything the commands point to has to stay valid until the
+// replay, data for buffer uploads is copied in.
+struct CommandBuffer
+{
+	std::vector<unsigned char> memory; // Keeps the size of the largest frame.
+	size_t used;
+	std::chrono::steady_clock::time_point started; // When recording began.
+	unsigned int culledObjects; // Counted while recording, part of the frameStats of the replay.
+	unsigned int occludedObjects;
+};
+
+struct CompletedFrame
+{
+	FrameStats stats;
+	double latency; // Milliseconds from the start of recording to the end of the replay.
+};
+
+// Replays command buffers on a thread that holds the GL context, while the main thread records the next frame. Without the
+// thread the buffers replay on the main thread as soon as they are submitted.
+struct Renderer
+{
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool finished;
+	bool running;
+	GLFWwindow* window;
+	CommandBuffer buffers[RENDER_BUFFERS];
+	int recording; // Main thread only.
+	int submitted; // Waiting for or in replay, -1 when the render thread is idle.
+	bool collect; // Keep the completed frames for the benchmark.
+	std::vector<CompletedFrame> completed;
+};
+
+// Complete ("X") event, times are microseconds since traceStart().
+struct TraceEvent
+{
+	const char* name; // String literals only, they are written out later by the flush thread.
+	const char* category;
+	double start;
+	double duration;
+	int track;
+};
+
+// Ring written by one thread and drained by the flush thread.
+struct TraceBuffer
+{
+	TraceEvent events[TRACE_BUFFER_EVENTS];
+	std::atomic<unsigned int> head;
+	std::atomic<unsigned int> tail;
+	std::atomic<unsigned int> dropped;
+	int id;
+	const char* name;
+};
+
+struct Tracer
+{
+	std::atomic<bool> enabled;
+	std::atomic<bool> stopping;
+	int generation;
+	std::chrono::steady_clock::time_point start;
+
+	std::mutex registry; // Only taken when a thread records its first event or exits.
+	TraceBuffer* buffers[TRACE_MAX_THREADS];
+	std::atomic<int> bufferCount;
+	std::vector<TraceBuffer*> freeBuffers;
+
+	std::thread flushThread;
+	FILE* file;
+	bool firstEvent;
+};
+
+struct TraceThread
+{
+	TraceBuffer* buffer;
+	int generation;
+	~TraceThread();
+};
+
+// Records the lifetime of the block as one trace event.
+struct TraceZone
+{
+	const char* name;
+	const char* category;
+	std::chrono::steady_clock::time_point start;
+	TraceZone(const char* name, const char* category = "cpu");
+	~TraceZone();
+};
+
+// Ring slot, sequence follows the bounded MPMC queue of D. Vyukov (driver threads may call back concurrently).
+struct DebugMessage
+{
+	std::atomic<unsigned int> sequence;
+	GLenum source;
+	GLenum type;
+	GLenum severity;
+	GLuint id;
+	char text[DEBUG_MESSAGE_LENGTH];
+};
+
+struct DebugOutput
+{
+	bool enabled;
+	DebugMessage messages[DEBUG_RING_MESSAGES];
+	std::atomic<unsigned int> tail; // Next slot claimed by the callback.
+	unsigned int head; // Next slot reported, GL-context thread only.
+	std::atomic<unsigned int> dropped;
+};
+
+struct TextureJob
+{
+	int texture;
+	std::string path;
+};
+
+struct TextureLevel
+{
+	int width;
+	int height;
+	size_t offset;
+	size_t size;
+};
+
+// Block compressed mip chain, level 0 first.
+struct CompressedImage
+{
+	GLenum format;
+	std::vector<unsigned char> data;
+	std::vector<TextureLevel> levels;
+};
+
+// RGBA8 rows bottom first from stbi_load, or the cooked mip chain when pixels is NULL (both empty when loading failed).
+struct DecodedImage
+{
+	int texture;
+	int width;
+	int height;
+	unsigned char* pixels;
+	CompressedImage compressed;
+};
+
+struct StreamedTexture
+{
+	GLuint id;
+	bool ready;
+};
+
+// Decodes in background jobs, uploads on the GL thread through PBOs within a per-frame budget.
+struct TextureStreamer
+{
+	JobCounter decodes; // Background jobs in flight.
+	std::mutex mutex;
+	std::deque<DecodedImage> decoded;
+	bool compressed; // S3TC is supported, textures go through the cooked cache.
+
+	// GL thread only.
+	std::vector<StreamedTexture> textures;
+	GLuint placeholder;
+	GLuint PBOs[TEXTURE_UPLOAD_PBOS];
+	int nextPBO;
+	DecodedImage upload;
+	int uploadedRows;
+	int uploadedLevels;
+	bool uploading;
+	int pending;
+};
+
+// Times one pass on the CPU and the GPU for the lifetime of the block.
+struct ProfileZone
+{
+	CommandBuffer& commands;
+	ProfileScope scope;
+	TraceZone trace;
+	ProfileZone(CommandBuffer& commands, ProfileScope scope);
+	~ProfileZone();
+};
+
+// Functions
+void display(GLFWwindow* window, const ProgramInfo& program, const ProgramInfo& lightShader, GLuint VAO, GLuint LVAO, 
+	bool readInputs = true);
+glm::mat4 cameraMatrix();
+FrameConstants buildFrameConstants();
+void updateTransforms();
+
+GLuint programInit(const char* vertexShaderCode, const char* fragmentShaderCode);
+ProgramInfo programReflect(GLuint program);
+void terminateProgram(GLuint program);
+
+void bindUniformBlock(GLuint program, const char* name, GLint size, GLuint binding);
+
+
+GLuint createInstanceBuffer(GLuint VAO, const std::vector<glm::mat4>& instances);
+void updateInstanceBuffer(GLuint buffer, const std::vector<glm::mat4>& instances);
+std::vector<glm::mat4> instanceGrid(int count, float spacing);
+void benchmarkInstances(GLFWwindow* window, const ProgramInfo& program, const ProgramInfo& lightShader, GLuint VAO, 
+	GLuint LVAO);
+
+AppOptions parseArguments(int argc, char** argv);
+
+void jobSystemInit(int threads);
+void jobSystemTerminate();
+void jobWorkerLoop(int worker);
+bool jobPush(JobDeque& deque, Job* job);
+Job* jobPop(JobDeque& deque);
+Job* jobSteal(JobDeque& deque);
+Job* jobFind(bool background);
+void jobExecute(Job* job);
+void jobWake();
+void jobSubmit(const std::function<void()>& function, JobCounter* counter, const JobCounter* dependency = NULL);
+void jobSubmitBackground(const std::function<void()>& function, JobCounter* counter);
+void jobWait(const JobCounter& counter);
+void parallelFor(int count, const std::function<void(int)>& body);
+int jobsBenchmark(const AppOptions& options);
+
+unsigned int packColor(float r, float g, float b, float a);
+SoftwareRenderer createSoftwareRenderer(int width, int height);
+int clipNearPlane(const SoftwareVertex input[3], SoftwareVertex output[4]);
+bool setupTriangle(const SoftwareRenderer& renderer, const SoftwareVertex* v[3], SoftwareShader shader, 
+	SoftwareTriangle& tri);
+void softwareGeometry(SoftwareRenderer& renderer, const SoftwareDraw& draw, SoftwareChunk& chunk);
+glm::vec4 sampleTexture(const SoftwareTexture& texture, float s, float t);
+unsigned int softwareShade(const SoftwareRenderer& renderer, const SoftwareTriangle& tri, const float lambda[3]);
+void softwareRasterTriangle(SoftwareRenderer& renderer, const SoftwareTriangle& tri, int tileX, int tileY);
+void softwareRasterTile(SoftwareRenderer& renderer, int tile);
+void softwareRender(SoftwareRenderer& renderer, const std::vector<SoftwareDraw>& draws, const FrameConstants& constants);
+bool writePPM(const char* path, int width, int height, int pitch, const unsigned int* pixels);
+int softwareMain(const AppOptions& options);
+
+bool headlessInit();
+void headlessTerminate();
+void scriptedCamera(int frame, int frames);
+OffscreenTarget createOffscreenTarget(int width, int height);
+void terminateOffscreenTarget(OffscreenTarget target);
+void renderHeadless(const AppOptions& options, const ProgramInfo& program, const ProgramInfo& lightShader, GLuint VAO, 
+	GLuint LVAO);
+void frameWriterStart(FrameWriter& writer, const std::string& prefix, bool raw, int width, int height);
+void frameWriterPush(FrameWriter& writer, OutputFrame&& frame);
+void frameWriterStop(FrameWriter& writer);
+unsigned int crc32(unsigned int crc, const unsigned char* data, size_t size);
+bool writePNG(const char* path, int width, int height, const unsigned char* pixels);
+bool writeRaw(const char* path, int width, int height, const unsigned char* pixels);
+
+std::vector<CameraKey> loadCameraPath(const char* path);
+void recordCameraKey(FILE* file);
+double percentile(const std::vector<double>& sorted, double p);
+void runBenchmark(GLFWwindow* window, const AppOptions& options, const ProgramInfo& program, const ProgramInfo& lightShader, 
+	GLuint VAO, GLuint LVAO);
+
+void profilerInit(Profiler& profiler);
+void profilerTerminate(Profiler& profiler);
+void profilerFrame(Profiler& profiler);
+void profilerBegin(Profiler& profiler, ProfileScope scope);
+void profilerEnd(Profiler& profiler, ProfileScope scope);
+ProfileSample profilerAverage(const Profiler& profiler);
+void profilerLog(const Profiler& profiler);
+
+void traceStart(const char* path);
+void traceStop();
+TraceBuffer* traceBuffer();
+void traceThreadName(const char* name);
+double traceTime(std::chrono::steady_clock::time_point time);
+void traceRecord(const char* name, const char* category, double start, double duration, int track = -1);
+void traceRecordSince(const char* name, std::chrono::steady_clock::time_point start, const char* category = "cpu");
+void traceFlush();
+
+void* glProcAddress(const char* name);
+bool glExtensionSupported(const char* name);
+bool debugOutputInit();
+void APIENTRY debugCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, 
+	const void* userParam);
+const char* debugTypeString(GLenum type);
+void debugOutputFlush();
+
+void textureStreamerInit(TextureStreamer& streamer);
+void textureStreamerTerminate(TextureStreamer& streamer);
+void textureDecode(TextureStreamer& streamer, const TextureJob& job);
+int textureRequest(TextureStreamer& streamer, const std::string& path);
+GLuint streamedTexture(const TextureStreamer& streamer, int handle);
+void textureStreamerUpdate(TextureStreamer& streamer);
+void textureStreamerFinish(TextureStreamer& streamer);
+
+bool readFile(const std::string& path, std::vector<unsigned char>& data);
+unsigned long long contentHash(const unsigned char* data, size_t size);
+std::string cacheFilePath(const std::string& path, unsigned long long hash, const char* extension);
+void downsample(const unsigned char* src, int width, int height, unsigned char* dst);
+unsigned short packColor565(const unsigned char* color);
+void unpackColor565(unsigned short packed, int* color);
+void encodeColorBlock(const unsigned char* block, unsigned char* out);
+void encodeAlphaBlock(const unsigned char* block, unsigned char* out);
+void cookTexture(const unsigned char* pixels, int width, int height, CompressedImage& image);
+bool writeKTX2(const std::string& path, const CompressedImage& image);
+bool readKTX2(const std::string& path, CompressedImage& image);
+bool loadCookedTexture(const std::string& path, CompressedImage& image, bool* cooked);
+int cookMain(const AppOptions& options);
+
+bool mapFile(const char* path, MappedFile& file);
+void unmapFile(MappedFile& file);
+const VertexAttribute* findAttribute(const VertexLayout& layout, GLuint location);
+void objectBounds(const ObjectData& object, glm::vec3& boundsMin, glm::vec3& boundsMax);
+bool writeMesh(const char* path, const ObjectData& object);
+bool loadMesh(const char* path, Mesh& mesh);
+bool loadMesh(const char* name, const ObjectData& builtIn, VertexFormat format, Mesh& mesh);
+void terminateMesh(Mesh& mesh);
+
+const char* parseFloat(const char* p, const char* end, float& value);
+const char* parseInt(const char* p, const char* end, int& value);
+int objIndex(int index, int seen);
+void parseObjChunk(const char* begin, const char* end, ObjChunk& chunk);
+unsigned int objCornerHash(const ObjCornerKey& key);
+void generateNormals(ImportedMesh& mesh);
+bool importObj(const MappedFile& file, ImportedMesh& mesh);
+const char* parseJson(const char* p, const char* end, JsonValue& value, int depth);
+const JsonValue* jsonMember(const JsonValue* object, const char* key);
+const JsonValue* jsonItem(const JsonValue* array, int index);
+double jsonNumber(const JsonValue* value, double fallback);
+bool decodeBase64(const std::string& text, std::vector<unsigned char>& data);
+bool gltfAccessor(const GltfModel& model, int index, int components, GltfAccessor& accessor);
+bool gltfOptionalAccessor(const GltfModel& model, const JsonValue* index, int components, GltfAccessor& accessor, bool& present);
+float gltfComponent(const GltfAccessor& accessor, size_t element, int component);
+GLuint gltfIndex(const GltfAccessor& accessor, size_t element);
+void gltfCollectNodes(const GltfModel& model, int node, const glm::mat4& parent, std::vector<GltfDraw>& draws, int depth);
+int gltfPrimitive(const GltfModel& model, const GltfDraw& draw, ImportedMesh& out);
+bool importGltf(const char* path, const MappedFile& file, ImportedMesh& mesh);
+unsigned long long gltfBufferHash(const char* path, const MappedFile& file);
+bool importModel(const char* path, const MappedFile& file, ImportedMesh& mesh);
+bool loadModel(const char* path, VertexFormat format, Mesh& mesh);
+
+bool vertexCacheStats(const GLuint* indices, size_t indexCount, size_t vertexCount, float& acmr, float& atvr);
+void tipsify(const GLuint* indices, size_t triangleCount, std::vector<GLuint>& out, std::vector<size_t>& clusters);
+void optimizeMesh(const char* name, void* vertices, size_t vertexCount, const VertexLayout& layout, GLuint* indices, 
+	size_t indexCount);
+
+const VertexLayout& vertexFormatLayout(VertexFormat format);
+__m128i floatToHalf(__m128 value);
+float halfToFloat(unsigned short half);
+__m128i packOctahedral(__m128 x, __m128 y, __m128 z);
+glm::vec3 octahedralDecode(float u, float v);
+bool packVertices(const char* name, const ObjectData& object, VertexFormat format, std::vector<unsigned char>& packed, 
+	ObjectData& out);
+void positionDequantization(const ObjectData& object, glm::vec3& scale, glm::vec3& offset);
+void fetchAttribute(const unsigned char* vertex, const VertexAttribute& attribute, float* out);
+GLuint attributeSize(const VertexAttribute& attribute);
+
+int sceneAddNode(SceneGraph& scene, int parent, const glm::mat4& local);
+void sceneSort(SceneGraph& scene);
+void sceneSetLocal(SceneGraph& scene, int node, const glm::mat4& local);
+const glm::mat4& sceneLocal(const SceneGraph& scene, int node);
+const glm::mat4& sceneWorld(const SceneGraph& scene, int node);
+void sceneTransformRange(SceneGraph& scene, int first, int last);
+int sceneUpdate(SceneGraph& scene);
+void buildScene();
+void syncSceneTransforms();
+int sceneBenchmark(const AppOptions& options);
+
+void frustumPlanes(const glm::mat4& matrix, glm::vec4 planes[6]);
+glm::vec4 boundingSphere(const ObjectData& object);
+CullSpheres cullSpheres(const std::vector<glm::mat4>& transforms, const glm::vec4& sphere);
+int cullRange(const CullSpheres& spheres, const glm::vec4 planes[6], int first, int last, int* visible);
+int frustumCull(const CullSpheres& spheres, const glm::mat4& matrix, std::vector<int>& visible);
+void setInstances(const std::vector<glm::mat4>& instances);
+unsigned int cullDraws();
+std::vector<glm::mat4> visibleTransforms();
+
+void transformBounds(const glm::mat4& transform, const glm::vec3& localMin, const glm::vec3& localMax, glm::vec3& boundsMin, 
+	glm::vec3& boundsMax);
+float bvhArea(const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+int bvhSplit(std::vector<BvhReference>& references, int begin, int end, int depth, glm::vec3& boundsMin, glm::vec3& boundsMax);
+int bvhBuildRecursive(std::vector<BvhReference>& references, int begin, int end, int depth, std::vector<BvhNode>& nodes);
+int bvhBuildTop(BvhBuild& build, int begin, int end, int depth);
+void bvhSetSlot(Bvh& bvh, int slot, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+void bvhAddLeaf(Bvh& bvh, const BvhBuild& build, BvhNode& node);
+void bvhFlatten(Bvh& bvh, BvhBuild& build, int top);
+void bvhBuild(Bvh& bvh, const std::vector<glm::vec3>& boundsMin, const std::vector<glm::vec3>& boundsMax);
+void bvhRefit(Bvh& bvh, const std::vector<glm::vec3>& boundsMin, const std::vector<glm::vec3>& boundsMax);
+int bvhFrustumTest(const BvhNode& node, const glm::vec4 planes[6]);
+int bvhFrustum(const Bvh& bvh, const glm::vec4 planes[6], std::vector<int>& visible);
+bool rayBox(const glm::vec3& origin, const glm::vec3& inverseDirection, const float* boundsMin, const float* boundsMax, 
+	float maxDistance, float& distance);
+int bvhRay(const Bvh& bvh, const glm::vec3& origin, const glm::vec3& direction, float& distance);
+int bvhOverlap(const Bvh& bvh, const glm::vec3& boundsMin, const glm::vec3& boundsMax, std::vector<int>& objects);
+int pickInstance(double x, double y, float& distance);
+void recordPickOutline(CommandBuffer& commands, const ProgramInfo& program);
+int bvhBenchmark(const AppOptions& options);
+
+void occlusionInit(OcclusionCuller& culler, const ObjectData& occluder, const ObjectData& light);
+void occlusionTerminate(OcclusionCuller& culler);
+void occlusionWait(OcclusionCuller& culler);
+int occlusionCull(OcclusionCuller& culler, std::vector<int>& visible, bool& lightVisible);
+void occlusionRun(OcclusionCuller& culler, const OcclusionJob& job, std::vector<unsigned char>& occluded, bool& lightOccluded);
+void occlusionRasterize(OcclusionCuller& culler, const glm::mat4& matrix);
+void occlusionBuildPyramid(OcclusionCuller& culler);
+bool occlusionTest(const OcclusionCuller& culler, const glm::mat4& matrix, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+
+void stateUseProgram(GLStateCache& cache, GLuint program);
+void stateBindVertexArray(GLStateCache& cache, GLuint vertexArray);
+void stateBindTexture(GLStateCache& cache, GLuint texture);
+void stateSetModel(GLStateCache& cache, const glm::mat4& model);
+unsigned long long drawKey(RenderPass pass, GLuint program, GLuint material, GLuint texture, GLuint vertexArray, float depth);
+float viewDepth(const glm::mat4& model);
+void queueDraw(RenderQueue& queue, RenderPass pass, GLuint material, const DrawItem& item);
+void submitQueue(RenderQueue& queue, CommandBuffer& commands);
+
+int lowestBit(unsigned int mask);
+int highestBit(unsigned int value);
+void heapInit(OffsetHeap& heap, GLuint capacity);
+void heapBin(GLuint size, bool roundUp, int& firstLevel, int& secondLevel);
+int heapNewNode(OffsetHeap& heap);
+void heapInsertFree(OffsetHeap& heap, int index);
+void heapRemoveFree(OffsetHeap& heap, int index);
+int heapAllocate(OffsetHeap& heap, GLuint size);
+void heapFree(OffsetHeap& heap, int index);
+void heapGrow(OffsetHeap& heap, GLuint capacity);
+bool heapMakeRoom(OffsetHeap& heap, GLuint size, std::vector<HeapMove>& moves);
+void heapCompact(OffsetHeap& heap, std::vector<HeapMove>& moves);
+GLuint heapLargestFree(const OffsetHeap& heap);
+void geometryInit(Geometry& geometry);
+void geometryTerminate(Geometry& geometry);
+int geometryAdd(Geometry& geometry, const ObjectData& object);
+void geometryRemove(Geometry& geometry, int mesh);
+int geometryAllocate(Geometry& geometry, int pool, GLuint size);
+GLuint geometryRelocate(GLuint buffer, GLuint unitSize, GLuint capacity, const std::vector<HeapMove>& moves);
+void geometryBindPool(Geometry& geometry, GeometryPool& pool);
+GLuint geometryVertexArray(const Geometry& geometry, int mesh);
+int heapBenchmark(const AppOptions& options);
+
+void streamBufferInit(StreamBuffer& ring, size_t size, bool allowPersistent);
+void streamBufferTerminate(StreamBuffer& ring);
+void streamCreateStorage(StreamBuffer& ring, size_t size);
+void streamFrameBegin(StreamBuffer& ring);
+void streamFrameEnd(StreamBuffer& ring);
+GLintptr streamWrite(StreamBuffer& ring, const void* data, size_t size, size_t alignment);
+bool streamOverlaps(size_t begin, size_t end, size_t offset, size_t size);
+void streamWait(StreamBuffer& ring, size_t offset, size_t size);
+
+void commandsReset(CommandBuffer& commands);
+template <typename T>
+void recordCommand(CommandBuffer& commands, CommandType type, const T& command, const void* data = NULL, size_t size = 0);
+void recordBufferUpdate(CommandBuffer& commands, GLuint buffer, const void* data, size_t size);
+void recordConstants(CommandBuffer& commands, GLuint binding, const void* data, size_t size);
+void recordStreamedDraw(CommandBuffer& commands, const VertexLayout& layout, GLenum mode, const void* vertices, size_t vertexBytes, 
+	const GLuint* indices, GLsizei indexCount);
+void streamBindVertices(StreamBuffer& ring, GLStateCache& cache, const VertexLayout& layout);
+void recordCallback(CommandBuffer& commands, void (*function)(void* data), void* data);
+void executeCommands(const CommandBuffer& commands, GLStateCache& cache);
+void renderStart(Renderer& renderer, GLFWwindow* window);
+void renderStop(Renderer& renderer);
+void renderThread(Renderer& renderer);
+CommandBuffer& renderCommands(Renderer& renderer);
+void renderSubmit(Renderer& renderer);
+void renderFinish(Renderer& renderer);
+void renderReplay(Renderer& renderer, CommandBuffer& commands);
+
+void simulationStart(Simulation& simulation);
+void simulationStop(Simulation& simulation);
+void simulationThread(Simulation& simulation);
+void simulationStep(SimulationSnapshot& state, const SimulationInput& input);
+void simulationPublish(Simulation& simulation, const SimulationSnapshot& state);
+void simulationInput(Simulation& simulation, const SimulationInput& input);
+void simulationInterpolate(Simulation& simulation);
+
+void inputs(GLFWwindow* window, CommandBuffer& commands);
+void statsLog(const FrameStats& stats);
+
+void checkShaderCompileErrors(GLuint shader);
+void checkProgramLinkErrors(GLuint program);
+const char* getGLErrorString(GLenum err);
+void checkOpenGLError(void);
+void errorLog(std::string category, std::string type, std::string massage, std::string comment="");
+
+// Global Variables
+glm::vec3 camPos = glm::vec3(0.0f, 0.0f, 2.0f);
+glm::vec3 orientation = glm::vec3(0.0f, 0.0f, -1.0f);
+glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f);
+
+glm::vec4 lightColor = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
+glm::vec3 lightPos = glm::vec3(1.0f, 1.0f, 2.0f);
+glm::mat4 lightModel = glm::mat4(1.0f);
+
+glm::vec3 cubePos = glm::vec3(0.0f, 0.0f, 0.0f);
+glm::mat4 cubeModel = glm::mat4(1.0f);
+
+SceneGraph scene;
+int sceneTurntable, scenePyramid, sceneLight; // Node handles
+
+bool cullingEnabled = true;
+glm::vec3 pyramidBoundsMin, pyramidBoundsMax; // Object space
+std::vector<glm::mat4> instanceTransforms;
+Bvh instanceBvh; // In the space of cubeModel.
+CullSpheres lightSpheres;
+std::vector<int> visibleInstances; // Result of cullDraws().
+std::vector<int> drawnInstances; // Instances in instanceBuffer.
+bool lightVisible = true;
+bool pickKeyDown = false;
+int pickedInstance = -1; // Outlined until the next right click.
+
+OcclusionCuller occlusionCuller;
+bool occlusionEnabled = false;
+
+GLStateCache glState; // GL thread only.
+RenderQueue renderQueue;
+Renderer renderer;
+
+float rotation = 0.0f; // Turntable speed in degrees per second.
+float turntableAngle = 0.0f; // Degrees, interpolated from the simulation.
+float camSpeed = 0.1; // Per tick, 4 times faster with shift.
+float sensitivity = 100.0;
+bool firstClick = true;
+
+Simulation simulation;
+
+TextureStreamer textureStreamer;
+int textureFloatArts;
+GLfloat scale = 1.0f;
+
+float screenColor[4] = { 0.1f, 0.2f, 0.3f, 1.f };
+
+FrameStats frameStats = {};
+FrameStats lastFrameStats = {};
+bool statsKeyDown = false;
+
+Profiler profiler = {};
+const char* profileScopeNames[PROFILE_COUNT] = { "clear", "setup", "cull", "pyramid", "light", "swap" };
+bool profileKeyDown = false;
+
+Tracer tracer;
+thread_local TraceThread traceThread;
+
+JobSystem jobSystem;
+thread_local int jobThread = -1; // Index in jobSystem.deques, -1 outside the job system.
+
+DebugOutput debugOutput;
+
+const char* uniformNames[UNIFORM_COUNT] = { "tex0", "positionScale", "positionOffset" };
+constexpr GLenum uniformTypes[UNIFORM_COUNT] = { GL_SAMPLER_2D, GL_FLOAT_VEC3, GL_FLOAT_VEC3 };
+
+StreamBuffer streamBuffer; // GL thread only.
+GLsizei instanceCount = 1;
+GLuint instanceBuffer = 0;
+Geometry geometry;
+int pyramidGeometry = -1;
+int lightGeometry = -1;
+
+// Layout of the inline arrays: position, color, texture coordinates, normal.
+const VertexLayout vertexLayoutFull = { 11 * sizeof(float), 4, {
+	{ 0, 3, GL_FLOAT, GL_FALSE, 0 },
+	{ 1, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float) },
+	{ 2, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float) },
+	{ 3, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float) } } };
+const VertexLayout vertexLayoutPosition = { 3 * sizeof(float), 1, { { 0, 3, GL_FLOAT, GL_FALSE, 0 } } };
+const VertexLayout vertexLayoutPacked = { 24, 4, {
+	{ 0, 3, GL_FLOAT, GL_FALSE, 0 },
+	{ 1, 4, GL_UNSIGNED_BYTE, GL_TRUE, 12 },
+	{ 2, 2, GL_HALF_FLOAT, GL_FALSE, 16 },
+	{ 3, 4, GL_INT_2_10_10_10_REV, GL_TRUE, 20 } } };
+const VertexLayout vertexLayoutPacked16 = { 20, 4, {
+	{ 0, 4, GL_SHORT, GL_TRUE, 0 }, // w unused
+	{ 1, 4, GL_UNSIGNED_BYTE, GL_TRUE, 8 },
+	{ 2, 2, GL_HALF_FLOAT, GL_FALSE, 12 },
+	{ 3, 4, GL_INT_2_10_10_10_REV, GL_TRUE, 16 } } };
+
+#ifdef __linux__
+EGLDisplay headlessDisplay = EGL_NO_DISPLAY;
+EGLContext headlessContext = EGL_NO_CONTEXT;
+#else
+GLFWwindow* headlessWindow = NULL;
+#endif
+
+ProfileZone::ProfileZone(CommandBuffer& commands, ProfileScope scope) : commands(commands), scope(scope), 
+	trace(profileScopeNames[scope]) {
+	recordCommand(commands, COMMAND_PROFILE_BEGIN, ProfileCommand{ scope });
+}
+
+ProfileZone::~ProfileZone() {
+	recordCommand(commands, COMMAND_PROFILE_END, ProfileCommand{ scope });
+}
+
+// Uniform Setters (the key is checked against uniformTypes at compile time)
+template<UniformKey key> void setUniform(const ProgramInfo& program, const glm::mat4& value) {
+	static_assert(uniformTypes[key] == GL_FLOAT_MAT4, "uniform is not a mat4");
+	if (program.locations[key] < 0) return;
+	frameStats.uniformCalls++;
+	DRIVER_CALL(glUniformMatrix4fv(program.locations[key], 1, GL_FALSE, glm::value_ptr(value)));
+}
+
+template<UniformKey key> void setUniform(const ProgramInfo& program, const glm::vec4& value) {
+	static_assert(uniformTypes[key] == GL_FLOAT_VEC4, "uniform is not a vec4");
+	if (program.locations[key] < 0) return;
+	frameStats.uniformCalls++;
+	DRIVER_CALL(glUniform4f(program.locations[key], value.x, value.y, value.z, value.w));
+}
+
+template<UniformKey key> void setUniform(const ProgramInfo& program, const glm::vec3& value) {
+	static_assert(uniformTypes[key] == GL_FLOAT_VEC3, "uniform is not a vec3");
+	if (program.locations[key] < 0) return;
+	frameStats.uniformCalls++;
+	DRIVER_CALL(glUniform3f(program.locations[key], value.x, value.y, value.z));
+}
+
+template<UniformKey key> void setUniform(const ProgramInfo& program, GLint value) {
+	static_assert(uniformTypes[key] == GL_SAMPLER_2D, "uniform is not a sampler");
+	if (program.locations[key] < 0) return;
+	frameStats.uniformCalls++;
+	DRIVER_CALL(glUniform1i(program.locations[key], value));
+}
+
+const char* vertexShaderCode =
+"#version 330 core\n"
+"layout (location = 0) in vec3 aPos;\n"
+"layout (location = 1) in vec3 aColor;\n"
+"layout (location = 2) in vec2 aTex;\n"
+"layout (location = 3) in vec4 aNormals;\n"
+"layout (location = 4) in mat4 aInstance;\n"
+"layout (std140) uniform FrameConstants\n"
+"{\n"
+"	mat4 camMatrix;\n"
+"	vec4 camPos;\n"
+"	vec4 lightColor;\n"
+"	vec4 lightPos;\n"
+"};\n"
+"layout (std140) uniform DrawConstants\n"
+"{\n"
+"	mat4 model;\n"
+"};\n"
+"uniform vec3 positionScale;\n"
+"uniform vec3 positionOffset;\n"
+"out vec3 color;\n"
+"out vec2 texCoord;\n"
+"out vec3 crnt_pos;\n"
+"out vec3 normals;\n"
+// Packed normals are octahedral with w = 0, float normals read back with w = 1.
+"vec3 octahedralDecode(vec2 e)\n"
+"{\n"
+"	vec3 n = vec3(e, 1.0f - abs(e.x) - abs(e.y));\n"
+"	if (n.z < 0.0f)\n"
+"		n.xy = (1.0f - abs(n.yx)) * vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);\n"
+"	return normalize(n);\n"
+"}\n"
+"void main()\n"
+"{\n"
+"   vec3 position = aPos * positionScale + positionOffset;\n"
+"   crnt_pos = vec3(model * aInstance * vec4(position, 1.0f));\n"
+"	gl_Position = camMatrix * vec4(crnt_pos, 1.0f);\n"
+"	color = aColor;\n"
+"	texCoord = aTex;\n"
+"   normals = aNormals.w > 0.5f ? aNormals.xyz : octahedralDecode(aNormals.xy);\n"
+"}\0;"
+;
+const char* fragmentShaderCode =
+"#version 330 core\n"
+"out vec4 FragColor;\n"
+"in vec3 color;\n"
+"in vec2 texCoord;\n"
+"in vec3 crnt_pos;\n"
+"in vec3 normals;\n"
+"uniform sampler2D tex0;\n"
+"layout (std140) uniform FrameConstants\n"
+"{\n"
+"	mat4 camMatrix;\n"
+"	vec4 camPos;\n"
+"	vec4 lightColor;\n"
+"	vec4 lightPos;\n"
+"};\n"
+"void main()\n"
+"{\n"
+"   float ambient = 0.20;\n"
+
+"   vec3 normal = normalize(normals);\n"
+"   vec3 lightDirection = normalize(lightPos.xyz - crnt_pos);\n"
+"   float diffuse = max(dot(normal, lightDirection), 0.0f);\n"
+
+"   float specularLight = 0.50f;\n"
+"   vec3 viewDirection = normalize(camPos.xyz - crnt_pos);\n"
+"   vec3 reflectionDirection = reflect(-lightDirection, normal);\n"
+"   float specAmount = pow(max(dot(viewDirection, reflectionDirection), 0.0f), 8);\n"
+"   float specular = specAmount * specularLight;\n"
+
+"	FragColor = texture(tex0, texCoord) * lightColor  * (diffuse + ambient + specular);\n"
+"}\n\0;"
+;
+
+const char* vertexShaderLightCode =
+"#version 330 core\n"
+"layout (location = 0) in vec3 aPos;\n"
+"layout (std140) uniform FrameConstants\n"
+"{\n"
+"	mat4 camMatrix;\n"
+"	vec4 camPos;\n"
+"	vec4 lightColor;\n"
+"	vec4 lightPos;\n"
+"};\n"
+"layout (std140) uniform DrawConstants\n"
+"{\n"
+"	mat4 model;\n"
+"};\n"
+"void main()\n"
+"{\n"
+"	gl_Position = camMatrix * model * vec4(aPos, 1.0);\n"
+"}\n\0;"
+;
+const char* fragmentShaderLightCode =
+"#version 330 core\n"
+"out vec4 FragColor;\n"
+"layout (std140) uniform FrameConstants\n"
+"{\n"
+"	mat4 camMatrix;\n"
+"	vec4 camPos;\n"
+"	vec4 lightColor;\n"
+"	vec4 lightPos;\n"
+"};\n"
+"void main()\n"
+"{\n"
+"	FragColor = lightColor;\n"
+"}\n\0;"
+;
+
+GLfloat objectFloatArtsvertices[] = {
+	// Positions          // Colors               // Texture Coordinates           // Normals
+	// Back Face
+	-0.5f * scale, -0.5f * scale, -0.5f * scale,  1.0f, 0.0f, 0.0f,    1.0f, 0.0f,  0.0f, 0.0f, -1.0f,  // Back-left-bottom
+	 0.5f * scale, -0.5f * scale, -0.5f * scale,  1.0f, 0.0f, 0.0f,     0.0f, 0.0f,  0.0f, 0.0f, -1.0f,  // Back-right-bottom
+	 0.5f * scale,  0.5f * scale, -0.5f * scale,  1.0f, 0.0f, 0.0f,     0.0f, 1.0f,  0.0f, 0.0f, -1.0f,  // Back-right-top
+	-0.5f * scale,  0.5f * scale, -0.5f * scale,  1.0f, 0.0f, 0.0f,    1.0f, 1.0f,  0.0f, 0.0f, -1.0f,  // Back-left-top
+
+	// Front Face
+	-0.5f * scale, -0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 1.0f,    0.0f, 0.0f,  0.0f, 0.0f,  1.0f,  // Front-left-bottom
+	 0.5f * scale, -0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 1.0f,     1.0f, 0.0f,  0.0f, 0.0f,  1.0f,  // Front-right-bottom
+	 0.5f * scale,  0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 1.0f,     1.0f, 1.0f,  0.0f, 0.0f,  1.0f,  // Front-right-top
+	-0.5f * scale,  0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 1.0f,    0.0f, 1.0f,  0.0f, 0.0f,  1.0f,  // Front-left-top
+
+	// Left Face (no texture)
+	-0.5f * scale, -0.5f * scale, -0.5f * scale,  0.0f, 1.0f, 0.0f,    0.0f, 0.0f,  -1.0f, 0.0f, 0.0f,  // Back-left-bottom
+	-0.5f * scale, -0.5f * scale,  0.5f * scale,  0.0f, 1.0f, 0.0f,    0.0f, 0.0f,  -1.0f, 0.0f, 0.0f,  // Front-left-bottom
+	-0.5f * scale,  0.5f * scale,  0.5f * scale,  0.0f, 1.0f, 0.0f,    0.0f, 0.0f,  -1.0f, 0.0f, 0.0f,  // Front-left-top
+	-0.5f * scale,  0.5f * scale, -0.5f * scale,  0.0f, 1.0f, 0.0f,    0.0f, 0.0f,  -1.0f, 0.0f, 0.0f,  // Back-left-top
+
+	// Right Face (no texture)
+	 0.5f * scale, -0.5f * scale, -0.5f * scale,  0.0f, 0.0f, 1.0f,    0.0f, 0.0f,   1.0f, 0.0f, 0.0f,  // Back-right-bottom
+	 0.5f * scale, -0.5f * scale,  0.5f * scale,  0.0f, 0.0f, 1.0f,    0.0f, 0.0f,   1.0f, 0.0f, 0.0f,  // Front-right-bottom
+	 0.5f * scale,  0.5f * scale,  0.5f * scale,  0.0f, 0.0f, 1.0f,    0.0f, 0.0f,   1.0f, 0.0f, 0.0f,  // Front-right-top
+	 0.5f * scale,  0.5f * scale, -0.5f * scale,  0.0f, 0.0f, 1.0f,    0.0f, 0.0f,   1.0f, 0.0f, 0.0f,  // Back-right-top
+
+	 // Top Face (no texture)
+	  -0.5f * scale,  0.5f * scale, -0.5f * scale,  1.0f, 1.0f, 0.0f,    0.0f, 0.0f,   0.0f, 1.0f, 0.0f,  // Back-left-top
+	   0.5f * scale,  0.5f * scale, -0.5f * scale,  1.0f, 1.0f, 0.0f,    0.0f, 0.0f,   0.0f, 1.0f, 0.0f,  // Back-right-top
+	   0.5f * scale,  0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 0.0f,    0.0f, 0.0f,   0.0f, 1.0f, 0.0f,  // Front-right-top
+	  -0.5f * scale,  0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 0.0f,    0.0f, 0.0f,   0.0f, 1.0f, 0.0f,  // Front-left-top
+
+	  // Bottom Face (no texture)
+	   -0.5f * scale, -0.5f * scale, -0.5f * scale,  0.5f, 0.5f, 0.5f,    0.0f, 0.0f,   0.0f, -1.0f, 0.0f,  // Back-left-bottom
+		0.5f * scale, -0.5f * scale, -0.5f * scale,  0.5f, 0.5f, 0.5f,    0.0f, 0.0f,   0.0f, -1.0f, 0.0f,  // Back-right-bottom
+		0.5f * scale, -0.5f * scale,  0.5f * scale,  0.5f, 0.5f, 0.5f,    0.0f, 0.0f,   0.0f, -1.0f, 0.0f,  // Front-right-bottom
+	   -0.5f * scale, -0.5f * scale,  0.5f * scale,  0.5f, 0.5f, 0.5
+};
+
+GLfloat objectCubeVerticesFull[] = {
+	// Positions          // Colors               // Texture Coordinates      // Normals
+	// Back Face
+	-0.5f * scale, -0.5f * scale, -0.5f * scale,  1.0f, 0.0f, 0.0f,    1.0f, 0.0f,  0.0f, 0.0f, -1.0f,  // Back-left-bottom
+	 0.5f * scale, -0.5f * scale, -0.5f * scale,  1.0f, 0.0f, 0.0f,     0.0f, 0.0f,  0.0f, 0.0f, -1.0f,  // Back-right-bottom
+	 0.5f * scale,  0.5f * scale, -0.5f * scale,  1.0f, 0.0f, 0.0f,     0.0f, 1.0f,  0.0f, 0.0f, -1.0f,  // Back-right-top
+	-0.5f * scale,  0.5f * scale, -0.5f * scale,  1.0f, 0.0f, 0.0f,    1.0f, 1.0f,  0.0f, 0.0f, -1.0f,  // Back-left-top
+
+	// Front Face
+	-0.5f * scale, -0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 1.0f,    0.0f, 0.0f,  0.0f, 0.0f,  1.0f,  // Front-left-bottom
+	 0.5f * scale, -0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 1.0f,    1.0f, 0.0f,  0.0f, 0.0f,  1.0f,  // Front-right-bottom
+	 0.5f * scale,  0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 1.0f,    1.0f, 1.0f,  0.0f, 0.0f,  1.0f,  // Front-right-top
+	-0.5f * scale,  0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 1.0f,    0.0f, 1.0f,  0.0f, 0.0f,  1.0f,  // Front-left-top
+
+	// Left Face
+	-0.5f * scale, -0.5f * scale, -0.5f * scale,  0.0f, 1.0f, 0.0f,    0.0f, 0.0f,  -1.0f, 0.0f, 0.0f,  // Back-left-bottom
+	-0.5f * scale, -0.5f * scale,  0.5f * scale,  0.0f, 1.0f, 0.0f,    1.0f, 0.0f,  -1.0f, 0.0f, 0.0f,  // Front-left-bottom
+	-0.5f * scale,  0.5f * scale,  0.5f * scale,  0.0f, 1.0f, 0.0f,    1.0f, 1.0f,  -1.0f, 0.0f, 0.0f,  // Front-left-top
+	-0.5f * scale,  0.5f * scale, -0.5f * scale,  0.0f, 1.0f, 0.0f,    0.0f, 1.0f,  -1.0f, 0.0f, 0.0f,  // Back-left-top
+
+	// Right Face
+	 0.5f * scale, -0.5f * scale, -0.5f * scale,  0.0f, 0.0f, 1.0f,    0.0f, 0.0f,   1.0f, 0.0f, 0.0f,  // Back-right-bottom
+	 0.5f * scale, -0.5f * scale,  0.5f * scale,  0.0f, 0.0f, 1.0f,    1.0f, 0.0f,   1.0f, 0.0f, 0.0f,  // Front-right-bottom
+	 0.5f * scale,  0.5f * scale,  0.5f * scale,  0.0f, 0.0f, 1.0f,    1.0f, 1.0f,   1.0f, 0.0f, 0.0f,  // Front-right-top
+	 0.5f * scale,  0.5f * scale, -0.5f * scale,  0.0f, 0.0f, 1.0f,    0.0f, 1.0f,   1.0f, 0.0f, 0.0f,  // Back-right-top
+
+	 // Top Face
+	 -0.5f * scale,  0.5f * scale, -0.5f * scale,  1.0f, 1.0f, 0.0f,    0.0f, 0.0f,   0.0f, 1.0f, 0.0f,  // Back-left-top
+	  0.5f * scale,  0.5f * scale, -0.5f * scale,  1.0f, 1.0f, 0.0f,    1.0f, 0.0f,   0.0f, 1.0f, 0.0f,  // Back-right-top
+	  0.5f * scale,  0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 0.0f,    1.0f, 1.0f,   0.0f, 1.0f, 0.0f,  // Front-right-top
+	 -0.5f * scale,  0.5f * scale,  0.5f * scale,  1.0f, 1.0f, 0.0f,    0.0f, 1.0f,   0.0f, 1.0f, 0.0f,  // Front-left-top
+
+	 // Bottom Face
+	 -0.5f * scale, -0.5f * scale, -0.5f * scale,  0.5f, 0.5f, 0.5f,    0.0f, 1.0f,   0.0f, -1.0f, 0.0f,  // Back-left-bottom
+	  0.5f * scale, -0.5f * scale, -0.5f * scale,  0.5f, 0.5f, 0.5f,    1.0f, 1.0f,   0.0f, -1.0f, 0.0f,  // Back-right-bottom
+	  0.5f * scale, -0.5f * scale,  0.5f * scale,  0.5f, 0.5f, 0.5f,    1.0f, 0.0f,   0.0f, -1.0f, 0.0f,  // Front-right-bottom
+	 -0.5f * scale, -0.5f * scale,  0.5f * scale,  0.5f, 0.5f
+};
+
+GLuint objectCubeIndices[] = {
+	// Back face
+	0, 1, 2,
+	0, 2, 3,
+	// Front face
+	4, 5, 6,
+	4, 6, 7,
+	// Left face
+	8, 9, 10,
+	8, 10, 11,
+	// Right face
+	12, 13, 14,
+	12, 14, 15,
+	// Top face
+	16, 17, 18,
+	16, 18, 19,
+	// Bottom face
+	20, 21, 22,
+	20, 22, 23
+};
+
+GLfloat objectPyramidVertices[] =
+{ //     COORDINATES     /        COLORS          /    TexCoord   /        NORMALS       //
+	-0.5f, 0.0f,  0.5f,     0.83f, 0.70f, 0.44f, 	 0.0f, 0.0f,      0.0f, -1.0f, 0.0f, // Bottom side
+	-0.5f, 0.0f, -0.5f,     0.83f, 0.70f, 0.44f,	 0.0f, 5.0f,      0.0f, -1.0f, 0.0f, // Bottom side
+	 0.5f, 0.0f, -0.5f,     0.83f, 0.70f, 0.44f,	 5.0f, 5.0f,      0.0f, -1.0f, 0.0f, // Bottom side
+	 0.5f, 0.0f,  0.5f,     0.83f, 0.70f, 0.44f,	 5.0f, 0.0f,      0.0f, -1.0f, 0.0f, // Bottom side
+
+	-0.5f, 0.0f,  0.5f,     0.83f, 0.70f, 0.44f, 	 0.0f, 0.0f,     -0.8f, 0.5f,  0.0f, // Left Side
+	-0.5f, 0.0f, -0.5f,     0.83f, 0.70f, 0.44f,	 5.0f, 0.0f,     -0.8f, 0.5f,  0.0f, // Left Side
+	 0.0f, 0.8f,  0.0f,     0.92f, 0.86f, 0.76f,	 2.5f, 5.0f,     -0.8f, 0.5f,  0.0f, // Left Side
+
+	-0.5f, 0.0f, -0.5f,     0.83f, 0.70f, 0.44f,	 5.0f, 0.0f,      0.0f, 0.5f, -0.8f, // Non-facing side
+	 0.5f, 0.0f, -0.5f,     0.83f, 0.70f, 0.44f,	 0.0f, 0.0f,      0.0f, 0.5f, -0.8f, // Non-facing side
+	 0.0f, 0.8f,  0.0f,     0.92f, 0.86f, 0.76f,	 2.5f, 5.0f,      0.0f, 0.5f, -0.8f, // Non-facing side
+
+	 0.5f, 0.0f, -0.5f,     0.83f, 0.70f, 0.44f,	 0.0f, 0.0f,      0.8f, 0.5f,  0.0f, // Right side
+	 0.5f, 0.0f,  0.5f,     0.83f, 0.70f, 0.44f,	 5.0f, 0.0f,      0.8f, 0.5f,  0.0f, // Right side
+	 0.0f, 0.8f,  0.0f,     0.92f, 0.86f, 0.76f,	 2.5f, 5.0f,      0.8f, 0.5f,  0.0f, // Right side
+
+	 0.5f, 0.0f,  0.5f,     0.83f, 0.70f, 0.44f,	 5.0f, 0.0f,      0.0f, 0.5f,  0.8f, // Facing side
+	-0.5f, 0.0f,  0.5f,     0.83f, 0.70f, 0.44f, 	 0.0f, 0.0f,      0.0f, 0.5f,  0.8f, // Facing side
+	 0.0f, 0.8f,  0.0f,     0.92f, 0.86f, 0.76f,	 2.5f, 5.0f,      0.0f, 0.5f,  0.8f  // Facing side
+};
+
+// Indices for vertices order
+GLuint objectPyramidIndices[] =
+{
+	0, 1, 2, // Bottom side
+	0, 2, 3, // Bottom side
+	4, 6, 5, // Left side
+	7, 9, 8, // Non-facing side
+	10, 12, 11, // Right side
+	13, 15, 14 // Facing side
+};
+
+GLfloat objectLightVertices[] = {
+	//     COORDINATES        
+	-0.1f, -0.1f,  0.1f,      
+	-0.1f, -0.1f, -0.1f,      
+	 0.1f, -0.1f, -0.1f,      
+	 0.1f, -0.1f,  0.1f,      
+	-0.1f,  0.1f,  0.1f,      
+	-0.1f,  0.1f, -0.1f,     
+	 0.1f,  0.1f, -0.1f,    
+	 0.1f,  0.1f,  0.1f
+};
+
+GLuint objectLightIndices[] =
+{
+	0, 1, 2,
+	0, 2, 3,
+	0, 4, 7,
+	0, 7, 3,
+	3, 7, 6,
+	3, 6, 2,
+	2, 6, 5,
+	2, 5, 1,
+	1, 5, 4,
+	1, 4, 0,
+	4, 5, 6,
+	4, 6, 7
+};
+
+int main(int argc, char** argv) {
+	AppOptions options = parseArguments(argc, argv);
+	if (options.tracePath) {
+		traceStart(options.tracePath);
+		atexit(traceStop);
+		traceThreadName("main");
+	}
+	jobSystemInit(options.threads);
+	atexit(jobSystemTerminate);
+	std::chrono::steady_clock::time_point startup = std::chrono::steady_clock::now();
+	if (options.cookPath)
+		return cookMain(options);
+	if (options.sceneNodes)
+		return sceneBenchmark(options);
+	if (options.bvhObjects)
+		return bvhBenchmark(options);
+	if (options.benchJobs)
+		return jobsBenchmark(options);
+	if (options.heapAllocations)
+		return heapBenchmark(options);
+	if (options.software)
+		return softwareMain(options);
+
+	const char* screenTitle = "Float Arts";
+	int viewPortX1 = 0, viewPortY1 = 0, viewPortX2 = SCREEN_WIDTH, viewPortY2 = SCREEN_HEIGHT;
+
+	GLFWwindow* window = NULL;
+	if (options.headless) {
+		if (!headlessInit())
+			return -1;
+	}
+	else {
+		if (!glfwInit()) {
+			errorLog("PVE", "INIT", "can't initilize glfw.", "");
+			return -1;
+		}
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+#ifndef NDEBUG
+		glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GLFW_TRUE);
+#endif
+
+		window = glfwCreateWindow(SCREEN_WIDTH, SCREEN_HEIGHT, screenTitle, NULL, NULL);
+		if (window == NULL) {
+			errorLog("PVE", "INIT", "can't create window.", "");
+			glfwTerminate();
+			return -1;
+		}
+		glfwMakeContextCurrent(window);
+
+		gladLoadGL();
+	}
+	traceRecordSince("createContext", startup);
+	debugOutputInit();
+	glViewport(viewPortX1, viewPortY1, viewPortX2, viewPortY2);
+
+	// Shader program and Bindings
+	ProgramInfo program = programReflect(programInit(vertexShaderCode, fragmentShaderCode));
+	geometryInit(geometry);
+	//ObjectData floatArtsCube = { objectCubeVerticesFull, sizeof(objectCubeVerticesFull), objectCubeIndices, sizeof(objectCubeIndices), vertexLayoutFull };
+	ObjectData pyramid = { objectPyramidVertices, sizeof(objectPyramidVertices), objectPyramidIndices, sizeof(objectPyramidIndices), 
+		vertexLayoutFull, glm::vec3(0.0f), glm::vec3(0.0f) };
+	Mesh pyramidMesh;
+	if (!options.modelPath || !loadModel(options.modelPath, options.vertexFormat, pyramidMesh))
+		loadMesh("pyramid.mesh", pyramid, options.vertexFormat, pyramidMesh);
+	//pyramidGeometry = geometryAdd(geometry, floatArtsCube);
+	pyramidGeometry = geometryAdd(geometry, pyramidMesh.object);
+	if (pyramidGeometry < 0) {
+		errorLog("PVE", "INIT", "can't upload the model mesh.", "");
+		glfwTerminate();
+		return -1;
+	}
+	GLuint VAO = geometryVertexArray(geometry, pyramidGeometry);
+	glm::vec3 positionScale, positionOffset;
+	positionDequantization(pyramidMesh.object, positionScale, positionOffset);
+	pyramidBoundsMin = pyramidMesh.object.boundsMin;
+	pyramidBoundsMax = pyramidMesh.object.boundsMax;
+	CHECK_GL_ERRORS();
+
+	std::vector<glm::mat4> instances = instanceGrid(options.instances, 1.5f);
+	instanceBuffer = createInstanceBuffer(VAO, instances);
+	setInstances(instances);
+	cullingEnabled = !options.noCull;
+
+	ProgramInfo lightShader = programReflect(programInit(vertexShaderLightCode, fragmentShaderLightCode));
+	ObjectData lightCube = { objectLightVertices, sizeof(objectLightVertices), objectLightIndices, sizeof(objectLightIndices), 
+		vertexLayoutPosition, glm::vec3(0.0f), glm::vec3(0.0f) };
+	Mesh lightMesh;
+	loadMesh("light.mesh", lightCube, options.vertexFormat, lightMesh);
+	lightGeometry = geometryAdd(geometry, lightMesh.object);
+	if (lightGeometry < 0) {
+		errorLog("PVE", "INIT", "can't upload the light mesh.", "");
+		glfwTerminate();
+		return -1;
+	}
+	GLuint LVAO = geometryVertexArray(geometry, lightGeometry);
+	lightSpheres = cullSpheres(std::vector<glm::mat4>(1, glm::mat4(1.0f)), boundingSphere(lightMesh.object));
+	occlusionEnabled = cullingEnabled && !options.noOcclusion;
+	if (occlusionEnabled)
+		occlusionInit(occlusionCuller, pyramidMesh.object, lightMesh.object);
+	terminateMesh(pyramidMesh);
+	terminateMesh(lightMesh);
+	CHECK_GL_ERRORS();
+
+	streamBufferInit(streamBuffer, STREAM_BUFFER_SIZE, !options.noBufferStorage);
+
+	// Light
+	buildScene();
+
+	stateUseProgram(glState, program.id);
+	setUniform<UNIFORM_POSITION_SCALE>(program, positionScale);
+	setUniform<UNIFORM_POSITION_OFFSET>(program, positionOffset);
+
+	// Textures
+	glActiveTexture(GL_TEXTURE0);
+	textureStreamerInit(textureStreamer);
+	textureFloatArts = textureRequest(textureStreamer, "matin_on_the_code.png");
+	if (options.headless || options.benchmarkPath)
+		textureStreamerFinish(textureStreamer); // Every recorded or measured frame has the real textures.
+
+	stateUseProgram(glState, program.id);
+	setUniform<UNIFORM_TEX0>(program, 0);
+	traceRecordSince("startup", startup);
+
+	glEnable(GL_DEPTH_TEST);
+	profilerInit(profiler);
+	if (options.benchmarkPath)
+		runBenchmark(window, options, program, lightShader, VAO, LVAO);
+	else if (options.headless)
+		renderHeadless(options, program, lightShader, VAO, LVAO);
+	else {
+		glfwSwapInterval(1);
+		if (options.benchInstances) {
+			benchmarkInstances(window, program, lightShader, VAO, LVAO);
+			glfwSetWindowShouldClose(window, GLFW_TRUE);
+		}
+
+		FILE* cameraRecord = options.recordPath ? fopen(options.recordPath, "w") : NULL;
+		if (options.recordPath && !cameraRecord)
+			errorLog("AVE", "LOAD", std::string("can't write (") + options.recordPath + ").\n", "");
+
+		simulationStart(simulation);
+		if (!options.noRenderThread)
+			renderStart(renderer, window);
+		while (!glfwWindowShouldClose(window)) {
+			display(window, program, lightShader, VAO, LVAO);
+			if (cameraRecord)
+				recordCameraKey(cameraRecord);
+		}
+		renderStop(renderer);
+		simulationStop(simulation);
+
+		if (cameraRecord)
+			fclose(cameraRecord);
+	}
+
+	occlusionTerminate(occlusionCuller);
+	glDeleteBuffers(1, &instanceBuffer);
+	terminateProgram(program.id);
+	terminateProgram(lightShader.id);
+	geometryTerminate(geometry);
+
+	profilerTerminate(profiler);
+	streamBufferTerminate(streamBuffer);
+	textureStreamerTerminate(textureStreamer);
+	if (options.headless)
+		headlessTerminate();
+	else {
+		glfwDestroyWindow(window);
+		glfwTerminate();
+	}
+	return 0;
+}
+
+//******************************************************************************************************************************
+void display(GLFWwindow* window, const ProgramInfo& program, const ProgramInfo& lightShader, GLuint VAO, GLuint LVAO, 
+	bool readInputs) {
+	TraceZone trace("display");
+	// Records the GL work of the frame, renderSubmit() replays it here or on the render thread.
+	CommandBuffer& commands = renderCommands(renderer);
+
+	// Transforms and culling run on the job system meanwhile.
+	JobCounter transformed, culled;
+	{
+		ProfileZone zone(commands, PROFILE_SETUP);
+		if (window && readInputs)
+			inputs(window, commands);
+		if (simulation.running)
+			simulationInterpolate(simulation);
+		jobSubmit(updateTransforms, &transformed);
+		jobSubmit([&commands]() {
+			commands.culledObjects = cullDraws();
+			if (occlusionEnabled)
+				commands.occludedObjects = occlusionCull(occlusionCuller, visibleInstances, lightVisible);
+		}, &culled, &transformed);
+		recordCallback(commands, [](void* streamer) { textureStreamerUpdate(*(TextureStreamer*)streamer); }, &textureStreamer);
+		FrameConstants constants = buildFrameConstants();
+		recordConstants(commands, FRAME_CONSTANTS_BINDING, &constants, sizeof(constants));
+	}
+
+	{
+		ProfileZone zone(commands, PROFILE_CLEAR);
+		ClearCommand clear = { { screenColor[0], screenColor[1], screenColor[2], screenColor[3] }, 
+			GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT };
+		recordCommand(commands, COMMAND_CLEAR, clear);
+	}
+
+	{
+		ProfileZone zone(commands, PROFILE_CULL);
+		jobWait(culled);
+		// Staged in the stream buffer and copied into instanceBuffer instead of drawn from the ring, ranges of the ring only
+		// live for one frame and the instances are drawn every frame until the visible set changes.
+		if (visibleInstances != drawnInstances) {
+			std::vector<glm::mat4> transforms = visibleTransforms();
+			recordBufferUpdate(commands, instanceBuffer, transforms.data(), transforms.size() * sizeof(glm::mat4));
+			drawnInstances = visibleInstances;
+		}
+		instanceCount = (GLsizei)drawnInstances.size();
+	}
+
+	if (instanceCount > 0)
+		queueDraw(renderQueue, RENDER_PASS_OPAQUE, 0, { 0, &program, VAO, textureFloatArts, pyramidGeometry, instanceCount, 
+			cubeModel, PROFILE_PYRAMID });
+	if (lightVisible)
+		queueDraw(renderQueue, RENDER_PASS_OPAQUE, 0, { 0, &lightShader, LVAO, -1, lightGeometry, 0, lightModel, PROFILE_LIGHT });
+	submitQueue(renderQueue, commands);
+	if (pickedInstance >= 0 && pickedInstance < (int)instanceTransforms.size())
+		recordPickOutline(commands, lightShader);
+
+	if (window) {
+		ProfileZone zone(commands, PROFILE_SWAP);
+		recordCommand(commands, COMMAND_SWAP, SwapCommand{ window });
+	}
+	renderSubmit(renderer);
+	if (window)
+		glfwPollEvents();
+}
+
+glm::mat4 cameraMatrix() {
+	glm::mat4 view = glm::mat4(1.0f);
+	glm::mat4 proj = glm::mat4(1.0f);
+	view = glm::lookAt(camPos, camPos + orientation, up);
+	proj = glm::perspective(FOV, (float)SCREEN_WIDTH / SCREEN_HEIGHT, NEAR_PLANE, FAR_PLANE);
+	return proj * view;
+}
+
+FrameConstants buildFrameConstants() {
+	FrameConstants constants;
+	constants.camMatrix = cameraMatrix();
+	constants.camPos = glm::vec4(camPos, 1.0f);
+	constants.lightColor = lightColor;
+	constants.lightPos = glm::vec4(lightPos, 1.0f);
+	return constants;
+}
+
+void updateTransforms() {
+	glm::mat4 turntable = glm::rotate(glm::mat4(1.0f), glm::radians(turntableAngle), glm::vec3(0.0f, 1.0f, 0.0f));
+	if (turntable != sceneLocal(scene, sceneTurntable))
+		sceneSetLocal(scene, sceneTurntable, turntable);
+	syncSceneTransforms();
+}
+
+GLuint programInit(const char* vertexShaderCode, const char* fragmentShaderCode) {
+	TraceZone trace("programInit");
+	GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER),
+		fragmentShader = glCreateShader(GL_FRAGMENT_SHADER),
+		shaderProgram = glCreateProgram();
+
+	glShaderSource(vertexShader, 1, &vertexShaderCode, NULL);
+	glCompileShader(vertexShader);
+	checkShaderCompileErrors(vertexShader);
+
+	glShaderSource(fragmentShader, 1, &fragmentShaderCode, NULL);
+	glCompileShader(fragmentShader);
+	checkShaderCompileErrors(fragmentShader);
+
+	glAttachShader(shaderProgram, vertexShader);
+	glAttachShader(shaderProgram, fragmentShader);
+	glLinkProgram(shaderProgram);
+	checkProgramLinkErrors(shaderProgram);
+
+	glDeleteShader(vertexShader);
+	glDeleteShader(fragmentShader);
+
+	return shaderProgram;
+}
+
+ProgramInfo programReflect(GLuint program) {
+	ProgramInfo info;
+	info.id = program;
+	for (int key = 0; key < UNIFORM_COUNT; key++)
+		info.locations[key] = -1;
+
+	GLint activeUniforms = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &activeUniforms);
+
+	for (GLint i = 0; i < activeUniforms; i++) {
+		char name[256];
+		GLsizei nameLength = 0;
+		GLint size = 0;
+		GLenum type = GL_NONE;
+		glGetActiveUniform(program, i, sizeof(name), &nameLength, &size, &type, name);
+
+		char* arraySuffix = strstr(name, "[0]");
+		if (arraySuffix)
+			*arraySuffix = '\0';
+
+		for (int key = 0; key < UNIFORM_COUNT; key++) {
+			if (strcmp(name, uniformNames[key]) != 0)
+				continue;
+			if (type != uniformTypes[key])
+				errorLog("PVE", "PROG", std::string("uniform (") + name + ") has an unexpected type.\n", "");
+			info.locations[key] = glGetUniformLocation(program, name);
+		}
+	}
+
+	bindUniformBlock(program, "FrameConstants", sizeof(FrameConstants), FRAME_CONSTANTS_BINDING);
+	bindUniformBlock(program, "DrawConstants", sizeof(DrawConstants), DRAW_CONSTANTS_BINDING);
+	return info;
+}
+
+// Shared blocks get their fixed binding point here since GLSL 330 has no layout (binding = N).
+void bindUniformBlock(GLuint program, const char* name, GLint size, GLuint binding) {
+	GLuint index = glGetUniformBlockIndex(program, name);
+	if (index == GL_INVALID_INDEX)
+		return;
+	GLint blockSize = 0;
+	glGetActiveUniformBlockiv(program, index, GL_UNIFORM_BLOCK_DATA_SIZE, &blockSize);
+	if (blockSize != size)
+		errorLog("PVE", "PROG", std::string(name) + " block doesn't match the std140 struct.\n", "");
+	glUniformBlockBinding(program, index, binding);
+}
+
+void terminateProgram(GLuint program) {
+	glDeleteProgram(program);
+}
+
+GLuint createInstanceBuffer(GLuint VAO, const std::vector<glm::mat4>& instances) {
+	GLuint IBO;
+	glGenBuffers(1, &IBO);
+
+	stateBindVertexArray(glState, VAO);
+	glBindBuffer(GL_ARRAY_BUFFER, IBO);
+	glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(glm::mat4), instances.data(), GL_DYNAMIC_DRAW);
+
+	// One model matrix per instance, a mat4 attribute is four vec4 columns.
+	for (int column = 0; column < 4; column++) {
+		glVertexAttribPointer(INSTANCE_ATTRIBUTE + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), 
+			(void*)(column * sizeof(glm::vec4)));
+		glEnableVertexAttribArray(INSTANCE_ATTRIBUTE + column);
+		glVertexAttribDivisor(INSTANCE_ATTRIBUTE + column, 1);
+	}
+	CHECK_GL_ERRORS();
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	stateBindVertexArray(glState, 0);
+
+	return IBO;
+}
+
+void updateInstanceBuffer(GLuint buffer, const std::vector<glm::mat4>& instances) {
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(glm::mat4), instances.data(), GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+std::vector<glm::mat4> instanceGrid(int count, float spacing) {
+	std::vector<glm::mat4> instances(count > 0 ? count : 1, glm::mat4(1.0f));
+	int side = (int)std::ceil(std::sqrt((double)instances.size()));
+	float offset = (side - 1) * spacing * 0.5f;
+
+	for (size_t i = 0; i < instances.size(); i++) {
+		glm::vec3 position = glm::vec3((i % side) * spacing - offset, 0.0f, (i / side) * spacing - offset);
+		instances[i] = glm::translate(glm::mat4(1.0f), position);
+	}
+	return instances;
+}
+
+void benchmarkInstances(GLFWwindow* window, const ProgramInfo& program, const ProgramInfo& lightShader, GLuint VAO, 
+	GLuint LVAO) {
+	const int counts[] = { 1, 10, 100, 1000, 10000, 100000 };
+	const int warmupFrames = 10;
+	const int minFrames = 30;
+	const double minSeconds = 2.0;
+
+	glfwSwapInterval(0);
+	std::cout << "instances" << "\t" << "frames/sec" << "\t" << "ms/frame" << std::endl;
+	for (int count : counts) {
+		std::vector<glm::mat4> instances = instanceGrid(count, 1.5f);
+		updateInstanceBuffer(instanceBuffer, instances);
+		setInstances(instances);
+
+		for (int i = 0; i < warmupFrames && !glfwWindowShouldClose(window); i++)
+			display(window, program, lightShader, VAO, LVAO);
+		glFinish();
+
+		int frames = 0;
+		double start = glfwGetTime(), elapsed = 0.0;
+		while ((frames < minFrames || elapsed < minSeconds) && !glfwWindowShouldClose(window)) {
+			display(window, program, lightShader, VAO, LVAO);
+			frames++;
+			if (frames == minFrames || elapsed >= minSeconds)
+				glFinish();
+			elapsed = glfwGetTime() - start;
+		}
+		if (frames == 0)
+			break;
+
+		std::cout << count << "\t" << frames / elapsed << "\t" << 1000.0 * elapsed / frames << std::endl;
+	}
+	glfwSwapInterval(1);
+}
+
+AppOptions parseArguments(int argc, char** argv) {
+	AppOptions options = {};
+	options.instances = 1;
+	options.frames = 1;
+	options.outPrefix = "frame_";
+	options.warmupFrames = 60;
+	options.jsonPath = "benchmark.json";
+	options.vertexFormat = VERTEX_FORMAT_PACKED16;
+	options.threads = std::max((int)std::thread::hardware_concurrency(), 2); // A worker for the background jobs.
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc)
+			options.instances = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--bench-instances") == 0)
+			options.benchInstances = true;
+		else if (strcmp(argv[i], "--software") == 0)
+			options.software = true;
+		else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+			options.frames = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--headless") == 0)
+			options.headless = true;
+		else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+			options.outPrefix = argv[++i];
+		else if (strcmp(argv[i], "--raw") == 0)
+			options.rawFrames = true;
+		else if (strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc)
+			options.benchmarkPath = argv[++i];
+		else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+			options.recordPath = argv[++i];
+		else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+			options.warmupFrames = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+			options.jsonPath = argv[++i];
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			options.tracePath = argv[++i];
+		else if (strcmp(argv[i], "--cook") == 0 && i + 1 < argc)
+			options.cookPath = argv[++i];
+		else if (strcmp(argv[i], "--model") == 0 && i + 1 < argc)
+			options.modelPath = argv[++i];
+		else if (strcmp(argv[i], "--no-cull") == 0)
+			options.noCull = true;
+		else if (strcmp(argv[i], "--no-occlusion") == 0)
+			options.noOcclusion = true;
+		else if (strcmp(argv[i], "--bench-bvh") == 0 && i + 1 < argc)
+			options.bvhObjects = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--bench-scene") == 0 && i + 1 < argc)
+			options.sceneNodes = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--no-render-thread") == 0)
+			options.noRenderThread = true;
+		else if (strcmp(argv[i], "--bench-heap") == 0 && i + 1 < argc)
+			options.heapAllocations = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--no-buffer-storage") == 0)
+			options.noBufferStorage = true;
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			options.threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--bench-jobs") == 0)
+			options.benchJobs = true;
+		else if (strcmp(argv[i], "--vertex-format") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "float") == 0)
+				options.vertexFormat = VERTEX_FORMAT_FLOAT;
+			else if (strcmp(argv[i], "packed") == 0)
+				options.vertexFormat = VERTEX_FORMAT_PACKED;
+			else if (strcmp(argv[i], "packed16") == 0)
+				options.vertexFormat = VERTEX_FORMAT_PACKED16;
+			else
+				errorLog("PVE", "INIT", std::string("unknown vertex format (") + argv[i] + ").\n", "");
+		}
+		else
+			errorLog("PVE", "INIT", std::string("unknown argument (") + argv[i] + ").\n", "");
+	}
+	return options;
+}
+
+//******************************************************************************************************************************
+// Job System
+// Starts threads - 1 workers. Jobs submitted by a worker go to its own deque, idle threads steal the oldest job of another.
+void jobSystemInit(int threads) {
+	threads = std::max(threads, 1);
+	jobSystem.threadCount = threads;
+	jobSystem.available = 0;
+	jobSystem.sleeping = 0;
+	jobSystem.finished = false;
+	for (int i = 0; i < threads; i++) {
+		jobSystem.deques.emplace_back(new JobDeque);
+		jobSystem.deques.back()->top = 0;
+		jobSystem.deques.back()->bottom = 0;
+	}
+	jobThread = 0;
+	for (int i = 1; i < threads; i++)
+		jobSystem.threads.emplace_back(jobWorkerLoop, i);
+}
+
+// Registered with atexit() so early returns from main() still join the workers. Jobs left over run on the calling thread.
+void jobSystemTerminate() {
+	{
+		std::lock_guard<std::mutex> lock(jobSystem.mutex);
+		jobSystem.finished = true;
+	}
+	jobSystem.wake.notify_all();
+	for (std::thread& thread : jobSystem.threads)
+		thread.join();
+	jobSystem.threads.clear();
+	while (Job* job = jobFind(true))
+		jobExecute(job);
+	jobSystem.deques.clear();
+	jobSystem.threadCount = 0;
+	jobThread = -1;
+}
+
+void jobWorkerLoop(int worker) {
+	jobThread = worker;
+	traceThreadName("worker");
+	int idle = 0;
+	while (!jobSystem.finished) {
+		Job* job = jobFind(true);
+		if (job) {
+			jobExecute(job);
+			idle = 0;
+		}
+		else if (++idle < JOB_SPIN_COUNT)
+			std::this_thread::yield();
+		else {
+			std::unique_lock<std::mutex> lock(jobSystem.mutex);
+			jobSystem.sleeping++;
+			jobSystem.wake.wait(lock, []() { return jobSystem.finished || jobSystem.available > 0; });
+			jobSystem.sleeping--;
+			idle = 0;
+		}
+	}
+}
+
+// Owner only. Returns false when the deque is full. The orderings are the C11 ones of Le et al.
+bool jobPush(JobDeque& deque, Job* job) {
+	long long bottom = deque.bottom.load(std::memory_order_relaxed);
+	long long top = deque.top.load(std::memory_order_acquire);
+	if (bottom - top >= JOB_DEQUE_SIZE)
+		return false;
+	deque.jobs[bottom & (JOB_DEQUE_SIZE - 1)].store(job, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	deque.bottom.store(bottom + 1, std::memory_order_relaxed);
+	return true;
+}
+
+// Owner only, takes the newest job.
+Job* jobPop(JobDeque& deque) {
+	long long bottom = deque.bottom.load(std::memory_order_relaxed) - 1;
+	deque.bottom.store(bottom, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	long long top = deque.top.load(std::memory_order_relaxed);
+	if (top > bottom) {
+		deque.bottom.store(bottom + 1, std::memory_order_relaxed);
+		return NULL;
+	}
+	Job* job = deque.jobs[bottom & (JOB_DEQUE_SIZE - 1)].load(std::memory_order_relaxed);
+	if (top == bottom) { // The last job, thieves race for it.
+		if (!deque.top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			job = NULL;
+		deque.bottom.store(bottom + 1, std::memory_order_relaxed);
+	}
+	return job;
+}
+
+// Any thread, takes the oldest job. NULL when the deque is empty or another thread won the job.
+Job* jobSteal(JobDeque& deque) {
+	long long top = deque.top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	long long bottom = deque.bottom.load(std::memory_order_acquire);
+	if (top >= bottom)
+		return NULL;
+	Job* job = deque.jobs[top & (JOB_DEQUE_SIZE - 1)].load(std::memory_order_relaxed);
+	if (!deque.top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		return NULL;
+	return job;
+}
+
+// The own deque first, its newest job has warm data. Then the other deques from a random one, then the background jobs.
+Job* jobFind(bool background) {
+	static thread_local unsigned int seed = 12345;
+	int count = (int)jobSystem.deques.size();
+	Job* job = jobThread >= 0 && jobThread < count ? jobPop(*jobSystem.deques[jobThread]) : NULL;
+	if (!job && count > 1) {
+		seed = seed * 1664525u + 1013904223u;
+		int first = (int)((seed >> 8) % count);
+		for (int i = 0; !job && i < count; i++) {
+			int victim = (first + i) % count;
+			if (victim != jobThread)
+				job = jobSteal(*jobSystem.deques[victim]);
+		}
+	}
+	if (!job && background && jobSystem.available > 0) {
+		std::lock_guard<std::mutex> lock(jobSystem.mutex);
+		if (!jobSystem.background.empty()) {
+			job = jobSystem.background.front();
+			jobSystem.background.pop_front();
+		}
+	}
+	if (job)
+		jobSystem.available--;
+	return job;
+}
+
+void jobExecute(Job* job) {
+	if (job->dependency)
+		jobWait(*job->dependency);
+	job->function();
+	if (job->counter)
+		job->counter->pending.fetch_sub(1, std::memory_order_release);
+	delete job;
+}
+
+// Called after available went up. A worker going to sleep increments sleeping before it checks available, so one of the two
+// sees the other.
+void jobWake() {
+	if (jobSystem.sleeping > 0) {
+		{
+			std::lock_guard<std::mutex> lock(jobSystem.mutex);
+		}
+		jobSystem.wake.notify_one();
+	}
+}
+
+// Queues the function on the deque of the calling thread, counter goes back down when it has run. A thread outside the job
+// system runs it inline.
+void jobSubmit(const std::function<void()>& function, JobCounter* counter, const JobCounter* dependency) {
+	if (counter)
+		counter->pending++;
+	Job* job = new Job{ function, counter, dependency };
+	if (jobThread < 0 || jobThread >= (int)jobSystem.deques.size()) {
+		jobExecute(job);
+		return;
+	}
+	jobSystem.available++;
+	if (!jobPush(*jobSystem.deques[jobThread], job)) {
+		jobSystem.available--;
+		jobExecute(job);
+		return;
+	}
+	jobWake();
+}
+
+// For jobs that would stall a frame if the waiting main thread picked them up. Without workers they run inline.
+void jobSubmitBackground(const std::function<void()>& function, JobCounter* counter) {
+	if (counter)
+		counter->pending++;
+	Job* job = new Job{ function, counter, NULL };
+	if (jobSystem.threads.empty()) {
+		jobExecute(job);
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(jobSystem.mutex);
+		jobSystem.background.push_back(job);
+		jobSystem.available++;
+	}
+	jobSystem.wake.notify_one();
+}
+
+// Runs other jobs until the counter reaches zero, so waiting inside a job doesn't take a thread out of the pool.
+void jobWait(const JobCounter& counter) {
+	while (counter.pending.load(std::memory_order_acquire) > 0) {
+		Job* job = jobFind(false);
+		if (job)
+			jobExecute(job);
+		else
+			std::this_thread::yield();
+	}
+}
+
+// body(0) to body(count - 1), indices are claimed one at a time so uneven items balance out. The calling thread works too.
+void parallelFor(int count, const std::function<void(int)>& body) {
+	int jobs = std::min(jobSystem.threadCount, count) - 1;
+	std::atomic<int> next(0);
+	auto work = [&]() {
+		for (int i = next++; i < count; i = next++)
+			body(i);
+	};
+
+	JobCounter counter;
+	for (int i = 0; i < jobs; i++)
+		jobSubmit(work, &counter);
+	work();
+	jobWait(counter);
+}
+
+// --bench-jobs: the parallel passes of a frame on 1 to --threads threads, the speedup is against 1 thread.
+int jobsBenchmark(const AppOptions& options) {
+	int count = JOB_BENCH_OBJECTS;
+	unsigned int seed = 12345;
+	auto random = [&seed]() {
+		seed = seed * 1664525u + 1013904223u;
+		return (seed >> 8) / 16777216.0f;
+	};
+	auto randomVec3 = [&random](float scale) { 
+		float x = random(), y = random(), z = random();
+		return (glm::vec3(x, y, z) * 2.0f - 1.0f) * scale;
+	};
+
+	SceneGraph scene;
+	std::vector<glm::mat4> transforms(count);
+	std::vector<glm::vec3> boundsMin(count), boundsMax(count);
+	float worldSize = std::cbrt((float)count) * 2.0f;
+	for (int i = 0; i < count; i++) {
+		glm::mat4 local = glm::rotate(glm::translate(glm::mat4(1.0f), randomVec3(1.0f)), random() * 6.28f, glm::vec3(0.0f, 1.0f, 0.0f));
+		sceneAddNode(scene, i ? (int)(random() * i) : -1, local);
+		transforms[i] = glm::translate(glm::mat4(1.0f), randomVec3(worldSize));
+		transformBounds(transforms[i], glm::vec3(-0.5f), glm::vec3(0.5f), boundsMin[i], boundsMax[i]);
+	}
+	sceneSort(scene);
+	CullSpheres spheres = cullSpheres(transforms, glm::vec4(0.0f, 0.0f, 0.0f, 0.87f));
+	glm::mat4 camMatrix = glm::perspective(FOV, (float)SCREEN_WIDTH / SCREEN_HEIGHT, NEAR_PLANE, FAR_PLANE) * 
+		glm::lookAt(glm::vec3(0.0f, 0.0f, worldSize), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+	auto now = []() { return std::chrono::steady_clock::now(); };
+	auto fastest = [&now](const std::function<void()>& pass) {
+		double best = DBL_MAX;
+		for (int run = 0; run < JOB_BENCH_RUNS; run++) {
+			std::chrono::steady_clock::time_point start = now();
+			pass();
+			best = std::min(best, std::chrono::duration<double, std::milli>(now() - start).count());
+		}
+		return best;
+	};
+
+	int maxThreads = std::max(options.threads, 1);
+	double serialTime = 0.0;
+	std::vector<int> visible;
+	for (int threads = 1; threads <= maxThreads; threads++) {
+		jobSystemTerminate();
+		jobSystemInit(threads);
+		double sceneTime = fastest([&scene]() {
+			for (int s = 0; s < scene.levelStart[1]; s++)
+				sceneSetLocal(scene, scene.node[s], sceneLocal(scene, scene.node[s]));
+			sceneUpdate(scene);
+		});
+		Bvh bvh;
+		double bvhTime = fastest([&]() { bvhBuild(bvh, boundsMin, boundsMax); });
+		double cullTime = fastest([&]() { frustumCull(spheres, camMatrix, visible); });
+		double jobTime = fastest([]() {
+			JobCounter counter;
+			for (int i = 0; i < JOB_BENCH_JOBS; i++)
+				jobSubmit([]() {}, &counter);
+			jobWait(counter);
+		});
+
+		double total = sceneTime + bvhTime + cullTime;
+		if (threads == 1)
+			serialTime = total;
+		std::cout << "JOBS" << " [threads: " << threads << ", scene ms: " << sceneTime << ", bvh ms: " << bvhTime << ", cull ms: " 
+			<< cullTime << ", speedup: " << serialTime / total << ", ns/job: " << 1.0e6 * jobTime / JOB_BENCH_JOBS << "]" << std::endl;
+	}
+	std::cout << "JOBS" << " [objects: " << count << ", visible: " << visible.size() << ", cores: " 
+		<< std::max(std::thread::hardware_concurrency(), 1u) << "]" << std::endl;
+	return 0;
+}
+
+//******************************************************************************************************************************
+// Software Rasterizer
+unsigned int packColor(float r, float g, float b, float a) {
+	r = std::min(std::max(r, 0.0f), 1.0f);
+	g = std::min(std::max(g, 0.0f), 1.0f);
+	b = std::min(std::max(b, 0.0f), 1.0f);
+	a = std::min(std::max(a, 0.0f), 1.0f);
+	return (unsigned int)(r * 255.0f + 0.5f) | (unsigned int)(g * 255.0f + 0.5f) << 8 |
+		(unsigned int)(b * 255.0f + 0.5f) << 16 | (unsigned int)(a * 255.0f + 0.5f) << 24;
+}
+
+SoftwareRenderer createSoftwareRenderer(int width, int height) {
+	SoftwareRenderer renderer;
+	renderer.width = width;
+	renderer.height = height;
+	renderer.pitch = (width + SOFTWARE_BLOCK_SIZE - 1) / SOFTWARE_BLOCK_SIZE * SOFTWARE_BLOCK_SIZE;
+	renderer.paddedHeight = (height + SOFTWARE_BLOCK_SIZE - 1) / SOFTWARE_BLOCK_SIZE * SOFTWARE_BLOCK_SIZE;
+	renderer.tilesX = (renderer.pitch + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+	renderer.tilesY = (renderer.paddedHeight + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+	renderer.color.resize(renderer.pitch * renderer.paddedHeight);
+	renderer.depth.resize(renderer.pitch * renderer.paddedHeight);
+	renderer.visible.resize(renderer.pitch * renderer.paddedHeight);
+	renderer.blockMaxDepth.resize((renderer.pitch / SOFTWARE_BLOCK_SIZE) * (renderer.paddedHeight / SOFTWARE_BLOCK_SIZE));
+	renderer.activeChunks = 0;
+	renderer.texture = NULL;
+	return renderer;
+}
+
+// Clips a triangle against the near plane (z >= -w), returns the vertex count of the resulting polygon.
+int clipNearPlane(const SoftwareVertex input[3], SoftwareVertex output[4]) {
+	int count = 0;
+	for (int i = 0; i < 3; i++) {
+		const SoftwareVertex& a = input[i];
+		const SoftwareVertex& b = input[(i + 1) % 3];
+		float da = a.clip.z + a.clip.w, db = b.clip.z + b.clip.w;
+
+		if (da >= 0.0f)
+			output[count++] = a;
+		if ((da >= 0.0f) != (db >= 0.0f)) {
+			float t = da / (da - db);
+			SoftwareVertex& v = output[count++];
+			v.clip = a.clip + (b.clip - a.clip) * t;
+			for (int k = 0; k < SOFTWARE_VARYINGS; k++)
+				v.varyings[k] = a.varyings[k] + (b.varyings[k] - a.varyings[k]) * t;
+		}
+	}
+	return count;
+}
+
+// Viewport transform and edge/depth setup, returns false for degenerate or off-screen triangles.
+bool setupTriangle(const SoftwareRenderer& renderer, const SoftwareVertex* v[3], SoftwareShader shader, 
+	SoftwareTriangle& tri) {
+	for (int i = 0; i < 3; i++) {
+		tri.invW[i] = 1.0f / v[i]->clip.w;
+		tri.x[i] = (v[i]->clip.x * tri.invW[i] * 0.5f + 0.5f) * renderer.width;
+		tri.y[i] = (0.5f - v[i]->clip.y * tri.invW[i] * 0.5f) * renderer.height;
+		tri.z[i] = v[i]->clip.z * tri.invW[i] * 0.5f + 0.5f;
+		memcpy(tri.varyings[i], v[i]->varyings, sizeof(tri.varyings[i]));
+	}
+
+	float area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) - (tri.x[2] - tri.x[0]) * (tri.y[1] - tri.y[0]);
+	if (area == 0.0f || area != area)
+		return false;
+	if (area < 0.0f) { // No face culling in the GL path, so both windings are drawn.
+		std::swap(tri.x[1], tri.x[2]);
+		std::swap(tri.y[1], tri.y[2]);
+		std::swap(tri.z[1], tri.z[2]);
+		std::swap(tri.invW[1], tri.invW[2]);
+		for (int k = 0; k < SOFTWARE_VARYINGS; k++)
+			std::swap(tri.varyings[1][k], tri.varyings[2][k]);
+		area = -area;
+	}
+
+	// Pixel centers covered by the bounding box.
+	float minX = std::min(tri.x[0], std::min(tri.x[1], tri.x[2])), maxX = std::max(tri.x[0], std::max(tri.x[1], tri.x[2]));
+	float minY = std::min(tri.y[0], std::min(tri.y[1], tri.y[2])), maxY = std::max(tri.y[0], std::max(tri.y[1], tri.y[2]));
+	tri.minX = std::max((int)std::ceil(minX - 0.5f), 0);
+	tri.minY = std::max((int)std::ceil(minY - 0.5f), 0);
+	tri.maxX = std::min((int)std::floor(maxX - 0.5f), renderer.width - 1);
+	tri.maxY = std::min((int)std::floor(maxY - 0.5f), renderer.height - 1);
+	if (tri.minX > tri.maxX || tri.minY > tri.maxY)
+		return false;
+
+	// Edge i is opposite to vertex i, E(x, y) = a * x + b * y + c is positive inside.
+	float zA = 0.0f, zB = 0.0f, zC = 0.0f;
+	for (int i = 0; i < 3; i++) {
+		int from = (i + 1) % 3, to = (i + 2) % 3;
+		tri.edgeA[i] = tri.y[from] - tri.y[to];
+		tri.edgeB[i] = tri.x[to] - tri.x[from];
+		tri.edgeC[i] = -(tri.edgeA[i] * tri.x[from] + tri.edgeB[i] * tri.y[from]);
+		tri.topLeft[i] = tri.edgeA[i] > 0.0f || (tri.edgeA[i] == 0.0f && tri.edgeB[i] > 0.0f);
+
+		zA += tri.edgeA[i] * tri.z[i];
+		zB += tri.edgeB[i] * tri.z[i];
+		zC += tri.edgeC[i] * tri.z[i];
+	}
+	tri.invArea = 1.0f / area;
+	tri.zPlane[0] = zA * tri.invArea;
+	tri.zPlane[1] = zB * tri.invArea;
+	tri.zPlane[2] = zC * tri.invArea;
+	tri.zMin = std::min(tri.z[0], std::min(tri.z[1], tri.z[2]));
+	tri.shader = shader;
+	return true;
+}
+
+// Vertex shading, clipping and binning of one chunk of instances.
+void softwareGeometry(SoftwareRenderer& renderer, const SoftwareDraw& draw, SoftwareChunk& chunk) {
+	chunk.triangles.clear();
+	for (std::vector<unsigned int>& bin : chunk.bins)
+		bin.clear();
+
+	const unsigned char* vertices = (const unsigned char*)draw.object.vertices;
+	const GLuint* indices = (const GLuint*)draw.object.indices;
+	size_t indexCount = draw.object.indicesSize / sizeof(GLuint);
+	const VertexLayout& layout = draw.object.layout;
+	const VertexAttribute* position = findAttribute(layout, 0);
+	const VertexAttribute* texCoord = findAttribute(layout, 2);
+	const VertexAttribute* normal = findAttribute(layout, 3);
+	glm::vec3 positionScale, positionOffset;
+	positionDequantization(draw.object, positionScale, positionOffset);
+
+	for (int instance = chunk.firstInstance; instance < chunk.firstInstance + chunk.instanceCount; instance++) {
+		glm::mat4 world = draw.instances ? draw.model * draw.instances[instance] : draw.model;
+		glm::mat4 clipMatrix = renderer.constants.camMatrix * world;
+
+		for (size_t i = 0; i + 2 < indexCount; i += 3) {
+			SoftwareVertex corners[3], polygon[4];
+			for (int k = 0; k < 3; k++) {
+				const unsigned char* vertex = vertices + indices[i + k] * layout.stride;
+				float aPos[4];
+				fetchAttribute(vertex, *position, aPos);
+				glm::vec4 objectPos = glm::vec4(glm::make_vec3(aPos) * positionScale + positionOffset, 1.0f);
+				glm::vec4 crntPos = world * objectPos;
+
+				corners[k].clip = clipMatrix * objectPos;
+				corners[k].varyings[0] = crntPos.x;
+				corners[k].varyings[1] = crntPos.y;
+				corners[k].varyings[2] = crntPos.z;
+				for (int j = 3; j < SOFTWARE_VARYINGS; j++)
+					corners[k].varyings[j] = 0.0f;
+				if (texCoord) {
+					float aTex[4];
+					fetchAttribute(vertex, *texCoord, aTex);
+					corners[k].varyings[3] = aTex[0];
+					corners[k].varyings[4] = aTex[1];
+				}
+				if (normal) {
+					float aNormal[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+					fetchAttribute(vertex, *normal, aNormal);
+					glm::vec3 n = aNormal[3] > 0.5f ? glm::make_vec3(aNormal) : octahedralDecode(aNormal[0], aNormal[1]);
+					corners[k].varyings[5] = n.x;
+					corners[k].varyings[6] = n.y;
+					corners[k].varyings[7] = n.z;
+				}
+			}
+
+			int polygonSize = clipNearPlane(corners, polygon);
+			for (int k = 1; k + 1 < polygonSize; k++) {
+				const SoftwareVertex* fan[3] = { &polygon[0], &polygon[k], &polygon[k + 1] };
+				SoftwareTriangle tri;
+				if (!setupTriangle(renderer, fan, draw.shader, tri))
+					continue;
+
+				unsigned int index = (unsigned int)chunk.triangles.size();
+				chunk.triangles.push_back(tri);
+				for (int ty = tri.minY / SOFTWARE_TILE_SIZE; ty <= tri.maxY / SOFTWARE_TILE_SIZE; ty++)
+					for (int tx = tri.minX / SOFTWARE_TILE_SIZE; tx <= tri.maxX / SOFTWARE_TILE_SIZE; tx++)
+						chunk.bins[ty * renderer.tilesX + tx].push_back(index);
+			}
+		}
+	}
+}
+
+// GL_LINEAR + GL_REPEAT lookup of the base level, like the sampler state set in main().
+glm::vec4 sampleTexture(const SoftwareTexture& texture, float s, float t) {
+	float u = s * texture.width - 0.5f, v = t * texture.height - 0.5f;
+	float fu = std::floor(u), fv = std::floor(v);
+	float wu = u - fu, wv = v - fv;
+	int x0 = (int)fu % texture.width, y0 = (int)fv % texture.height;
+	if (x0 < 0) x0 += texture.width;
+	if (y0 < 0) y0 += texture.height;
+	int x1 = (x0 + 1) % texture.width, y1 = (y0 + 1) % texture.height;
+
+	const unsigned char* p00 = &texture.pixels[(y0 * texture.width + x0) * 4];
+	const unsigned char* p10 = &texture.pixels[(y0 * texture.width + x1) * 4];
+	const unsigned char* p01 = &texture.pixels[(y1 * texture.width + x0) * 4];
+	const unsigned char* p11 = &texture.pixels[(y1 * texture.width + x1) * 4];
+
+	glm::vec4 color;
+	for (int c = 0; c < 4; c++) {
+		float top = p00[c] + (p10[c] - p00[c]) * wu;
+		float bottom = p01[c] + (p11[c] - p01[c]) * wu;
+		color[c] = (top + (bottom - top) * wv) / 255.0f;
+	}
+	return color;
+}
+
+// Same terms as fragmentShaderCode and fragmentShaderLightCode.
+unsigned int softwareShade(const SoftwareRenderer& renderer, const SoftwareTriangle& tri, const float lambda[3]) {
+	const FrameConstants& constants = renderer.constants;
+	if (tri.shader == SOFTWARE_SHADER_LIGHT)
+		return packColor(constants.lightColor.x, constants.lightColor.y, constants.lightColor.z, constants.lightColor.w);
+
+	// Perspective correct interpolation.
+	float weights[3], sum = 0.0f;
+	for (int i = 0; i < 3; i++) {
+		weights[i] = lambda[i] * tri.invW[i];
+		sum += weights[i];
+	}
+	float varyings[SOFTWARE_VARYINGS];
+	for (int k = 0; k < SOFTWARE_VARYINGS; k++)
+		varyings[k] = (weights[0] * tri.varyings[0][k] + weights[1] * tri.varyings[1][k] + weights[2] * tri.varyings[2][k]) / sum;
+
+	glm::vec3 crntPos = glm::vec3(varyings[0], varyings[1], varyings[2]);
+	glm::vec2 texCoord = glm::vec2(varyings[3], varyings[4]);
+	glm::vec3 normals = glm::vec3(varyings[5], varyings[6], varyings[7]);
+
+	float ambient = 0.20f;
+
+	glm::vec3 normal = glm::normalize(normals);
+	glm::vec3 lightDirection = glm::normalize(glm::vec3(constants.lightPos) - crntPos);
+	float diffuse = std::max(glm::dot(normal, lightDirection), 0.0f);
+
+	float specularLight = 0.50f;
+	glm::vec3 viewDirection = glm::normalize(glm::vec3(constants.camPos) - crntPos);
+	glm::vec3 reflectionDirection = glm::reflect(-lightDirection, normal);
+	float specAmount = std::pow(std::max(glm::dot(viewDirection, reflectionDirection), 0.0f), 8.0f);
+	float specular = specAmount * specularLight;
+
+	glm::vec4 texel = renderer.texture ? sampleTexture(*renderer.texture, texCoord.x, texCoord.y) : glm::vec4(1.0f);
+	glm::vec4 color = texel * constants.lightColor * (diffuse + ambient + specular);
+	return packColor(color.x, color.y, color.z, color.w);
+}
+
+void softwareRasterTriangle(SoftwareRenderer& renderer, const SoftwareTriangle& tri, int tileX, int tileY) {
+	int x0 = std::max(tri.minX, tileX), x1 = std::min(tri.maxX, tileX + SOFTWARE_TILE_SIZE - 1);
+	int y0 = std::max(tri.minY, tileY), y1 = std::min(tri.maxY, tileY + SOFTWARE_TILE_SIZE - 1);
+	int blocksPerRow = renderer.pitch / SOFTWARE_BLOCK_SIZE;
+	const __m128 offsets = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+	const __m128 zero = _mm_setzero_ps();
+
+	__m128 edgeStep[3], topLeft[3];
+	for (int i = 0; i < 3; i++) {
+		edgeStep[i] = _mm_mul_ps(_mm_set1_ps(tri.edgeA[i]), offsets);
+		topLeft[i] = _mm_castsi128_ps(_mm_set1_epi32(tri.topLeft[i] ? -1 : 0));
+	}
+	__m128 zStep = _mm_mul_ps(_mm_set1_ps(tri.zPlane[0]), offsets);
+
+	for (int by = y0 & ~(SOFTWARE_BLOCK_SIZE - 1); by <= y1; by += SOFTWARE_BLOCK_SIZE) {
+		for (int bx = x0 & ~(SOFTWARE_BLOCK_SIZE - 1); bx <= x1; bx += SOFTWARE_BLOCK_SIZE) {
+			// Hierarchical depth test, the whole block is behind what is already drawn.
+			float& blockMax = renderer.blockMaxDepth[(by / SOFTWARE_BLOCK_SIZE) * blocksPerRow + bx / SOFTWARE_BLOCK_SIZE];
+			if (tri.zMin >= blockMax)
+				continue;
+
+			// Coarse edge test at the block corner that maximizes each edge function.
+			bool outside = false;
+			for (int i = 0; i < 3 && !outside; i++) {
+				float e = tri.edgeA[i] * (bx + 0.5f) + tri.edgeB[i] * (by + 0.5f) + tri.edgeC[i] +
+					std::max(tri.edgeA[i], 0.0f) * (SOFTWARE_BLOCK_SIZE - 1) + std::max(tri.edgeB[i], 0.0f) * (SOFTWARE_BLOCK_SIZE - 1);
+				outside = e < 0.0f;
+			}
+			if (outside)
+				continue;
+
+			bool written = false;
+			for (int y = by; y < by + SOFTWARE_BLOCK_SIZE; y++) {
+				float py = y + 0.5f;
+				for (int x = bx; x < bx + SOFTWARE_BLOCK_SIZE; x += 4) {
+					float px = x + 0.5f;
+					__m128 e[3], mask = _mm_castsi128_ps(_mm_set1_epi32(-1));
+					for (int i = 0; i < 3; i++) {
+						e[i] = _mm_add_ps(_mm_set1_ps(tri.edgeA[i] * px + tri.edgeB[i] * py + tri.edgeC[i]), edgeStep[i]);
+						__m128 inside = _mm_or_ps(_mm_and_ps(topLeft[i], _mm_cmpge_ps(e[i], zero)), 
+							_mm_andnot_ps(topLeft[i], _mm_cmpgt_ps(e[i], zero)));
+						mask = _mm_and_ps(mask, inside);
+					}
+					if (_mm_movemask_ps(mask) == 0)
+						continue;
+
+					float* depth = &renderer.depth[y * renderer.pitch + x];
+					__m128 z = _mm_add_ps(_mm_set1_ps(tri.zPlane[0] * px + tri.zPlane[1] * py + tri.zPlane[2]), zStep);
+					__m128 stored = _mm_loadu_ps(depth);
+					mask = _mm_and_ps(mask, _mm_cmplt_ps(z, stored));
+					int bits = _mm_movemask_ps(mask);
+					if (bits == 0)
+						continue;
+
+					_mm_storeu_ps(depth, _mm_or_ps(_mm_and_ps(mask, z), _mm_andnot_ps(mask, stored)));
+					written = true;
+
+					for (int lane = 0; lane < 4; lane++)
+						if (bits & (1 << lane))
+							renderer.visible[y * renderer.pitch + x + lane] = &tri;
+				}
+			}
+
+			if (written) {
+				float farthest = 0.0f;
+				for (int y = by; y < by + SOFTWARE_BLOCK_SIZE; y++)
+					for (int x = bx; x < bx + SOFTWARE_BLOCK_SIZE; x++)
+						farthest = std::max(farthest, renderer.depth[y * renderer.pitch + x]);
+				blockMax = farthest;
+			}
+		}
+	}
+}
+
+void softwareRasterTile(SoftwareRenderer& renderer, int tile) {
+	int tileX = (tile % renderer.tilesX) * SOFTWARE_TILE_SIZE;
+	int tileY = (tile / renderer.tilesX) * SOFTWARE_TILE_SIZE;
+	int tileRight = std::min(tileX + SOFTWARE_TILE_SIZE, renderer.pitch);
+	int tileBottom = std::min(tileY + SOFTWARE_TILE_SIZE, renderer.paddedHeight);
+	unsigned int clearColor = packColor(screenColor[0], screenColor[1], screenColor[2], screenColor[3]);
+
+	for (int y = tileY; y < tileBottom; y++) {
+		std::fill(&renderer.color[y * renderer.pitch + tileX], &renderer.color[y * renderer.pitch] + tileRight, clearColor);
+		std::fill(&renderer.depth[y * renderer.pitch + tileX], &renderer.depth[y * renderer.pitch] + tileRight, 1.0f);
+	}
+	int blocksPerRow = renderer.pitch / SOFTWARE_BLOCK_SIZE;
+	for (int by = tileY / SOFTWARE_BLOCK_SIZE; by < tileBottom / SOFTWARE_BLOCK_SIZE; by++)
+		for (int bx = tileX / SOFTWARE_BLOCK_SIZE; bx < tileRight / SOFTWARE_BLOCK_SIZE; bx++)
+			renderer.blockMaxDepth[by * blocksPerRow + bx] = 1.0f;
+
+	for (int y = tileY; y < tileBottom; y++)
+		std::fill(&renderer.visible[y * renderer.pitch + tileX], &renderer.visible[y * renderer.pitch] + tileRight, nullptr);
+
+	// Chunks are in submission order, so the result doesn't depend on the thread count.
+	for (int c = 0; c < renderer.activeChunks; c++) {
+		const SoftwareChunk& chunk = renderer.chunks[c];
+		for (unsigned int index : chunk.bins[tile])
+			softwareRasterTriangle(renderer, chunk.triangles[index], tileX, tileY);
+	}
+
+	// Shade once per pixel after the depth test has settled, overdraw only costs the depth test.
+	for (int y = tileY; y < std::min(tileBottom, renderer.height); y++) {
+		for (int x = tileX; x < std::min(tileRight, renderer.width); x++) {
+			const SoftwareTriangle* tri = renderer.visible[y * renderer.pitch + x];
+			if (!tri)
+				continue;
+
+			float lambda[3];
+			for (int i = 0; i < 3; i++)
+				lambda[i] = (tri->edgeA[i] * (x + 0.5f) + tri->edgeB[i] * (y + 0.5f) + tri->edgeC[i]) * tri->invArea;
+			renderer.color[y * renderer.pitch + x] = softwareShade(renderer, *tri, lambda);
+		}
+	}
+}
+
+void softwareRender(SoftwareRenderer& renderer, const std::vector<SoftwareDraw>& draws, const FrameConstants& constants) {
+	renderer.constants = constants;
+	int tileCount = renderer.tilesX * renderer.tilesY;
+
+	// Split the draws into chunks of instances for the geometry stage.
+	renderer.activeChunks = 0;
+	for (size_t d = 0; d < draws.size(); d++) {
+		int triangles = (int)std::max(draws[d].object.indicesSize / sizeof(GLuint) / 3, (size_t)1);
+		int instancesPerChunk = std::max(SOFTWARE_CHUNK_TRIANGLES / triangles, 1);
+		int instances = draws[d].instances ? draws[d].instanceCount : 1;
+
+		for (int first = 0; first < instances; first += instancesPerChunk) {
+			if (renderer.activeChunks == (int)renderer.chunks.size())
+				renderer.chunks.push_back(SoftwareChunk());
+			SoftwareChunk& chunk = renderer.chunks[renderer.activeChunks++];
+			chunk.draw = (int)d;
+			chunk.firstInstance = first;
+			chunk.instanceCount = std::min(instancesPerChunk, instances - first);
+			chunk.bins.resize(tileCount);
+		}
+	}
+
+	parallelFor(renderer.activeChunks, [&](int c) {
+		TraceZone trace("softwareGeometry");
+		softwareGeometry(renderer, draws[renderer.chunks[c].draw], renderer.chunks[c]);
+	});
+	parallelFor(tileCount, [&](int tile) {
+		TraceZone trace("softwareRasterTile");
+		softwareRasterTile(renderer, tile);
+	});
+}
+
+bool writePPM(const char* path, int width, int height, int pitch, const unsigned int* pixels) {
+	FILE* file = fopen(path, "wb");
+	if (!file)
+		return false;
+
+	fprintf(file, "P6 %d %d 255\n", width, height);
+	std::vector<unsigned char> row(width * 3);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			unsigned int pixel = pixels[y * pitch + x];
+			row[x * 3 + 0] = pixel & 0xFF;
+			row[x * 3 + 1] = (pixel >> 8) & 0xFF;
+			row[x * 3 + 2] = (pixel >> 16) & 0xFF;
+		}
+		fwrite(row.data(), 1, row.size(), file);
+	}
+	fclose(file);
+	return true;
+}
+
+int softwareMain(const AppOptions& options) {
+	SoftwareTexture texture;
+	int channels;
+	stbi_set_flip_vertically_on_load(1);
+	unsigned char* pixels = stbi_load("matin_on_the_code.png", &texture.width, &texture.height, &channels, 4);
+	if (!pixels) {
+		errorLog("AVE", "LOAD", "can't load (FloatArts.png) texture.", "");
+		return -1;
+	}
+	texture.pixels.assign(pixels, pixels + texture.width * texture.height * 4);
+	stbi_image_free(pixels);
+
+	ObjectData pyramid = { objectPyramidVertices, sizeof(objectPyramidVertices), objectPyramidIndices, sizeof(objectPyramidIndices), 
+		vertexLayoutFull, glm::vec3(0.0f), glm::vec3(0.0f) };
+	ObjectData lightCube = { objectLightVertices, sizeof(objectLightVertices), objectLightIndices, sizeof(objectLightIndices), 
+		vertexLayoutPosition, glm::vec3(0.0f), glm::vec3(0.0f) };
+	Mesh pyramidMesh, lightMesh;
+	if (!options.modelPath || !loadModel(options.modelPath, options.vertexFormat, pyramidMesh))
+		loadMesh("pyramid.mesh", pyramid, options.vertexFormat, pyramidMesh);
+	loadMesh("light.mesh", lightCube, options.vertexFormat, lightMesh);
+	pyramidBoundsMin = pyramidMesh.object.boundsMin;
+	pyramidBoundsMax = pyramidMesh.object.boundsMax;
+	setInstances(instanceGrid(options.instances, 1.5f));
+	lightSpheres = cullSpheres(std::vector<glm::mat4>(1, glm::mat4(1.0f)), boundingSphere(lightMesh.object));
+	cullingEnabled = !options.noCull;
+	buildScene();
+
+	SoftwareRenderer renderer = createSoftwareRenderer(SCREEN_WIDTH, SCREEN_HEIGHT);
+	renderer.texture = &texture;
+
+	// At least one frame, so there is an image to write and a time to report.
+	int frames = std::max(options.frames, 1);
+	double totalTime = 0.0;
+	for (int frame = 0; frame < frames; frame++) {
+		updateTransforms();
+		cullDraws();
+		std::vector<glm::mat4> instances = visibleTransforms();
+		std::vector<SoftwareDraw> draws;
+		if (!instances.empty())
+			draws.push_back({ pyramidMesh.object, cubeModel, instances.data(), (int)instances.size(), SOFTWARE_SHADER_PHONG });
+		if (lightVisible)
+			draws.push_back({ lightMesh.object, lightModel, NULL, 1, SOFTWARE_SHADER_LIGHT });
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		softwareRender(renderer, draws, buildFrameConstants());
+		totalTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	terminateMesh(pyramidMesh);
+	terminateMesh(lightMesh);
+
+	std::cout << "SOFTWARE" << " [frames: " << frames << ", ms/frame: " << 1000.0 * totalTime / frames
+		<< ", frames/sec: " << frames / totalTime << ", threads: " << jobSystem.threadCount 
+		<< "]" << std::endl;
+
+	if (!writePPM("software.ppm", renderer.width, renderer.height, renderer.pitch, renderer.color.data())) {
+		errorLog("AVE", "LOAD", "can't write (software.ppm).\n", "");
+		return -1;
+	}
+	return 0;
+}
+
+//******************************************************************************************************************************
+// Headless Rendering
+bool headlessInit() {
+#ifdef __linux__
+	// Surfaceless Mesa display, works with llvmpipe on machines without X or a GPU.
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = 
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	headlessDisplay = getPlatformDisplay ? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL) : 
+		eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (headlessDisplay == EGL_NO_DISPLAY || !eglInitialize(headlessDisplay, NULL, NULL)) {
+		errorLog("PVE", "INIT", "can't initilize egl.\n", "");
+		return false;
+	}
+
+	EGLint configAttributes[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+	EGLint contextAttributes[] = { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3, 
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, 
+#ifndef NDEBUG
+		EGL_CONTEXT_OPENGL_DEBUG, EGL_TRUE, 
+#endif
+		EGL_NONE };
+	EGLConfig config;
+	EGLint configCount = 0;
+	eglBindAPI(EGL_OPENGL_API);
+	if (!eglChooseConfig(headlessDisplay, configAttributes, &config, 1, &configCount) || configCount < 1 ||
+		(headlessContext = eglCreateContext(headlessDisplay, config, EGL_NO_CONTEXT, contextAttributes)) == EGL_NO_CONTEXT ||
+		!eglMakeCurrent(headlessDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, headlessContext)) {
+		errorLog("PVE", "INIT", "can't create a surfaceless context.\n", "");
+		eglTerminate(headlessDisplay);
+		return false;
+	}
+	return gladLoadGLLoader((GLADloadproc)eglGetProcAddress) != 0;
+#else
+	// Hidden window, its default framebuffer is never used.
+	if (!glfwInit()) {
+		errorLog("PVE", "INIT", "can't initilize glfw.", "");
+		return false;
+	}
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+#ifndef NDEBUG
+	glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GLFW_TRUE);
+#endif
+
+	headlessWindow = glfwCreateWindow(SCREEN_WIDTH, SCREEN_HEIGHT, "Float Arts", NULL, NULL);
+	if (headlessWindow == NULL) {
+		errorLog("PVE", "INIT", "can't create window.", "");
+		glfwTerminate();
+		return false;
+	}
+	glfwMakeContextCurrent(headlessWindow);
+	return gladLoadGL() != 0;
+#endif
+}
+
+void headlessTerminate() {
+#ifdef __linux__
+	eglMakeCurrent(headlessDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(headlessDisplay, headlessContext);
+	eglTerminate(headlessDisplay);
+#else
+	glfwDestroyWindow(headlessWindow);
+	glfwTerminate();
+#endif
+}
+
+// One orbit around the scene at the starting camera distance over the whole run.
+void scriptedCamera(int frame, int frames) {
+	float angle = glm::radians(360.0f) * frame / std::max(frames, 1);
+	camPos = glm::vec3(2.0f * std::sin(angle), 0.5f, 2.0f * std::cos(angle));
+	orientation = glm::normalize(glm::vec3(0.0f, 0.4f, 0.0f) - camPos);
+}
+
+// Color and depth renderbuffers, left bound as the draw framebuffer.
+OffscreenTarget createOffscreenTarget(int width, int height) {
+	OffscreenTarget target;
+	glGenFramebuffers(1, &target.FBO);
+	glGenRenderbuffers(1, &target.colorBuffer);
+	glGenRenderbuffers(1, &target.depthBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, target.colorBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, target.depthBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, target.FBO);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.colorBuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, target.depthBuffer);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		errorLog("PVE", "INIT", "offscreen framebuffer is incomplete.\n", "");
+	return target;
+}
+
+void terminateOffscreenTarget(OffscreenTarget target) {
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteRenderbuffers(1, &target.colorBuffer);
+	glDeleteRenderbuffers(1, &target.depthBuffer);
+	glDeleteFramebuffers(1, &target.FBO);
+}
+
+void renderHeadless(const AppOptions& options, const ProgramInfo& program, const ProgramInfo& lightShader, GLuint VAO, 
+	GLuint LVAO) {
+	const GLsizeiptr frameSize = SCREEN_WIDTH * SCREEN_HEIGHT * 4;
+	OffscreenTarget target = createOffscreenTarget(SCREEN_WIDTH, SCREEN_HEIGHT);
+
+	// Readbacks go through a ring of pixel buffers and are mapped a few frames later, so they don't stall the GPU.
+	GLuint PBOs[HEADLESS_READBACK_BUFFERS];
+	glGenBuffers(HEADLESS_READBACK_BUFFERS, PBOs);
+	for (int i = 0; i < HEADLESS_READBACK_BUFFERS; i++) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, PBOs[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, frameSize, NULL, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	CHECK_GL_ERRORS();
+
+	FrameWriter writer;
+	frameWriterStart(writer, options.outPrefix, options.rawFrames, SCREEN_WIDTH, SCREEN_HEIGHT);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < options.frames + HEADLESS_READBACK_BUFFERS - 1; frame++) {
+		if (frame < options.frames) {
+			scriptedCamera(frame, options.frames);
+			display(NULL, program, lightShader, VAO, LVAO);
+			CHECK_GL_ERRORS();
+
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, PBOs[frame % HEADLESS_READBACK_BUFFERS]);
+			glReadPixels(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+		}
+
+		int ready = frame - (HEADLESS_READBACK_BUFFERS - 1);
+		if (ready >= 0 && ready < options.frames) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, PBOs[ready % HEADLESS_READBACK_BUFFERS]);
+			const unsigned char* pixels = (const unsigned char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frameSize, 
+				GL_MAP_READ_BIT);
+			if (pixels) {
+				OutputFrame output;
+				output.index = ready;
+				output.pixels.assign(pixels, pixels + frameSize);
+				frameWriterPush(writer, std::move(output));
+			}
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glFinish();
+	double renderTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	frameWriterStop(writer);
+	double totalTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "HEADLESS" << " [frames: " << options.frames << ", ms/frame: " << 1000.0 * renderTime / std::max(options.frames, 1)
+		<< ", total with writes: " << totalTime << " s]" << std::endl;
+
+	glDeleteBuffers(HEADLESS_READBACK_BUFFERS, PBOs);
+	terminateOffscreenTarget(target);
+}
+
+void frameWriterStart(FrameWriter& writer, const std::string& prefix, bool raw, int width, int height) {
+	writer.prefix = prefix;
+	writer.raw = raw;
+	writer.width = width;
+	writer.height = height;
+	writer.finished = false;
+	writer.thread = std::thread([&writer]() {
+		traceThreadName("frame writer");
+		std::unique_lock<std::mutex> lock(writer.mutex);
+		while (true) {
+			writer.changed.wait(lock, [&writer]() { return writer.finished || !writer.queue.empty(); });
+			if (writer.queue.empty())
+				break;
+
+			OutputFrame frame = std::move(writer.queue.front());
+			writer.queue.pop_front();
+			writer.changed.notify_all();
+			lock.unlock();
+
+			char number[16];
+			snprintf(number, sizeof(number), "%04d", frame.index);
+			std::string path = writer.prefix + number + (writer.raw ? ".rgba" : ".png");
+			TraceZone trace(writer.raw ? "writeRaw" : "writePNG");
+			bool written = writer.raw ? writeRaw(path.c_str(), writer.width, writer.height, frame.pixels.data()) :
+				writePNG(path.c_str(), writer.width, writer.height, frame.pixels.data());
+			if (!written)
+				errorLog("AVE", "LOAD", "can't write (" + path + ").\n", "");
+
+			lock.lock();
+		}
+	});
+}
+
+void frameWriterPush(FrameWriter& writer, OutputFrame&& frame) {
+	std::unique_lock<std::mutex> lock(writer.mutex);
+	writer.changed.wait(lock, [&writer]() { return writer.queue.size() < HEADLESS_QUEUE_FRAMES; });
+	writer.queue.push_back(std::move(frame));
+	writer.changed.notify_all();
+}
+
+void frameWriterStop(FrameWriter& writer) {
+	{
+		std::lock_guard<std::mutex> lock(writer.mutex);
+		writer.finished = true;
+	}
+	writer.changed.notify_all();
+	writer.thread.join();
+}
+
+unsigned int crc32(unsigned int crc, const unsigned char* data, size_t size) {
+	static const std::vector<unsigned int> table = []() {
+		std::vector<unsigned int> entries(256);
+		for (unsigned int n = 0; n < 256; n++) {
+			unsigned int c = n;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			entries[n] = c;
+		}
+		return entries;
+	}();
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++)
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+// Uncompressed (stored deflate blocks) RGB PNG, pixels are RGBA8 rows bottom first as read by glReadPixels.
+bool writePNG(const char* path, int width, int height, const unsigned char* pixels) {
+	FILE* file = fopen(path, "wb");
+	if (!file)
+		return false;
+
+	auto putBigEndian = [](std::vector<unsigned char>& out, unsigned int value) {
+		out.push_back(value >> 24); out.push_back(value >> 16); out.push_back(value >> 8); out.push_back(value);
+	};
+	auto writeChunk = [&](const char* type, const std::vector<unsigned char>& data) {
+		std::vector<unsigned char> chunk;
+		putBigEndian(chunk, (unsigned int)data.size());
+		chunk.insert(chunk.end(), type, type + 4);
+		chunk.insert(chunk.end(), data.begin(), data.end());
+		putBigEndian(chunk, crc32(0, chunk.data() + 4, chunk.size() - 4));
+		fwrite(chunk.data(), 1, chunk.size(), file);
+	};
+
+	const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	fwrite(signature, 1, sizeof(signature), file);
+
+	std::vector<unsigned char> header;
+	putBigEndian(header, width);
+	putBigEndian(header, height);
+	header.push_back(8); // Bit depth.
+	header.push_back(2); // RGB.
+	header.push_back(0); header.push_back(0); header.push_back(0);
+	writeChunk("IHDR", header);
+
+	std::vector<unsigned char> scanlines;
+	scanlines.reserve((size_t)(width * 3 + 1) * height);
+	for (int y = height - 1; y >= 0; y--) {
+		scanlines.push_back(0); // No filter.
+		const unsigned char* row = pixels + (size_t)y * width * 4;
+		for (int x = 0; x < width; x++)
+			scanlines.insert(scanlines.end(), row + x * 4, row + x * 4 + 3);
+	}
+
+	std::vector<unsigned char> zlib = { 0x78, 0x01 };
+	unsigned int a = 1, b = 0;
+	for (size_t offset = 0; offset < scanlines.size(); offset += 65535) {
+		size_t length = std::min(scanlines.size() - offset, (size_t)65535);
+		zlib.push_back(offset + length == scanlines.size() ? 1 : 0);
+		zlib.push_back(length & 0xFF); zlib.push_back(length >> 8);
+		zlib.push_back(~length & 0xFF); zlib.push_back((~length >> 8) & 0xFF);
+		zlib.insert(zlib.end(), scanlines.begin() + offset, scanlines.begin() + offset + length);
+		for (size_t i = offset; i < offset + length; i++) {
+			a = (a + scanlines[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+	}
+	putBigEndian(zlib, (b << 16) | a);
+	writeChunk("IDAT", zlib);
+	writeChunk("IEND", std::vector<unsigned char>());
+
+	bool ok = ferror(file) == 0;
+	fclose(file);
+	return ok;
+}
+
+// RGBA8 rows top first, no header.
+bool writeRaw(const char* path, int width, int height, const unsigned char* pixels) {
+	FILE* file = fopen(path, "wb");
+	if (!file)
+		return false;
+	for (int y = height - 1; y >= 0; y--)
+		fwrite(pixels + (size_t)y * width * 4, 1, (size_t)width * 4, file);
+	bool ok = ferror(file) == 0;
+	fclose(file);
+	return ok;
+}
+
+//******************************************************************************************************************************
+// Profiler
+void profilerInit(Profiler& profiler) {
+	profiler = {};
+	glGenQueries(PROFILER_FRAMES * PROFILE_COUNT, &profiler.queries[0][0]);
+}
+
+void profilerTerminate(Profiler& profiler) {
+	glDeleteQueries(PROFILER_FRAMES * PROFILE_COUNT, &profiler.queries[0][0]);
+	profiler = {};
+}
+
+// Reads back the slot written PROFILER_FRAMES frames ago, then hands it to the new frame.
+void profilerFrame(Profiler& profiler) {
+	if (!profiler.queries[0][0])
+		return;
+	profiler.slot = profiler.frame % PROFILER_FRAMES;
+	profiler.frame++;
+
+	int slot = profiler.slot;
+	bool issued = false, ready = true;
+	for (int scope = 0; scope < PROFILE_COUNT; scope++) {
+		if (!profiler.issued[slot][scope])
+			continue;
+		GLuint available = 0;
+		DRIVER_CALL(glGetQueryObjectuiv(profiler.queries[slot][scope], GL_QUERY_RESULT_AVAILABLE, &available));
+		issued = true;
+		ready = ready && available;
+	}
+	if (!issued)
+		return;
+	// Waiting here would stall on the GPU, a late frame is dropped from the average instead.
+	if (!ready) {
+		profiler.dropped++;
+		memset(profiler.issued[slot], 0, sizeof(profiler.issued[slot]));
+		return;
+	}
+
+	ProfileSample& sample = profiler.history[profiler.historyNext];
+	for (int scope = 0; scope < PROFILE_COUNT; scope++) {
+		GLuint64 elapsed = 0;
+		if (profiler.issued[slot][scope])
+			DRIVER_CALL(glGetQueryObjectui64v(profiler.queries[slot][scope], GL_QUERY_RESULT, &elapsed));
+		sample.gpu[scope] = elapsed / 1.0e6;
+		sample.cpu[scope] = profiler.cpu[slot][scope];
+		// Timer queries give durations only, GPU passes are placed at the time they were submitted.
+		if (profiler.issued[slot][scope])
+			traceRecord(profileScopeNames[scope], "gpu", traceTime(profiler.begin[slot][scope]), elapsed / 1.0e3, 
+				TRACE_GPU_TRACK);
+		profiler.issued[slot][scope] = false;
+	}
+	profiler.historyNext = (profiler.historyNext + 1) % PROFILER_HISTORY;
+	profiler.historyCount = std::min(profiler.historyCount + 1, PROFILER_HISTORY);
+}
+
+void profilerBegin(Profiler& profiler, ProfileScope scope) {
+	if (!profiler.queries[0][0])
+		return;
+	DRIVER_CALL(glBeginQuery(GL_TIME_ELAPSED, profiler.queries[profiler.slot][scope]));
+	profiler.begin[profiler.slot][scope] = std::chrono::steady_clock::now();
+}
+
+void profilerEnd(Profiler& profiler, ProfileScope scope) {
+	if (!profiler.queries[0][0])
+		return;
+	profiler.cpu[profiler.slot][scope] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - 
+		profiler.begin[profiler.slot][scope]).count();
+	DRIVER_CALL(glEndQuery(GL_TIME_ELAPSED));
+	profiler.issued[profiler.slot][scope] = true;
+}
+
+// Mean of the rolling history, in milliseconds.
+ProfileSample profilerAverage(const Profiler& profiler) {
+	ProfileSample average = {};
+	for (int i = 0; i < profiler.historyCount; i++)
+		for (int scope = 0; scope < PROFILE_COUNT; scope++) {
+			average.cpu[scope] += profiler.history[i].cpu[scope] / profiler.historyCount;
+			average.gpu[scope] += profiler.history[i].gpu[scope] / profiler.historyCount;
+		}
+	return average;
+}
+
+void profilerLog(const Profiler& profiler) {
+	ProfileSample average = profilerAverage(profiler);
+	double cpuTotal = 0.0, gpuTotal = 0.0;
+	printf("PROFILE [frames: %d, dropped: %d]\n", profiler.historyCount, profiler.dropped);
+	printf("  %-12s %10s %10s\n", "pass", "cpu ms", "gpu ms");
+	for (int scope = 0; scope < PROFILE_COUNT; scope++) {
+		printf("  %-12s %10.4f %10.4f\n", profileScopeNames[scope], average.cpu[scope], average.gpu[scope]);
+		cpuTotal += average.cpu[scope];
+		gpuTotal += average.gpu[scope];
+	}
+	printf("  %-12s %10.4f %10.4f\n", "total", cpuTotal, gpuTotal);
+	fflush(stdout);
+}
+
+//******************************************************************************************************************************
+// Trace
+void traceStart(const char* path) {
+	tracer.file = fopen(path, "w");
+	if (!tracer.file) {
+		errorLog("AVE", "LOAD", std::string("can't write (") + path + ").\n", "");
+		return;
+	}
+	fprintf(tracer.file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	tracer.firstEvent = true;
+	tracer.start = std::chrono::steady_clock::now();
+	tracer.generation++;
+	tracer.stopping = false;
+	tracer.flushThread = std::thread([]() {
+		while (!tracer.stopping) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(TRACE_FLUSH_MS));
+			traceFlush();
+		}
+	});
+	tracer.enabled = true;
+}
+
+// Registered with atexit() so early returns from main() still close the file.
+void traceStop() {
+	if (!tracer.enabled)
+		return;
+	tracer.enabled = false;
+	tracer.stopping = true;
+	tracer.flushThread.join();
+	traceFlush();
+
+	int count = tracer.bufferCount;
+	unsigned int dropped = 0;
+	for (int i = 0; i < count; i++) {
+		fprintf(tracer.file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}", 
+			i, tracer.buffers[i]->name);
+		dropped += tracer.buffers[i]->dropped;
+		delete tracer.buffers[i];
+	}
+	fprintf(tracer.file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"GPU\"}}", 
+		TRACE_GPU_TRACK);
+	fprintf(tracer.file, "\n]}\n");
+	fclose(tracer.file);
+	tracer.file = NULL;
+	tracer.bufferCount = 0;
+	tracer.freeBuffers.clear();
+
+	if (dropped)
+		errorLog("AVE", "NONE", std::to_string(dropped) + " trace events dropped, the buffers were full.\n", "");
+}
+
+// The calling thread's buffer, created on its first event and handed to a later thread once it exits.
+TraceBuffer* traceBuffer() {
+	if (traceThread.buffer && traceThread.generation == tracer.generation)
+		return traceThread.buffer;
+
+	std::lock_guard<std::mutex> lock(tracer.registry);
+	TraceBuffer* buffer = NULL;
+	if (!tracer.freeBuffers.empty()) {
+		buffer = tracer.freeBuffers.back();
+		tracer.freeBuffers.pop_back();
+	}
+	else if (tracer.bufferCount < TRACE_MAX_THREADS) {
+		buffer = new TraceBuffer();
+		buffer->id = tracer.bufferCount;
+		buffer->name = "thread";
+		tracer.buffers[buffer->id] = buffer;
+		tracer.bufferCount.store(buffer->id + 1, std::memory_order_release);
+	}
+	traceThread.buffer = buffer;
+	traceThread.generation = tracer.generation;
+	return buffer;
+}
+
+TraceThread::~TraceThread() {
+	if (!buffer || generation != tracer.generation || !tracer.enabled)
+		return;
+	std::lock_guard<std::mutex> lock(tracer.registry);
+	tracer.freeBuffers.push_back(buffer);
+}
+
+void traceThreadName(const char* name) {
+	if (!tracer.enabled)
+		return;
+	TraceBuffer* buffer = traceBuffer();
+	if (buffer)
+		buffer->name = name;
+}
+
+double traceTime(std::chrono::steady_clock::time_point time) {
+	return std::chrono::duration<double, std::micro>(time - tracer.start).count();
+}
+
+// Single producer (the owning thread), never blocks: a full buffer drops the event.
+void traceRecord(const char* name, const char* category, double start, double duration, int track) {
+	if (!tracer.enabled)
+		return;
+	TraceBuffer* buffer = traceBuffer();
+	if (!buffer)
+		return;
+
+	unsigned int head = buffer->head.load(std::memory_order_relaxed);
+	if (head - buffer->tail.load(std::memory_order_acquire) >= TRACE_BUFFER_EVENTS) {
+		buffer->dropped++;
+		return;
+	}
+	TraceEvent& event = buffer->events[head & (TRACE_BUFFER_EVENTS - 1)];
+	event.name = name;
+	event.category = category;
+	event.start = start;
+	event.duration = duration;
+	event.track = track < 0 ? buffer->id : track;
+	buffer->head.store(head + 1, std::memory_order_release);
+}
+
+// Only called from the flush thread, and from traceStop() once it has joined.
+void traceFlush() {
+	int count = tracer.bufferCount.load(std::memory_order_acquire);
+	for (int i = 0; i < count; i++) {
+		TraceBuffer* buffer = tracer.buffers[i];
+		unsigned int tail = buffer->tail.load(std::memory_order_relaxed);
+		unsigned int head = buffer->head.load(std::memory_order_acquire);
+		for (; tail != head; tail++) {
+			const TraceEvent& event = buffer->events[tail & (TRACE_BUFFER_EVENTS - 1)];
+			fprintf(tracer.file, "%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}", 
+				tracer.firstEvent ? "" : ",\n", event.name, event.category, event.track, event.start, event.duration);
+			tracer.firstEvent = false;
+		}
+		buffer->tail.store(tail, std::memory_order_release);
+	}
+	fflush(tracer.file);
+}
+
+TraceZone::TraceZone(const char* name, const char* category) : name(name), category(category) {
+	if (tracer.enabled)
+		start = std::chrono::steady_clock::now();
+}
+
+void traceRecordSince(const char* name, std::chrono::steady_clock::time_point start, const char* category) {
+	if (tracer.enabled)
+		traceRecord(name, category, traceTime(start), 
+			std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+}
+
+TraceZone::~TraceZone() {
+	traceRecordSince(name, start, category);
+}
+
+//******************************************************************************************************************************
+// Debug Output
+void* glProcAddress(const char* name) {
+#ifdef __linux__
+	if (headlessContext != EGL_NO_CONTEXT)
+		return (void*)eglGetProcAddress(name);
+#endif
+	return (void*)glfwGetProcAddress(name);
+}
+
+bool glExtensionSupported(const char* name) {
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (GLint i = 0; i < count; i++)
+		if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name) == 0)
+			return true;
+	return false;
+}
+
+// GL 4.3 or KHR_debug, messages are asynchronous so the driver never has to sync for them.
+bool debugOutputInit() {
+	bool core = GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 3);
+	if (!core && !glExtensionSupported("GL_KHR_debug"))
+		return false;
+
+	PFNGLDEBUGMESSAGECALLBACKPROC messageCallback = 
+		(PFNGLDEBUGMESSAGECALLBACKPROC)glProcAddress(core ? "glDebugMessageCallback" : "glDebugMessageCallbackKHR");
+	PFNGLDEBUGMESSAGECONTROLPROC messageControl = 
+		(PFNGLDEBUGMESSAGECONTROLPROC)glProcAddress(core ? "glDebugMessageControl" : "glDebugMessageControlKHR");
+	if (!messageCallback || !messageControl)
+		return false;
+
+	for (unsigned int i = 0; i < DEBUG_RING_MESSAGES; i++)
+		debugOutput.messages[i].sequence.store(i, std::memory_order_relaxed);
+	messageCallback(debugCallback, NULL);
+	messageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, NULL, GL_FALSE);
+	glEnable(GL_DEBUG_OUTPUT);
+	debugOutput.enabled = true;
+	return true;
+}
+
+// Can run on driver threads, the message is copied into the ring and reported by debugOutputFlush().
+void APIENTRY debugCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, 
+	const void* /*userParam*/) {
+	unsigned int position = debugOutput.tail.load(std::memory_order_relaxed);
+	DebugMessage* slot;
+	while (true) {
+		slot = &debugOutput.messages[position & (DEBUG_RING_MESSAGES - 1)];
+		int difference = (int)(slot->sequence.load(std::memory_order_acquire) - position);
+		if (difference == 0 && debugOutput.tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+			break;
+		if (difference < 0) {
+			debugOutput.dropped++;
+			return;
+		}
+		if (difference > 0)
+			position = debugOutput.tail.load(std::memory_order_relaxed);
+	}
+
+	slot->source = source;
+	slot->type = type;
+	slot->severity = severity;
+	slot->id = id;
+	size_t size = std::min((size_t)(length < 0 ? strlen(message) : length), (size_t)DEBUG_MESSAGE_LENGTH - 1);
+	memcpy(slot->text, message, size);
+	slot->text[size] = '\0';
+	slot->sequence.store(position + 1, std::memory_order_release);
+}
+
+const char* debugTypeString(GLenum type) {
+	switch (type) {
+	case GL_DEBUG_TYPE_ERROR:               return "Error";
+	case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR: return "Deprecated behavior";
+	case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR:  return "Undefined behavior";
+	case GL_DEBUG_TYPE_PORTABILITY:         return "Portability";
+	case GL_DEBUG_TYPE_PERFORMANCE:         return "Performance";
+	default:                                return "Other";
+	}
+}
+
+// Reports the queued messages through errorLog(), GL-context thread only (whichever thread holds the context).
+void debugOutputFlush() {
+	if (!debugOutput.enabled)
+		return;
+	unsigned int position = debugOutput.head;
+	while (true) {
+		DebugMessage& slot = debugOutput.messages[position & (DEBUG_RING_MESSAGES - 1)];
+		if (slot.sequence.load(std::memory_order_acquire) != position + 1)
+			break;
+
+		const char* type = slot.source == GL_DEBUG_SOURCE_SHADER_COMPILER ? "SHAD" : "NONE";
+		std::string comment = std::string("OpenGL DEBUG ") + debugTypeString(slot.type) + " " + std::to_string(slot.id);
+		errorLog("AVE", type, std::string(slot.text) + "\n", comment);
+		slot.sequence.store(position + DEBUG_RING_MESSAGES, std::memory_order_release);
+		position++;
+	}
+	debugOutput.head = position;
+
+	unsigned int dropped = debugOutput.dropped.exchange(0);
+	if (dropped)
+		errorLog("AVE", "NONE", std::to_string(dropped) + " debug messages dropped, the ring was full.\n", "");
+}
+
+//******************************************************************************************************************************
+// Benchmark
+std::vector<CameraKey> loadCameraPath(const char* path) {
+	std::vector<CameraKey> keys;
+	FILE* file = fopen(path, "r");
+	if (!file) {
+		errorLog("AVE", "LOAD", std::string("can't load (") + path + ") camera path.\n", "");
+		return keys;
+	}
+
+	CameraKey key;
+	while (fscanf(file, "%f %f %f %f %f %f", &key.position.x, &key.position.y, &key.position.z, 
+		&key.orientation.x, &key.orientation.y, &key.orientation.z) == 6)
+		keys.push_back(key);
+	fclose(file);
+	return keys;
+}
+
+void recordCameraKey(FILE* file) {
+	fprintf(file, "%.6f %.6f %.6f %.6f %.6f %.6f\n", camPos.x, camPos.y, camPos.z, orientation.x, orientation.y, orientation.z);
+}
+
+// Nearest rank percentile of sorted values.
+double percentile(const std::vector<double>& sorted, double p) {
+	if (sorted.empty())
+		return 0.0;
+	size_t rank = (size_t)std::ceil(p / 100.0 * sorted.size());
+	return sorted[std::min(std::max(rank, (size_t)1), sorted.size()) - 1];
+}
+
+void runBenchmark(GLFWwindow* window, const AppOptions& options, const ProgramInfo& program, const ProgramInfo& lightShader, 
+	GLuint VAO, GLuint LVAO) {
+	// "orbit" replays the scripted camera of the headless mode, anything else is a file written by --record.
+	bool orbit = strcmp(options.benchmarkPath, "orbit") == 0;
+	std::vector<CameraKey> path;
+	if (!orbit) {
+		path = loadCameraPath(options.benchmarkPath);
+		if (path.empty())
+			return;
+	}
+	int frames = orbit ? options.frames : (int)path.size();
+
+	OffscreenTarget target = {};
+	if (window) {
+		glfwSwapInterval(0);
+		if (!options.noRenderThread)
+			renderStart(renderer, window);
+	}
+	else
+		target = createOffscreenTarget(SCREEN_WIDTH, SCREEN_HEIGHT);
+
+	// frame_ms is the interval of the main thread, latency_ms the time from the start of the recording of a frame to the end
+	// of its replay. The render thread buys throughput with up to one frame of latency.
+	std::vector<double> frameTimes;
+	std::chrono::steady_clock::time_point measured;
+	for (int frame = -options.warmupFrames; frame < frames; frame++) {
+		int key = std::max(frame, 0);
+		if (frame == 0) {
+			renderFinish(renderer);
+			renderer.completed.clear();
+			renderer.collect = true;
+			measured = std::chrono::steady_clock::now();
+		}
+		if (orbit)
+			scriptedCamera(key, frames);
+		else {
+			camPos = path[key].position;
+			orientation = path[key].orientation;
+		}
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		display(window, program, lightShader, VAO, LVAO, false);
+		double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		if (frame >= 0)
+			frameTimes.push_back(elapsed);
+		if (window && glfwWindowShouldClose(window))
+			break;
+	}
+	renderFinish(renderer);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - measured).count();
+	renderer.collect = false;
+	bool threaded = renderer.running;
+	renderStop(renderer);
+
+	if (window)
+		glfwSwapInterval(1);
+	else
+		terminateOffscreenTarget(target);
+	if (frameTimes.empty() || renderer.completed.empty())
+		return;
+
+	// The counters belong to the replayed frames.
+	std::vector<double> drawCalls, driverCalls, culled, occluded, avoided, latencies;
+	for (const CompletedFrame& frame : renderer.completed) {
+		drawCalls.push_back(frame.stats.drawCalls);
+		driverCalls.push_back(frame.stats.driverCalls);
+		culled.push_back(frame.stats.culledObjects);
+		occluded.push_back(frame.stats.occludedObjects);
+		avoided.push_back(frame.stats.avoidedStateChanges);
+		latencies.push_back(frame.latency);
+	}
+	renderer.completed.clear();
+
+	auto mean = [](const std::vector<double>& values) {
+		double sum = 0.0;
+		for (double value : values)
+			sum += value;
+		return sum / values.size();
+	};
+	std::vector<double> sorted = frameTimes;
+	std::sort(sorted.begin(), sorted.end());
+	std::vector<double> sortedLatencies = latencies;
+	std::sort(sortedLatencies.begin(), sortedLatencies.end());
+
+	FILE* file = fopen(options.jsonPath, "w");
+	if (!file) {
+		errorLog("AVE", "LOAD", std::string("can't write (") + options.jsonPath + ").\n", "");
+		return;
+	}
+	fprintf(file, "{\n");
+	fprintf(file, "  \"path\": \"%s\",\n", options.benchmarkPath);
+	fprintf(file, "  \"headless\": %s,\n", window ? "false" : "true");
+	fprintf(file, "  \"render_thread\": %s,\n", threaded ? "true" : "false");
+	fprintf(file, "  \"instances\": %d,\n", (int)instanceCount);
+	fprintf(file, "  \"warmup_frames\": %d,\n", options.warmupFrames);
+	fprintf(file, "  \"frames\": %d,\n", (int)frameTimes.size());
+	fprintf(file, "  \"frame_ms\": { \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f },\n", 
+		mean(frameTimes), percentile(sorted, 50.0), percentile(sorted, 95.0), percentile(sorted, 99.0), sorted.back());
+	fprintf(file, "  \"frames_per_second\": %.2f,\n", frameTimes.size() / seconds);
+	fprintf(file, "  \"latency_ms\": { \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f },\n", 
+		mean(latencies), percentile(sortedLatencies, 50.0), percentile(sortedLatencies, 95.0), 
+		percentile(sortedLatencies, 99.0), sortedLatencies.back());
+	fprintf(file, "  \"draw_calls\": { \"mean\": %.2f, \"max\": %.0f },\n", 
+		mean(drawCalls), *std::max_element(drawCalls.begin(), drawCalls.end()));
+	fprintf(file, "  \"driver_calls\": { \"mean\": %.2f, \"max\": %.0f },\n", 
+		mean(driverCalls), *std::max_element(driverCalls.begin(), driverCalls.end()));
+	fprintf(file, "  \"culled_objects\": { \"mean\": %.2f, \"max\": %.0f },\n", 
+		mean(culled), *std::max_element(culled.begin(), culled.end()));
+	fprintf(file, "  \"occluded_objects\": { \"mean\": %.2f, \"max\": %.0f },\n", 
+		mean(occluded), *std::max_element(occluded.begin(), occluded.end()));
+	fprintf(file, "  \"avoided_state_changes\": { \"mean\": %.2f, \"max\": %.0f },\n", 
+		mean(avoided), *std::max_element(avoided.begin(), avoided.end()));
+	ProfileSample passes = profilerAverage(profiler);
+	fprintf(file, "  \"passes\": {\n");
+	for (int scope = 0; scope < PROFILE_COUNT; scope++)
+		fprintf(file, "    \"%s\": { \"cpu_ms\": %.4f, \"gpu_ms\": %.4f }%s\n", profileScopeNames[scope], 
+			passes.cpu[scope], passes.gpu[scope], scope + 1 < PROFILE_COUNT ? "," : "");
+	fprintf(file, "  }\n");
+	fprintf(file, "}\n");
+	fclose(file);
+
+	std::cout << "BENCHMARK" << " [frames: " << frameTimes.size() << ", p50: " << percentile(sorted, 50.0) << " ms, p95: " 
+		<< percentile(sorted, 95.0) << " ms, p99: " << percentile(sorted, 99.0) << " ms, fps: " << frameTimes.size() / seconds 
+		<< ", latency p50: " << percentile(sortedLatencies, 50.0) << " ms] -> " << options.jsonPath << std::endl;
+}
+
+//******************************************************************************************************************************
+// Texture Streaming
+void textureStreamerInit(TextureStreamer& streamer) {
+	// Grey checkerboard bound in place of every texture still streaming.
+	const unsigned char checker[] = { 96, 96, 96, 255, 160, 160, 160, 255, 160, 160, 160, 255, 96, 96, 96, 255 };
+	glGenTextures(1, &streamer.placeholder);
+	stateBindTexture(glState, streamer.placeholder);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 2, 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, checker);
+
+	glGenBuffers(TEXTURE_UPLOAD_PBOS, streamer.PBOs);
+	streamer.compressed = glExtensionSupported("GL_EXT_texture_compression_s3tc");
+	streamer.nextPBO = 0;
+	streamer.uploading = false;
+	streamer.pending = 0;
+}
+
+void textureStreamerTerminate(TextureStreamer& streamer) {
+	jobWait(streamer.decodes);
+
+	for (DecodedImage& image : streamer.decoded)
+		stbi_image_free(image.pixels);
+	streamer.decoded.clear();
+	if (streamer.uploading)
+		stbi_image_free(streamer.upload.pixels);
+	streamer.uploading = false;
+
+	for (StreamedTexture& texture : streamer.textures)
+		glDeleteTextures(1, &texture.id);
+	streamer.textures.clear();
+	glDeleteTextures(1, &streamer.placeholder);
+	glState.texture = 0; // Deleting unbinds it.
+	glDeleteBuffers(TEXTURE_UPLOAD_PBOS, streamer.PBOs);
+}
+
+// Background job, the result is picked up by textureStreamerUpdate().
+void textureDecode(TextureStreamer& streamer, const TextureJob& job) {
+	stbi_set_flip_vertically_on_load_thread(1);
+	DecodedImage image;
+	image.texture = job.texture;
+	image.pixels = NULL;
+	if (streamer.compressed) {
+		TraceZone trace("loadCookedTexture");
+		if (!loadCookedTexture(job.path, image.compressed, NULL))
+			errorLog("AVE", "LOAD", "can't load (" + job.path + ") texture.\n", "");
+	}
+	else {
+		TraceZone trace("stbi_load");
+		int channels;
+		image.pixels = stbi_load(job.path.c_str(), &image.width, &image.height, &channels, 4);
+		if (!image.pixels)
+			errorLog("AVE", "LOAD", "can't load (" + job.path + ") texture: " + stbi_failure_reason() + ".\n", "");
+	}
+
+	std::lock_guard<std::mutex> lock(streamer.mutex);
+	streamer.decoded.push_back(std::move(image));
+}
+
+// Queues the decode, the returned handle resolves to the placeholder until the upload finishes.
+int textureRequest(TextureStreamer& streamer, const std::string& path) {
+	StreamedTexture texture;
+	glGenTextures(1, &texture.id);
+	texture.ready = false;
+	streamer.textures.push_back(texture);
+	streamer.pending++;
+
+	int handle = (int)streamer.textures.size() - 1;
+	TextureJob job = { handle, path };
+	jobSubmitBackground([&streamer, job]() { textureDecode(streamer, job); }, &streamer.decodes);
+	return handle;
+}
+
+GLuint streamedTexture(const TextureStreamer& streamer, int handle) {
+	return streamer.textures[handle].ready ? streamer.textures[handle].id : streamer.placeholder;
+}
+
+// Copies at most TEXTURE_UPLOAD_BUDGET bytes of decoded rows through the PBOs, call once per frame on the GL thread.
+void textureStreamerUpdate(TextureStreamer& streamer) {
+	if (!streamer.pending)
+		return;
+	TraceZone trace("textureStreamerUpdate");
+
+	size_t budget = TEXTURE_UPLOAD_BUDGET;
+	while (budget > 0) {
+		if (!streamer.uploading) {
+			{
+				std::lock_guard<std::mutex> lock(streamer.mutex);
+				if (streamer.decoded.empty())
+					break;
+				streamer.upload = std::move(streamer.decoded.front());
+				streamer.decoded.pop_front();
+			}
+			if (!streamer.upload.pixels && streamer.upload.compressed.levels.empty()) {
+				streamer.pending--;
+				continue;
+			}
+
+			// Storage first, rows follow over as many frames as the budget needs.
+			stateBindTexture(glState, streamer.textures[streamer.upload.texture].id);
+			DRIVER_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR)); // GL_NEAREST, GL_LINEAR
+			DRIVER_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+			DRIVER_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT)); // S R T : X Y Z
+			DRIVER_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT));
+			if (streamer.upload.pixels)
+				DRIVER_CALL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, streamer.upload.width, streamer.upload.height, 0, GL_RGBA, 
+					GL_UNSIGNED_BYTE, NULL));
+			else
+				DRIVER_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 
+					(GLint)streamer.upload.compressed.levels.size() - 1));
+			streamer.uploadedRows = 0;
+			streamer.uploadedLevels = 0;
+			streamer.uploading = true;
+		}
+
+		DecodedImage& image = streamer.upload;
+		if (!image.pixels) {
+			// Whole levels, the prebuilt mip chain replaces glGenerateMipmap.
+			const CompressedImage& compressed = image.compressed;
+			const TextureLevel& level = compressed.levels[streamer.uploadedLevels];
+			GLuint PBO = streamer.PBOs[streamer.nextPBO];
+			streamer.nextPBO = (streamer.nextPBO + 1) % TEXTURE_UPLOAD_PBOS;
+			DRIVER_CALL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, PBO));
+			DRIVER_CALL(glBufferData(GL_PIXEL_UNPACK_BUFFER, level.size, compressed.data.data() + level.offset, GL_STREAM_DRAW));
+			stateBindTexture(glState, streamer.textures[image.texture].id);
+			DRIVER_CALL(glCompressedTexImage2D(GL_TEXTURE_2D, streamer.uploadedLevels, compressed.format, level.width, 
+				level.height, 0, (GLsizei)level.size, (void*)0));
+			DRIVER_CALL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+
+			budget -= std::min(level.size, budget);
+			if (++streamer.uploadedLevels == (int)compressed.levels.size()) {
+				streamer.textures[image.texture].ready = true;
+				streamer.uploading = false;
+				streamer.pending--;
+			}
+			continue;
+		}
+
+		size_t rowSize = (size_t)image.width * 4;
+		int rows = std::min(image.height - streamer.uploadedRows, std::max((int)(budget / rowSize), 1));
+		size_t size = rows * rowSize;
+
+		// Orphaned before every map, the driver hands out fresh storage instead of waiting on the last upload.
+		GLuint PBO = streamer.PBOs[streamer.nextPBO];
+		streamer.nextPBO = (streamer.nextPBO + 1) % TEXTURE_UPLOAD_PBOS;
+		DRIVER_CALL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, PBO));
+		DRIVER_CALL(glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW));
+		void* mapped = DRIVER_CALL(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, 
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+		if (mapped) {
+			memcpy(mapped, image.pixels + streamer.uploadedRows * rowSize, size);
+			DRIVER_CALL(glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER));
+			stateBindTexture(glState, streamer.textures[image.texture].id);
+			DRIVER_CALL(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, streamer.uploadedRows, image.width, rows, GL_RGBA, 
+				GL_UNSIGNED_BYTE, (void*)0));
+		}
+		else
+			errorLog("AVE", "LOAD", "can't map the texture upload buffer.\n", "");
+		DRIVER_CALL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+
+		streamer.uploadedRows += rows;
+		budget -= std::min(size, budget);
+		if (streamer.uploadedRows == image.height) {
+			TraceZone trace("glGenerateMipmap");
+			DRIVER_CALL(glGenerateMipmap(GL_TEXTURE_2D));
+			stbi_image_free(image.pixels);
+			streamer.textures[image.texture].ready = true;
+			streamer.uploading = false;
+			streamer.pending--;
+		}
+	}
+}
+
+// Blocks until every requested texture is resident, for runs that need identical frames.
+void textureStreamerFinish(TextureStreamer& streamer) {
+	while (streamer.pending) {
+		textureStreamerUpdate(streamer);
+		if (streamer.pending)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+//******************************************************************************************************************************
+// Texture Cooker
+bool readFile(const std::string& path, std::vector<unsigned char>& data) {
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	data.resize(size > 0 ? size : 0);
+	bool read = size >= 0 && fread(data.data(), 1, data.size(), file) == data.size();
+	fclose(file);
+	return read;
+}
+
+// FNV-1a.
+unsigned long long contentHash(const unsigned char* data, size_t size) {
+	unsigned long long hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ data[i]) * 1099511628211ULL;
+	return hash;
+}
+
+// Next to the source, "image.png" caches to "image.<hash>.ktx2".
+std::string cacheFilePath(const std::string& path, unsigned long long hash, const char* extension) {
+	size_t dot = path.find_last_of('.');
+	size_t slash = path.find_last_of("/\\");
+	std::string stem = dot == std::string::npos || (slash != std::string::npos && dot < slash) ? path : path.substr(0, dot);
+	char suffix[24];
+	snprintf(suffix, sizeof(suffix), ".%016llx", hash);
+	return stem + suffix + extension;
+}
+
+// 2x2 box filter of RGBA8, odd edges repeat the last texel.
+void downsample(const unsigned char* src, int width, int height, unsigned char* dst) {
+	int dstWidth = std::max(width / 2, 1), dstHeight = std::max(height / 2, 1);
+	const __m128i zero = _mm_setzero_si128(), two = _mm_set1_epi16(2);
+	for (int y = 0; y < dstHeight; y++) {
+		const unsigned char* row0 = src + (size_t)std::min(2 * y, height - 1) * width * 4;
+		const unsigned char* row1 = src + (size_t)std::min(2 * y + 1, height - 1) * width * 4;
+		unsigned char* out = dst + (size_t)y * dstWidth * 4;
+
+		int x = 0;
+		for (; 2 * x + 3 < width && x + 1 < dstWidth; x += 2) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(row0 + 8 * x));
+			__m128i b = _mm_loadu_si128((const __m128i*)(row1 + 8 * x));
+			__m128i low = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+			__m128i high = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+			low = _mm_add_epi16(low, _mm_srli_si128(low, 8));
+			high = _mm_add_epi16(high, _mm_srli_si128(high, 8));
+			__m128i sum = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(low, high), two), 2);
+			_mm_storel_epi64((__m128i*)(out + 4 * x), _mm_packus_epi16(sum, zero));
+		}
+		for (; x < dstWidth; x++) {
+			int x0 = std::min(2 * x, width - 1) * 4, x1 = std::min(2 * x + 1, width - 1) * 4;
+			for (int c = 0; c < 4; c++)
+				out[4 * x + c] = (unsigned char)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+		}
+	}
+}
+
+unsigned short packColor565(const unsigned char* color) {
+	return (unsigned short)(((color[0] * 31 + 127) / 255) << 11 | ((color[1] * 63 + 127) / 255) << 5 | 
+		((color[2] * 31 + 127) / 255));
+}
+
+void unpackColor565(unsigned short packed, int* color) {
+	int r = packed >> 11, g = (packed >> 5) & 63, b = packed & 31;
+	color[0] = (r << 3) | (r >> 2);
+	color[1] = (g << 2) | (g >> 4);
+	color[2] = (b << 3) | (b >> 2);
+}
+
+// Bounding box endpoints inset by 1/16 of the range, always the four color mode.
+void encodeColorBlock(const unsigned char* block, unsigned char* out) {
+	__m128i low = _mm_loadu_si128((const __m128i*)block), high = low;
+	for (int i = 1; i < 4; i++) {
+		__m128i pixels = _mm_loadu_si128((const __m128i*)(block + 16 * i));
+		low = _mm_min_epu8(low, pixels);
+		high = _mm_max_epu8(high, pixels);
+	}
+	low = _mm_min_epu8(low, _mm_shuffle_epi32(low, 0x4E));
+	low = _mm_min_epu8(low, _mm_shuffle_epi32(low, 0xB1));
+	high = _mm_max_epu8(high, _mm_shuffle_epi32(high, 0x4E));
+	high = _mm_max_epu8(high, _mm_shuffle_epi32(high, 0xB1));
+
+	unsigned char minColor[4], maxColor[4];
+	int packedMin = _mm_cvtsi128_si32(low), packedMax = _mm_cvtsi128_si32(high);
+	memcpy(minColor, &packedMin, 4);
+	memcpy(maxColor, &packedMax, 4);
+	for (int c = 0; c < 3; c++) {
+		int inset = (maxColor[c] - minColor[c]) >> 4;
+		minColor[c] = (unsigned char)(minColor[c] + inset);
+		maxColor[c] = (unsigned char)(maxColor[c] - inset);
+	}
+
+	unsigned short color0 = packColor565(maxColor), color1 = packColor565(minColor);
+	if (color0 < color1)
+		std::swap(color0, color1);
+	unsigned int indices = 0;
+	if (color0 != color1) {
+		int palette[4][3];
+		unpackColor565(color0, palette[0]);
+		unpackColor565(color1, palette[1]);
+		for (int c = 0; c < 3; c++) {
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+		}
+		for (int i = 0; i < 16; i++) {
+			int best = 0, bestDistance = INT_MAX;
+			for (int p = 0; p < 4; p++) {
+				int dr = block[4 * i] - palette[p][0], dg = block[4 * i + 1] - palette[p][1], db = block[4 * i + 2] - palette[p][2];
+				int distance = dr * dr + dg * dg + db * db;
+				if (distance < bestDistance) {
+					bestDistance = distance;
+					best = p;
+				}
+			}
+			indices |= best << (2 * i);
+		}
+	}
+	out[0] = color0 & 0xFF;
+	out[1] = color0 >> 8;
+	out[2] = color1 & 0xFF;
+	out[3] = color1 >> 8;
+	memcpy(out + 4, &indices, 4);
+}
+
+// Eight interpolated alphas between the block's extremes.
+void encodeAlphaBlock(const unsigned char* block, unsigned char* out) {
+	int alpha0 = 0, alpha1 = 255;
+	for (int i = 0; i < 16; i++) {
+		alpha0 = std::max(alpha0, (int)block[4 * i + 3]);
+		alpha1 = std::min(alpha1, (int)block[4 * i + 3]);
+	}
+	unsigned long long indices = 0;
+	if (alpha0 != alpha1) {
+		int palette[8] = { alpha0, alpha1 };
+		for (int p = 2; p < 8; p++)
+			palette[p] = ((8 - p) * alpha0 + (p - 1) * alpha1) / 7;
+		for (int i = 0; i < 16; i++) {
+			int best = 0;
+			for (int p = 1; p < 8; p++)
+				if (abs(block[4 * i + 3] - palette[p]) < abs(block[4 * i + 3] - palette[best]))
+					best = p;
+			indices |= (unsigned long long)best << (3 * i);
+		}
+	}
+	out[0] = (unsigned char)alpha0;
+	out[1] = (unsigned char)alpha1;
+	for (int i = 0; i < 6; i++)
+		out[2 + i] = (unsigned char)(indices >> (8 * i));
+}
+
+// BC1 when every texel is opaque, BC3 otherwise. Mips are built on the CPU down to 1x1.
+void cookTexture(const unsigned char* pixels, int width, int height, CompressedImage& image) {
+	bool opaque = true;
+	for (size_t i = 3; i < (size_t)width * height * 4 && opaque; i += 4)
+		opaque = pixels[i] == 255;
+	image.format = opaque ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	int blockSize = opaque ? 8 : 16;
+
+	std::vector<unsigned char> level(pixels, pixels + (size_t)width * height * 4), next;
+	image.levels.clear();
+	image.data.clear();
+	while (true) {
+		TextureLevel info;
+		info.width = width;
+		info.height = height;
+		info.offset = image.data.size();
+		info.size = (size_t)((width + 3) / 4) * ((height + 3) / 4) * blockSize;
+		image.levels.push_back(info);
+		image.data.resize(info.offset + info.size);
+
+		unsigned char* out = image.data.data() + info.offset;
+		for (int by = 0; by < height; by += 4)
+			for (int bx = 0; bx < width; bx += 4) {
+				unsigned char block[64];
+				for (int y = 0; y < 4; y++)
+					for (int x = 0; x < 4; x++)
+						memcpy(block + 16 * y + 4 * x, 
+							&level[((size_t)std::min(by + y, height - 1) * width + std::min(bx + x, width - 1)) * 4], 4);
+				if (!opaque) {
+					encodeAlphaBlock(block, out);
+					out += 8;
+				}
+				encodeColorBlock(block, out);
+				out += 8;
+			}
+
+		if (width == 1 && height == 1)
+			break;
+		next.resize((size_t)std::max(width / 2, 1) * std::max(height / 2, 1) * 4);
+		downsample(level.data(), width, height, next.data());
+		level.swap(next);
+		width = std::max(width / 2, 1);
+		height = std::max(height / 2, 1);
+	}
+}
+
+// KTX2 with the Khronos basic data format descriptor, level data is stored smallest first.
+bool writeKTX2(const std::string& path, const CompressedImage& image) {
+	bool bc1 = image.format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	unsigned int blockSize = bc1 ? 8 : 16;
+	std::vector<unsigned int> dfd;
+	dfd.push_back(0); // dfdTotalSize
+	dfd.push_back(0); // vendorId, descriptorType
+	dfd.push_back(2 | (24 + 16 * (bc1 ? 1 : 2)) << 16); // versionNumber, descriptorBlockSize
+	dfd.push_back((bc1 ? 128 : 130) | 1 << 8 | 1 << 16); // BC1A/BC3 color model, BT709, linear
+	dfd.push_back(3 | 3 << 8); // 4x4 texel blocks
+	dfd.push_back(blockSize);
+	dfd.push_back(0);
+	if (!bc1) {
+		unsigned int alphaSample[] = { 0 | 63 << 16 | 15u << 24, 0, 0, 0xFFFFFFFF };
+		dfd.insert(dfd.end(), alphaSample, alphaSample + 4);
+	}
+	unsigned int colorSample[] = { (bc1 ? 0u : 64u) | 63 << 16, 0, 0, 0xFFFFFFFF };
+	dfd.insert(dfd.end(), colorSample, colorSample + 4);
+	dfd[0] = (unsigned int)(dfd.size() * 4);
+
+	// Rows are bottom first like glTexImage2D expects.
+	const char key[] = "KTXorientation\0ru";
+	std::vector<unsigned char> kvd(4 + sizeof(key));
+	unsigned int entrySize = sizeof(key);
+	memcpy(kvd.data(), &entrySize, 4);
+	memcpy(kvd.data() + 4, key, sizeof(key));
+	kvd.resize((kvd.size() + 3) & ~3);
+
+	unsigned int levelCount = (unsigned int)image.levels.size();
+	size_t dfdOffset = 80 + 24 * levelCount;
+	size_t kvdOffset = dfdOffset + dfd.size() * 4;
+	size_t dataOffset = (kvdOffset + kvd.size() + blockSize - 1) / blockSize * blockSize;
+
+	std::vector<unsigned long long> levelIndex(3 * levelCount);
+	size_t offset = dataOffset;
+	for (int l = (int)levelCount - 1; l >= 0; l--) {
+		levelIndex[3 * l] = offset;
+		levelIndex[3 * l + 1] = image.levels[l].size;
+		levelIndex[3 * l + 2] = image.levels[l].size;
+		offset = (offset + image.levels[l].size + blockSize - 1) / blockSize * blockSize;
+	}
+
+	const unsigned char identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+	unsigned int header[9] = { bc1 ? 131u : 137u, 1, (unsigned int)image.levels[0].width, (unsigned int)image.levels[0].height, 
+		0, 0, 1, levelCount, 0 };
+	unsigned int index[4] = { (unsigned int)dfdOffset, (unsigned int)dfd.size() * 4, (unsigned int)kvdOffset, 
+		(unsigned int)kvd.size() };
+	unsigned long long superCompression[2] = { 0, 0 };
+
+	std::vector<unsigned char> file(offset, 0);
+	memcpy(&file[0], identifier, 12);
+	memcpy(&file[12], header, sizeof(header));
+	memcpy(&file[48], index, sizeof(index));
+	memcpy(&file[64], superCompression, sizeof(superCompression));
+	memcpy(&file[80], levelIndex.data(), levelIndex.size() * 8);
+	memcpy(&file[dfdOffset], dfd.data(), dfd.size() * 4);
+	memcpy(&file[kvdOffset], kvd.data(), kvd.size());
+	for (unsigned int l = 0; l < levelCount; l++)
+		memcpy(&file[(size_t)levelIndex[3 * l]], image.data.data() + image.levels[l].offset, image.levels[l].size);
+
+	FILE* out = fopen(path.c_str(), "wb");
+	if (!out)
+		return false;
+	bool written = fwrite(file.data(), 1, file.size(), out) == file.size();
+	return fclose(out) == 0 && written;
+}
+
+// Only reads back what writeKTX2() produces: BC1/BC3, one layer and face, no supercompression.
+bool readKTX2(const std::string& path, CompressedImage& image) {
+	std::vector<unsigned char> file;
+	const unsigned char identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+	if (!readFile(path, file) || file.size() < 80 || memcmp(file.data(), identifier, 12) != 0)
+		return false;
+
+	unsigned int header[9];
+	memcpy(header, &file[12], sizeof(header));
+	if ((header[0] != 131 && header[0] != 137) || header[4] > 1 || header[5] != 0 || header[6] != 1 || header[8] != 0 || 
+		header[7] == 0 || file.size() < 80 + 24 * (size_t)header[7])
+		return false;
+
+	image.format = header[0] == 131 ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	image.levels.resize(header[7]);
+	image.data.clear();
+	for (unsigned int l = 0; l < header[7]; l++) {
+		unsigned long long range[2];
+		memcpy(range, &file[80 + 24 * l], sizeof(range));
+		if (range[0] + range[1] > file.size())
+			return false;
+		TextureLevel& level = image.levels[l];
+		level.width = std::max((int)(header[2] >> l), 1);
+		level.height = std::max((int)(header[3] >> l), 1);
+		level.offset = image.data.size();
+		level.size = (size_t)range[1];
+		image.data.insert(image.data.end(), file.begin() + (size_t)range[0], file.begin() + (size_t)(range[0] + range[1]));
+	}
+	return true;
+}
+
+// Cached KTX2 when the source hash matches, otherwise decodes, cooks and writes the cache.
+bool loadCookedTexture(const std::string& path, CompressedImage& image, bool* cooked) {
+	std::vector<unsigned char> source;
+	if (!readFile(path, source))
+		return false;
+	unsigned long long hash = contentHash(source.data(), source.size()) ^ TEXTURE_CACHE_VERSION;
+	std::string cachePath = cacheFilePath(path, hash, ".ktx2");
+	if (cooked)
+		*cooked = false;
+	if (readKTX2(cachePath, image))
+		return true;
+
+	int width, height, channels;
+	unsigned char* pixels = stbi_load_from_memory(source.data(), (int)source.size(), &width, &height, &channels, 4);
+	if (!pixels)
+		return false;
+	{
+		TraceZone trace("cookTexture");
+		cookTexture(pixels, width, height, image);
+	}
+	stbi_image_free(pixels);
+	if (!writeKTX2(cachePath, image))
+		errorLog("AVE", "LOAD", "can't write (" + cachePath + ").\n", "");
+	if (cooked)
+		*cooked = true;
+	return true;
+}
+
+// --cook: builds the cache ahead of time, no GL context needed.
+int cookMain(const AppOptions& options) {
+	stbi_set_flip_vertically_on_load_thread(1);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	CompressedImage image;
+	bool cooked;
+	if (!loadCookedTexture(options.cookPath, image, &cooked)) {
+		errorLog("AVE", "LOAD", std::string("can't cook (") + options.cookPath + ") texture.\n", "");
+		return -1;
+	}
+	double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	size_t uncompressed = 0;
+	for (const TextureLevel& level : image.levels)
+		uncompressed += (size_t)level.width * level.height * 4;
+	std::cout << "COOK" << " [" << options.cookPath << (cooked ? " cooked" : " cached") << ", format: " 
+		<< (image.format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? "BC1" : "BC3") << ", levels: " << image.levels.size() 
+		<< ", bytes: " << uncompressed << " -> " << image.data.size() << ", ms: " << elapsed << "]" << std::endl;
+	return 0;
+}
+
+//******************************************************************************************************************************
+// Mesh Files
+// Read-only view of a whole file, the pages are loaded on first access.
+bool mapFile(const char* path, MappedFile& file) {
+	file.data = NULL;
+	file.size = 0;
+#ifdef _WIN32
+	file.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file.file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	file.mapping = GetFileSizeEx(file.file, &size) && size.QuadPart > 0 ? 
+		CreateFileMappingA(file.file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	if (file.mapping)
+		file.data = (const unsigned char*)MapViewOfFile(file.mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!file.data) {
+		if (file.mapping)
+			CloseHandle(file.mapping);
+		CloseHandle(file.file);
+		return false;
+	}
+	file.size = (size_t)size.QuadPart;
+#else
+	file.descriptor = open(path, O_RDONLY);
+	if (file.descriptor < 0)
+		return false;
+	struct stat info;
+	void* data = fstat(file.descriptor, &info) == 0 && info.st_size > 0 ? 
+		mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file.descriptor, 0) : MAP_FAILED;
+	if (data == MAP_FAILED) {
+		close(file.descriptor);
+		return false;
+	}
+	file.data = (const unsigned char*)data;
+	file.size = (size_t)info.st_size;
+#endif
+	return true;
+}
+
+void unmapFile(MappedFile& file) {
+	if (!file.data)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(file.data);
+	CloseHandle(file.mapping);
+	CloseHandle(file.file);
+#else
+	munmap((void*)file.data, file.size);
+	close(file.descriptor);
+#endif
+	file.data = NULL;
+	file.size = 0;
+}
+
+const VertexAttribute* findAttribute(const VertexLayout& layout, GLuint location) {
+	for (unsigned int i = 0; i < layout.attributeCount; i++)
+		if (layout.attributes[i].location == location)
+			return &layout.attributes[i];
+	return NULL;
+}
+
+// Object space bounds of the float3 positions, for culling without touching the vertices. Quantized positions bring their
+// bounds along.
+void objectBounds(const ObjectData& object, glm::vec3& boundsMin, glm::vec3& boundsMax) {
+	const VertexAttribute* position = findAttribute(object.layout, 0);
+	size_t vertexCount = object.verticesSize / object.layout.stride;
+	if (!position || position->type != GL_FLOAT || position->components < 3) {
+		boundsMin = object.boundsMin;
+		boundsMax = object.boundsMax;
+		return;
+	}
+	boundsMin = glm::vec3(vertexCount ? FLT_MAX : 0.0f);
+	boundsMax = glm::vec3(vertexCount ? -FLT_MAX : 0.0f);
+	for (size_t v = 0; v < vertexCount; v++) {
+		const float* p = (const float*)((const unsigned char*)object.vertices + v * object.layout.stride + position->offset);
+		boundsMin = glm::min(boundsMin, glm::make_vec3(p));
+		boundsMax = glm::max(boundsMax, glm::make_vec3(p));
+	}
+}
+
+bool writeMesh(const char* path, const ObjectData& object) {
+	MeshFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MESH_FILE_MAGIC, 4);
+	header.version = MESH_FILE_VERSION;
+	header.layout = object.layout;
+	header.indexType = GL_UNSIGNED_INT;
+	header.vertexCount = (unsigned int)(object.verticesSize / object.layout.stride);
+	header.indexCount = (unsigned int)(object.indicesSize / sizeof(GLuint));
+	header.vertexOffset = (sizeof(header) + MESH_FILE_ALIGNMENT - 1) / MESH_FILE_ALIGNMENT * MESH_FILE_ALIGNMENT;
+	header.vertexSize = object.verticesSize;
+	header.indexOffset = (header.vertexOffset + header.vertexSize + MESH_FILE_ALIGNMENT - 1) / MESH_FILE_ALIGNMENT * 
+		MESH_FILE_ALIGNMENT;
+	header.indexSize = object.indicesSize;
+
+	glm::vec3 boundsMin, boundsMax;
+	objectBounds(object, boundsMin, boundsMax);
+	memcpy(header.boundsMin, glm::value_ptr(boundsMin), sizeof(header.boundsMin));
+	memcpy(header.boundsMax, glm::value_ptr(boundsMax), sizeof(header.boundsMax));
+
+	std::vector<unsigned char> data((size_t)(header.indexOffset + header.indexSize), 0);
+	memcpy(data.data(), &header, sizeof(header));
+	memcpy(data.data() + header.vertexOffset, object.vertices, object.verticesSize);
+	memcpy(data.data() + header.indexOffset, object.indices, object.indicesSize);
+
+	FILE* file = fopen(path, "wb");
+	if (!file)
+		return false;
+	bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+	return fclose(file) == 0 && written;
+}
+
+// Maps the file and points the object straight at its blobs, nothing is parsed or copied.
+bool loadMesh(const char* path, Mesh& mesh) {
+	if (!mapFile(path, mesh.file))
+		return false;
+
+	// Everything downstream indexes the blobs without checks, so a truncated or corrupt file is rejected here.
+	const MeshFileHeader* header = (const MeshFileHeader*)mesh.file.data;
+	size_t size = mesh.file.size;
+	bool valid = size >= sizeof(MeshFileHeader) && memcmp(header->magic, MESH_FILE_MAGIC, 4) == 0 && 
+		header->version == MESH_FILE_VERSION && header->indexType == GL_UNSIGNED_INT && 
+		header->layout.attributeCount <= MESH_MAX_ATTRIBUTES && header->layout.stride > 0 && 
+		header->vertexSize <= size && header->vertexOffset <= size - header->vertexSize && 
+		header->indexSize <= size && header->indexOffset <= size - header->indexSize && header->indexOffset % sizeof(GLuint) == 0 && 
+		header->vertexSize == (unsigned long long)header->vertexCount * header->layout.stride && 
+		header->indexSize == (unsigned long long)header->indexCount * sizeof(GLuint);
+	for (GLuint i = 0; valid && i < header->layout.attributeCount; i++) {
+		const VertexAttribute& attribute = header->layout.attributes[i];
+		GLuint bytes = attributeSize(attribute);
+		valid = bytes > 0 && attribute.offset <= header->layout.stride && bytes <= header->layout.stride - attribute.offset;
+	}
+	if (valid) {
+		const GLuint* indices = (const GLuint*)(mesh.file.data + header->indexOffset);
+		for (GLuint i = 0; valid && i < header->indexCount; i++)
+			valid = indices[i] < header->vertexCount;
+	}
+	if (!valid) {
+		errorLog("AVE", "LOAD", std::string("(") + path + ") is not a valid version " + std::to_string(MESH_FILE_VERSION) + 
+			" mesh file.\n", "");
+		unmapFile(mesh.file);
+		return false;
+	}
+
+	mesh.object.vertices = mesh.file.data + header->vertexOffset;
+	mesh.object.verticesSize = (size_t)header->vertexSize;
+	mesh.object.indices = mesh.file.data + header->indexOffset;
+	mesh.object.indicesSize = (size_t)header->indexSize;
+	mesh.object.layout = header->layout;
+	mesh.object.boundsMin = glm::make_vec3(header->boundsMin);
+	mesh.object.boundsMax = glm::make_vec3(header->boundsMax);
+	return true;
+}
+
+// The built-in arrays are optimized, packed and written to "<name>.<hash>.mesh" the first time, every later run maps the file.
+bool loadMesh(const char* name, const ObjectData& builtIn, VertexFormat format, Mesh& mesh) {
+	bool packable = memcmp(&builtIn.layout, &vertexLayoutFull, sizeof(VertexLayout)) == 0;
+	const VertexLayout& layout = packable ? vertexFormatLayout(format) : builtIn.layout;
+	// Keyed like loadModel(), so editing the built-in arrays never picks up a stale file.
+	unsigned long long hash = contentHash((const unsigned char*)builtIn.vertices, builtIn.verticesSize) ^ 
+		contentHash((const unsigned char*)builtIn.indices, builtIn.indicesSize) * 31 ^ MESH_FILE_VERSION ^ 
+		((unsigned long long)format << 32);
+	std::string cachePath = cacheFilePath(name, hash, ".mesh");
+	const char* path = cachePath.c_str();
+	if (loadMesh(path, mesh)) {
+		if (memcmp(&mesh.object.layout, &layout, sizeof(VertexLayout)) == 0)
+			return true;
+		terminateMesh(mesh);
+	}
+
+	std::vector<unsigned char> vertices((const unsigned char*)builtIn.vertices, 
+		(const unsigned char*)builtIn.vertices + builtIn.verticesSize);
+	std::vector<GLuint> indices((const GLuint*)builtIn.indices, (const GLuint*)builtIn.indices + builtIn.indicesSize / sizeof(GLuint));
+	optimizeMesh(name, vertices.data(), vertices.size() / builtIn.layout.stride, builtIn.layout, indices.data(), indices.size());
+	ObjectData optimized = builtIn;
+	optimized.vertices = vertices.data();
+	optimized.indices = indices.data();
+	std::vector<unsigned char> packed;
+	packVertices(name, optimized, format, packed, optimized);
+	if (writeMesh(path, optimized) && loadMesh(path, mesh))
+		return true;
+
+	errorLog("AVE", "LOAD", std::string("can't load (") + path + ") mesh, using the built-in copy.\n", "");
+	mesh.file.data = NULL;
+	mesh.object = builtIn;
+	objectBounds(builtIn, mesh.object.boundsMin, mesh.object.boundsMax);
+	return false;
+}
+
+void terminateMesh(Mesh& mesh) {
+	unmapFile(mesh.file);
+}
+
+//******************************************************************************************************************************
+// Model Import
+// Decimal float without locale or errno handling, accurate to a few ulps which is plenty for vertex data.
+const char* parseFloat(const char* p, const char* end, float& value) {
+	static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 
+		1e16, 1e17, 1e18 };
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	bool negative = p < end && *p == '-';
+	if (p < end && (*p == '-' || *p == '+'))
+		p++;
+
+	unsigned long long mantissa = 0;
+	int digits = 0, exponent = 0;
+	const char* start = p;
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+		if (digits < 18) {
+			mantissa = mantissa * 10 + (*p - '0');
+			digits += mantissa != 0;
+		}
+		else
+			exponent++;
+	if (p < end && *p == '.')
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+			if (digits < 18) {
+				mantissa = mantissa * 10 + (*p - '0');
+				digits += mantissa != 0;
+				exponent--;
+			}
+	if (p == start) {
+		value = 0.0f;
+		return p;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char* e = p + 1;
+		bool negativeExponent = e < end && *e == '-';
+		if (e < end && (*e == '-' || *e == '+'))
+			e++;
+		if (e < end && *e >= '0' && *e <= '9') {
+			int power = 0;
+			for (; e < end && *e >= '0' && *e <= '9'; e++)
+				power = std::min(power * 10 + (*e - '0'), 1000);
+			exponent += negativeExponent ? -power : power;
+			p = e;
+		}
+	}
+
+	double result = (double)mantissa;
+	for (; exponent > 18; exponent -= 18)
+		result *= powers[18];
+	for (; exponent < -18; exponent += 18)
+		result /= powers[18];
+	result = exponent >= 0 ? result * powers[exponent] : result / powers[-exponent];
+	value = (float)(negative ? -result : result);
+	return p;
+}
+
+const char* parseInt(const char* p, const char* end, int& value) {
+	bool negative = p < end && *p == '-';
+	if (p < end && (*p == '-' || *p == '+'))
+		p++;
+	value = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+		value = value * 10 + (*p - '0');
+	if (negative)
+		value = -value;
+	return p;
+}
+
+// One OBJ index, relative (negative) indices are resolved later against the attribute counts seen before the face.
+int objIndex(int index, int seen) {
+	return index > 0 ? index - 1 : (index < 0 ? seen + index : -1);
+}
+
+// Parses whole lines of [begin, end). Face corners keep the raw OBJ index and the chunk local attribute counts.
+void parseObjChunk(const char* begin, const char* end, ObjChunk& chunk) {
+	const char* p = begin;
+	while (p < end) {
+		const char* line = p;
+		const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+		lineEnd = lineEnd ? lineEnd : end;
+		p = lineEnd + 1;
+		while (line < lineEnd && (*line == ' ' || *line == '\t'))
+			line++;
+		if (lineEnd - line < 2)
+			continue;
+
+		if (line[0] == 'v' && line[1] == ' ') {
+			float value[6] = {};
+			const char* q = line + 2;
+			int count = 0;
+			for (; count < 6; count++) {
+				const char* next = parseFloat(q, lineEnd, value[count]);
+				if (next == q || (next < lineEnd && *next != ' ' && *next != '\t' && *next != '\r'))
+					break;
+				q = next;
+			}
+			// Still stored, so the face indices after it keep pointing at the right vertices.
+			if (count < 3)
+				chunk.malformed++;
+			chunk.positions.insert(chunk.positions.end(), value, value + 3);
+			// Vertex colors are a common extension: "v x y z r g b".
+			for (int c = 3; c < 6; c++)
+				chunk.colors.push_back(count == 6 ? value[c] : 1.0f);
+		}
+		else if (line[0] == 'v' && line[1] == 't') {
+			float u = 0.0f, v = 0.0f;
+			const char* q = parseFloat(line + 2, lineEnd, u);
+			parseFloat(q, lineEnd, v);
+			chunk.texCoords.push_back(u);
+			chunk.texCoords.push_back(v);
+		}
+		else if (line[0] == 'v' && line[1] == 'n') {
+			float n[3] = {};
+			const char* q = line + 2;
+			for (int c = 0; c < 3; c++)
+				q = parseFloat(q, lineEnd, n[c]);
+			chunk.normals.insert(chunk.normals.end(), n, n + 3);
+		}
+		else if (line[0] == 'f' && line[1] == ' ') {
+			// Polygons are split into a triangle fan.
+			ObjCorner first = {}, previous = {}, corner;
+			int count = 0;
+			const char* q = line + 2;
+			while (true) {
+				while (q < lineEnd && (*q == ' ' || *q == '\t' || *q == '\r'))
+					q++;
+				if (q >= lineEnd)
+					break;
+				int index[3] = { 0, 0, 0 };
+				for (int k = 0; k < 3; k++) {
+					if (k > 0) {
+						if (q >= lineEnd || *q != '/')
+							break;
+						q++;
+					}
+					q = parseInt(q, lineEnd, index[k]);
+				}
+				while (q < lineEnd && *q != ' ' && *q != '\t' && *q != '\r')
+					q++;
+
+				corner.position = index[0];
+				corner.texCoord = index[1];
+				corner.normal = index[2];
+				corner.positionsSeen = (int)chunk.positions.size() / 3;
+				corner.texCoordsSeen = (int)chunk.texCoords.size() / 2;
+				corner.normalsSeen = (int)chunk.normals.size() / 3;
+				if (count == 0)
+					first = corner;
+				else if (count >= 2) {
+					chunk.corners.push_back(first);
+					chunk.corners.push_back(previous);
+					chunk.corners.push_back(corner);
+				}
+				previous = corner;
+				count++;
+			}
+		}
+	}
+}
+
+unsigned int objCornerHash(const ObjCornerKey& key) {
+	return ((unsigned int)key.position * 73856093u) ^ ((unsigned int)key.texCoord * 19349663u) ^ 
+		((unsigned int)key.normal * 83492791u);
+}
+
+// Area weighted vertex normals, for files without "vn".
+void generateNormals(ImportedMesh& mesh) {
+	size_t vertexCount = mesh.vertices.size() / 11;
+	for (size_t v = 0; v < vertexCount; v++)
+		mesh.vertices[v * 11 + 8] = mesh.vertices[v * 11 + 9] = mesh.vertices[v * 11 + 10] = 0.0f;
+	for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+		float* v[3];
+		for (int k = 0; k < 3; k++)
+			v[k] = &mesh.vertices[mesh.indices[i + k] * 11];
+		glm::vec3 a = glm::make_vec3(v[0]), b = glm::make_vec3(v[1]), c = glm::make_vec3(v[2]);
+		glm::vec3 normal = glm::cross(b - a, c - a);
+		for (int k = 0; k < 3; k++)
+			for (int j = 0; j < 3; j++)
+				v[k][8 + j] += normal[j];
+	}
+	for (size_t v = 0; v < vertexCount; v++) {
+		glm::vec3 normal = glm::make_vec3(&mesh.vertices[v * 11 + 8]);
+		float length = glm::length(normal);
+		if (length > 0.0f)
+			normal /= length;
+		memcpy(&mesh.vertices[v * 11 + 8], &normal[0], sizeof(float) * 3);
+	}
+}
+
+bool importObj(const MappedFile& file, ImportedMesh& mesh) {
+	const char* data = (const char*)file.data;
+	size_t size = file.size;
+
+	// Chunks end on a line break so no line is split between two workers.
+	int chunkCount = (int)std::max(std::min(size / IMPORT_CHUNK_SIZE, (size_t)IMPORT_MAX_CHUNKS), (size_t)1);
+	std::vector<size_t> bounds(chunkCount + 1, size);
+	bounds[0] = 0;
+	for (int c = 1; c < chunkCount; c++) {
+		size_t cut = std::max(bounds[c - 1], size * c / chunkCount);
+		const char* lineBreak = (const char*)memchr(data + cut, '\n', size - cut);
+		bounds[c] = lineBreak ? lineBreak - data + 1 : size;
+	}
+
+	std::vector<ObjChunk> chunks(chunkCount);
+	parallelFor(chunkCount, [&](int c) {
+		TraceZone trace("parseObjChunk");
+		parseObjChunk(data + bounds[c], data + bounds[c + 1], chunks[c]);
+	});
+
+	// Attribute offsets of every chunk, then the chunk local indices become global ones.
+	std::vector<float> positions, colors, texCoords, normals;
+	std::vector<ObjCornerKey> corners;
+	size_t totals[4] = {};
+	for (const ObjChunk& chunk : chunks) {
+		if (chunk.malformed > 0) {
+			errorLog("AVE", "LOAD", "vertex with fewer than 3 coordinates.\n", "OBJ");
+			return false;
+		}
+		totals[0] += chunk.positions.size();
+		totals[1] += chunk.texCoords.size();
+		totals[2] += chunk.normals.size();
+		totals[3] += chunk.corners.size();
+	}
+	positions.reserve(totals[0]);
+	colors.reserve(totals[0]);
+	texCoords.reserve(totals[1]);
+	normals.reserve(totals[2]);
+	corners.reserve(totals[3]);
+	for (ObjChunk& chunk : chunks) {
+		int positionBase = (int)positions.size() / 3, texCoordBase = (int)texCoords.size() / 2;
+		int normalBase = (int)normals.size() / 3;
+		for (const ObjCorner& corner : chunk.corners) {
+			ObjCornerKey key;
+			key.position = objIndex(corner.position, positionBase + corner.positionsSeen);
+			key.texCoord = objIndex(corner.texCoord, texCoordBase + corner.texCoordsSeen);
+			key.normal = objIndex(corner.normal, normalBase + corner.normalsSeen);
+			corners.push_back(key);
+		}
+		positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+		colors.insert(colors.end(), chunk.colors.begin(), chunk.colors.end());
+		texCoords.insert(texCoords.end(), chunk.texCoords.begin(), chunk.texCoords.end());
+		normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+		chunk = ObjChunk();
+	}
+
+	int positionCount = (int)positions.size() / 3, texCoordCount = (int)texCoords.size() / 2;
+	int normalCount = (int)normals.size() / 3;
+	// Open addressing table of vertex indices, at most half full.
+	size_t tableSize = 16;
+	while (tableSize < corners.size() * 2)
+		tableSize *= 2;
+	std::vector<GLuint> table(tableSize, UINT_MAX);
+	std::vector<ObjCornerKey> unique;
+	mesh.indices.reserve(corners.size());
+	mesh.vertices.reserve(positions.size() / 3 * 11);
+	for (const ObjCornerKey& key : corners) {
+		if (key.position < 0 || key.position >= positionCount) {
+			errorLog("AVE", "LOAD", "face refers to a missing vertex.\n", "OBJ");
+			return false;
+		}
+		size_t slot = objCornerHash(key) & (tableSize - 1);
+		while (table[slot] != UINT_MAX) {
+			const ObjCornerKey& other = unique[table[slot]];
+			if (other.position == key.position && other.texCoord == key.texCoord && other.normal == key.normal)
+				break;
+			slot = (slot + 1) & (tableSize - 1);
+		}
+		if (table[slot] != UINT_MAX) {
+			mesh.indices.push_back(table[slot]);
+			continue;
+		}
+		table[slot] = (GLuint)unique.size();
+		mesh.indices.push_back(table[slot]);
+		unique.push_back(key);
+
+		float vertex[11] = {};
+		memcpy(vertex, &positions[key.position * 3], sizeof(float) * 3);
+		memcpy(vertex + 3, &colors[key.position * 3], sizeof(float) * 3);
+		if (key.texCoord >= 0 && key.texCoord < texCoordCount)
+			memcpy(vertex + 6, &texCoords[key.texCoord * 2], sizeof(float) * 2);
+		if (key.normal >= 0 && key.normal < normalCount)
+			memcpy(vertex + 8, &normals[key.normal * 3], sizeof(float) * 3);
+		mesh.vertices.insert(mesh.vertices.end(), vertex, vertex + 11);
+	}
+	mesh.corners = corners.size();
+	if (normalCount == 0)
+		generateNormals(mesh);
+	return true;
+}
+
+// Minimal JSON reader for glTF, no unicode escapes beyond ASCII.
+const char* parseJson(const char* p, const char* end, JsonValue& value, int depth) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+		p++;
+	if (p >= end || depth > 64)
+		return NULL;
+
+	if (*p == '{' || *p == '[') {
+		bool object = *p == '{';
+		value.type = object ? JSON_OBJECT : JSON_ARRAY;
+		for (p++;;) {
+			while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' || *p == ','))
+				p++;
+			if (p >= end)
+				return NULL;
+			if (*p == (object ? '}' : ']'))
+				return p + 1;
+
+			std::string key;
+			if (object) {
+				JsonValue name;
+				p = parseJson(p, end, name, depth + 1);
+				while (p && p < end && *p != ':')
+					p++;
+				if (!p || p >= end || name.type != JSON_STRING)
+					return NULL;
+				key = name.string;
+				p++;
+			}
+			value.items.push_back(JsonValue());
+			value.keys.push_back(key);
+			p = parseJson(p, end, value.items.back(), depth + 1);
+			if (!p)
+				return NULL;
+		}
+	}
+	if (*p == '"') {
+		value.type = JSON_STRING;
+		for (p++; p < end && *p != '"'; p++) {
+			if (*p == '\\' && p + 1 < end) {
+				p++;
+				char escaped = *p == 'n' ? '\n' : *p == 't' ? '\t' : *p == 'r' ? '\r' : *p == 'b' ? '\b' : *p == 'f' ? '\f' : *p;
+				if (*p == 'u') {
+					int code = (int)strtol(std::string(p + 1, std::min(p + 5, end)).c_str(), NULL, 16);
+					escaped = code < 128 ? (char)code : '?';
+					p = std::min(p + 4, end - 1);
+				}
+				value.string += escaped;
+			}
+			else
+				value.string += *p;
+		}
+		return p < end ? p + 1 : NULL;
+	}
+	if ((end - p >= 4 && strncmp(p, "true", 4) == 0) || (end - p >= 5 && strncmp(p, "false", 5) == 0)) {
+		value.type = JSON_BOOL;
+		value.boolean = *p == 't';
+		return p + (value.boolean ? 4 : 5);
+	}
+	if (end - p >= 4 && strncmp(p, "null", 4) == 0) {
+		value.type = JSON_NULL;
+		return p + 4;
+	}
+
+	float number;
+	const char* next = parseFloat(p, end, number);
+	if (next == p)
+		return NULL;
+	value.type = JSON_NUMBER;
+	value.number = number;
+	return next;
+}
+
+const JsonValue* jsonMember(const JsonValue* object, const char* key) {
+	if (!object || object->type != JSON_OBJECT)
+		return NULL;
+	for (size_t i = 0; i < object->keys.size(); i++)
+		if (object->keys[i] == key)
+			return &object->items[i];
+	return NULL;
+}
+
+const JsonValue* jsonItem(const JsonValue* array, int index) {
+	if (!array || array->type != JSON_ARRAY || index < 0 || index >= (int)array->items.size())
+		return NULL;
+	return &array->items[index];
+}
+
+double jsonNumber(const JsonValue* value, double fallback) {
+	return value && value->type == JSON_NUMBER ? value->number : fallback;
+}
+
+bool decodeBase64(const std::string& text, std::vector<unsigned char>& data) {
+	int buffer = 0, bits = 0;
+	for (char c : text) {
+		int digit = c >= 'A' && c <= 'Z' ? c - 'A' : c >= 'a' && c <= 'z' ? c - 'a' + 26 : c >= '0' && c <= '9' ? c - '0' + 52 : 
+			c == '+' ? 62 : c == '/' ? 63 : -1;
+		if (digit < 0)
+			continue;
+		buffer = (buffer << 6) | digit;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			data.push_back((unsigned char)(buffer >> bits));
+		}
+	}
+	return !data.empty();
+}
+
+// Reads one element of an accessor as floats, normalized integers are mapped to [0, 1]. components is the count the
+// accessor type must have (1 SCALAR .. 4 VEC4), 0 accepts any.
+bool gltfAccessor(const GltfModel& model, int index, int components, GltfAccessor& accessor) {
+	const JsonValue* info = jsonItem(jsonMember(&model.json, "accessors"), index);
+	if (!info || jsonMember(info, "sparse"))
+		return false;
+	const JsonValue* view = jsonItem(jsonMember(&model.json, "bufferViews"), (int)jsonNumber(jsonMember(info, "bufferView"), -1));
+	int buffer = (int)jsonNumber(jsonMember(view, "buffer"), -1);
+	if (!view || buffer < 0 || buffer >= (int)model.buffers.size())
+		return false;
+
+	const JsonValue* type = jsonMember(info, "type");
+	std::string typeName = type && type->type == JSON_STRING ? type->string : "";
+	accessor.components = typeName == "SCALAR" ? 1 : typeName == "VEC2" ? 2 : typeName == "VEC3" ? 3 : typeName == "VEC4" ? 4 : 0;
+	accessor.componentType = (int)jsonNumber(jsonMember(info, "componentType"), 0);
+	accessor.normalized = jsonMember(info, "normalized") && jsonMember(info, "normalized")->boolean;
+	accessor.count = (size_t)jsonNumber(jsonMember(info, "count"), 0);
+	if (!accessor.components || (components && accessor.components != components) || accessor.componentType < 5120 || 
+		accessor.componentType > 5126 || accessor.componentType == 5124)
+		return false;
+	int componentSize = accessor.componentType == 5120 || accessor.componentType == 5121 ? 1 : 
+		accessor.componentType == 5122 || accessor.componentType == 5123 ? 2 : 4;
+	accessor.stride = (size_t)jsonNumber(jsonMember(view, "byteStride"), 0);
+	if (!accessor.stride)
+		accessor.stride = (size_t)componentSize * accessor.components;
+
+	size_t offset = (size_t)jsonNumber(jsonMember(view, "byteOffset"), 0) + (size_t)jsonNumber(jsonMember(info, "byteOffset"), 0);
+	const std::vector<unsigned char>& data = model.buffers[buffer];
+	if ((accessor.count && offset + accessor.stride * (accessor.count - 1) + 
+		componentSize * accessor.components > data.size()))
+		return false;
+	accessor.data = data.data() + offset;
+	return true;
+}
+
+// An attribute the primitive doesn't reference is fine, one it references with the wrong type is not.
+bool gltfOptionalAccessor(const GltfModel& model, const JsonValue* index, int components, GltfAccessor& accessor, bool& present) {
+	present = gltfAccessor(model, (int)jsonNumber(index, -1), components, accessor);
+	return present || !index;
+}
+
+float gltfComponent(const GltfAccessor& accessor, size_t element, int component) {
+	const unsigned char* p = accessor.data + element * accessor.stride;
+	switch (accessor.componentType) {
+	case 5120: return accessor.normalized ? std::max(((const signed char*)p)[component] / 127.0f, -1.0f) : ((const signed char*)p)[component];
+	case 5121: return accessor.normalized ? p[component] / 255.0f : p[component];
+	case 5122: return accessor.normalized ? std::max(((const short*)p)[component] / 32767.0f, -1.0f) : ((const short*)p)[component];
+	case 5123: return accessor.normalized ? ((const unsigned short*)p)[component] / 65535.0f : ((const unsigned short*)p)[component];
+	case 5125: return (float)((const unsigned int*)p)[component];
+	default:   return ((const float*)p)[component];
+	}
+}
+
+GLuint gltfIndex(const GltfAccessor& accessor, size_t element) {
+	const unsigned char* p = accessor.data + element * accessor.stride;
+	return accessor.componentType == 5121 ? *p : accessor.componentType == 5123 ? *(const unsigned short*)p : 
+		*(const unsigned int*)p;
+}
+
+void gltfCollectNodes(const GltfModel& model, int node, const glm::mat4& parent, std::vector<GltfDraw>& draws, int depth) {
+	const JsonValue* info = jsonItem(jsonMember(&model.json, "nodes"), node);
+	if (!info || depth > 64)
+		return;
+
+	glm::mat4 local = glm::mat4(1.0f);
+	const JsonValue* matrix = jsonMember(info, "matrix");
+	if (matrix && matrix->items.size() == 16) {
+		for (int i = 0; i < 16; i++)
+			local[i / 4][i % 4] = (float)jsonNumber(&matrix->items[i], 0.0);
+	}
+	else {
+		const JsonValue* t = jsonMember(info, "translation");
+		const JsonValue* r = jsonMember(info, "rotation");
+		const JsonValue* s = jsonMember(info, "scale");
+		if (t && t->items.size() == 3)
+			local = glm::translate(local, glm::vec3(jsonNumber(&t->items[0], 0), jsonNumber(&t->items[1], 0), jsonNumber(&t->items[2], 0)));
+		if (r && r->items.size() == 4)
+			local = local * glm::mat4_cast(glm::quat((float)jsonNumber(&r->items[3], 1), (float)jsonNumber(&r->items[0], 0), 
+				(float)jsonNumber(&r->items[1], 0), (float)jsonNumber(&r->items[2], 0)));
+		if (s && s->items.size() == 3)
+			local = glm::scale(local, glm::vec3(jsonNumber(&s->items[0], 1), jsonNumber(&s->items[1], 1), jsonNumber(&s->items[2], 1)));
+	}
+	glm::mat4 world = parent * local;
+
+	const JsonValue* primitives = jsonMember(jsonItem(jsonMember(&model.json, "meshes"), (int)jsonNumber(jsonMember(info, "mesh"), -1)), 
+		"primitives");
+	if (primitives)
+		for (const JsonValue& primitive : primitives->items)
+			draws.push_back({ &primitive, world });
+	const JsonValue* children = jsonMember(info, "children");
+	if (children)
+		for (const JsonValue& child : children->items)
+			gltfCollectNodes(model, (int)jsonNumber(&child, -1), world, draws, depth + 1);
+}
+
+// Converts one triangle primitive into the 11 float layout, glTF primitives are already indexed.
+// 1 when converted, 0 for a primitive that isn't triangles, -1 for accessors of the wrong type or out of range indices.
+int gltfPrimitive(const GltfModel& model, const GltfDraw& draw, ImportedMesh& out) {
+	int mode = (int)jsonNumber(jsonMember(draw.primitive, "mode"), 4);
+	const JsonValue* attributes = jsonMember(draw.primitive, "attributes");
+	GltfAccessor position, normal, texCoord, color, indices;
+	if (mode != 4)
+		return 0;
+	bool hasNormal, hasTexCoord, hasColor, hasIndices;
+	if (!gltfAccessor(model, (int)jsonNumber(jsonMember(attributes, "POSITION"), -1), 3, position) || 
+		!gltfOptionalAccessor(model, jsonMember(attributes, "NORMAL"), 3, normal, hasNormal) || 
+		!gltfOptionalAccessor(model, jsonMember(attributes, "TEXCOORD_0"), 2, texCoord, hasTexCoord) || 
+		!gltfOptionalAccessor(model, jsonMember(attributes, "COLOR_0"), 0, color, hasColor) || 
+		!gltfOptionalAccessor(model, jsonMember(draw.primitive, "indices"), 1, indices, hasIndices))
+		return -1;
+	// Colors are VEC3 or VEC4, indices unsigned bytes, shorts or ints.
+	if ((hasColor && color.components < 3) || (hasIndices && indices.componentType != 5121 && 
+		indices.componentType != 5123 && indices.componentType != 5125))
+		return -1;
+
+	glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(draw.world)));
+	out.vertices.resize(position.count * 11);
+	for (size_t v = 0; v < position.count; v++) {
+		float* vertex = &out.vertices[v * 11];
+		glm::vec4 p = draw.world * glm::vec4(gltfComponent(position, v, 0), gltfComponent(position, v, 1), 
+			gltfComponent(position, v, 2), 1.0f);
+		vertex[0] = p.x;
+		vertex[1] = p.y;
+		vertex[2] = p.z;
+		for (int c = 0; c < 3; c++)
+			vertex[3 + c] = hasColor && v < color.count ? gltfComponent(color, v, c) : 1.0f;
+		// glTF texture coordinates start at the top, the textures here are uploaded bottom row first.
+		vertex[6] = hasTexCoord && v < texCoord.count ? gltfComponent(texCoord, v, 0) : 0.0f;
+		vertex[7] = hasTexCoord && v < texCoord.count ? 1.0f - gltfComponent(texCoord, v, 1) : 0.0f;
+		glm::vec3 n = hasNormal && v < normal.count ? glm::normalize(normalMatrix * glm::vec3(gltfComponent(normal, v, 0), 
+			gltfComponent(normal, v, 1), gltfComponent(normal, v, 2))) : glm::vec3(0.0f);
+		vertex[8] = n.x;
+		vertex[9] = n.y;
+		vertex[10] = n.z;
+	}
+
+	size_t indexCount = hasIndices ? indices.count : position.count;
+	out.indices.resize(indexCount - indexCount % 3);
+	for (size_t i = 0; i < out.indices.size(); i++) {
+		out.indices[i] = hasIndices ? gltfIndex(indices, i) : (GLuint)i;
+		if (out.indices[i] >= position.count)
+			return -1;
+	}
+	out.corners = out.indices.size();
+	if (!hasNormal)
+		generateNormals(out);
+	return 1;
+}
+
+bool importGltf(const char* path, const MappedFile& file, ImportedMesh& mesh) {
+	GltfModel model;
+	const char* json = (const char*)file.data;
+	size_t jsonSize = file.size;
+	std::vector<unsigned char> binary;
+
+	// .glb: 12 byte header, then a JSON chunk and an optional BIN chunk.
+	if (file.size >= 20 && memcmp(file.data, "glTF", 4) == 0) {
+		unsigned int chunkLength, chunkType;
+		memcpy(&chunkLength, file.data + 12, 4);
+		memcpy(&chunkType, file.data + 16, 4);
+		if (chunkType != 0x4E4F534A || 20 + (size_t)chunkLength > file.size)
+			return false;
+		json = (const char*)file.data + 20;
+		jsonSize = chunkLength;
+		size_t binOffset = 20 + (size_t)chunkLength;
+		if (binOffset + 8 <= file.size) {
+			memcpy(&chunkLength, file.data + binOffset, 4);
+			memcpy(&chunkType, file.data + binOffset + 4, 4);
+			if (chunkType == 0x004E4942 && binOffset + 8 + chunkLength <= file.size)
+				binary.assign(file.data + binOffset + 8, file.data + binOffset + 8 + chunkLength);
+		}
+	}
+	if (!parseJson(json, json + jsonSize, model.json, 0)) {
+		errorLog("AVE", "LOAD", std::string("(") + path + ") has malformed JSON.\n", "glTF");
+		return false;
+	}
+
+	// Buffers are the BIN chunk, a data URI or a file next to the model.
+	std::string directory = path;
+	size_t slash = directory.find_last_of("/\\");
+	directory = slash == std::string::npos ? "" : directory.substr(0, slash + 1);
+	const JsonValue* buffers = jsonMember(&model.json, "buffers");
+	for (size_t b = 0; buffers && b < buffers->items.size(); b++) {
+		const JsonValue* uri = jsonMember(&buffers->items[b], "uri");
+		model.buffers.push_back(std::vector<unsigned char>());
+		if (!uri)
+			model.buffers.back().swap(binary);
+		else if (uri->string.compare(0, 5, "data:") == 0)
+			decodeBase64(uri->string.substr(uri->string.find(',') + 1), model.buffers.back());
+		else if (!readFile(directory + uri->string, model.buffers.back()))
+			errorLog("AVE", "LOAD", "can't load (" + directory + uri->string + ") buffer.\n", "glTF");
+	}
+
+	std::vector<GltfDraw> draws;
+	const JsonValue* scene = jsonItem(jsonMember(&model.json, "scenes"), (int)jsonNumber(jsonMember(&model.json, "scene"), 0));
+	const JsonValue* roots = jsonMember(scene, "nodes");
+	if (roots)
+		for (const JsonValue& root : roots->items)
+			gltfCollectNodes(model, (int)jsonNumber(&root, -1), glm::mat4(1.0f), draws, 0);
+	else {
+		const JsonValue* meshes = jsonMember(&model.json, "meshes");
+		for (size_t m = 0; meshes && m < meshes->items.size(); m++) {
+			const JsonValue* primitives = jsonMember(&meshes->items[m], "primitives");
+			for (size_t p = 0; primitives && p < primitives->items.size(); p++)
+				draws.push_back({ &primitives->items[p], glm::mat4(1.0f) });
+		}
+	}
+
+	std::vector<ImportedMesh> parts(draws.size());
+	std::vector<int> converted(draws.size());
+	parallelFor((int)draws.size(), [&](int d) {
+		TraceZone trace("gltfPrimitive");
+		converted[d] = gltfPrimitive(model, draws[d], parts[d]);
+	});
+	for (size_t d = 0; d < parts.size(); d++) {
+		if (converted[d] < 0) {
+			errorLog("AVE", "LOAD", std::string("(") + path + ") has a primitive with accessors of the wrong type.\n", "glTF");
+			return false;
+		}
+		if (!converted[d]) {
+			errorLog("AVE", "LOAD", std::string("(") + path + ") has a primitive that is not indexed triangles, skipped.\n", "glTF");
+			continue;
+		}
+		GLuint base = (GLuint)(mesh.vertices.size() / 11);
+		mesh.vertices.insert(mesh.vertices.end(), parts[d].vertices.begin(), parts[d].vertices.end());
+		for (GLuint index : parts[d].indices)
+			mesh.indices.push_back(base + index);
+		mesh.corners += parts[d].corners;
+	}
+	return !mesh.indices.empty();
+}
+
+// Hash of the buffer files a glTF refers to by uri, they are part of the model but not of the mapped file.
+unsigned long long gltfBufferHash(const char* path, const MappedFile& file) {
+	const char* json = (const char*)file.data;
+	size_t jsonSize = file.size;
+	if (file.size >= 20 && memcmp(file.data, "glTF", 4) == 0) {
+		unsigned int chunkLength;
+		memcpy(&chunkLength, file.data + 12, 4);
+		json = (const char*)file.data + 20;
+		jsonSize = std::min((size_t)chunkLength, file.size - 20);
+	}
+	JsonValue root;
+	if (!parseJson(json, json + jsonSize, root, 0))
+		return 0;
+
+	std::string directory = path;
+	size_t slash = directory.find_last_of("/\\");
+	directory = slash == std::string::npos ? "" : directory.substr(0, slash + 1);
+	unsigned long long hash = 0;
+	const JsonValue* buffers = jsonMember(&root, "buffers");
+	for (size_t b = 0; buffers && b < buffers->items.size(); b++) {
+		const JsonValue* uri = jsonMember(&buffers->items[b], "uri");
+		MappedFile buffer;
+		// Data URIs are already in the JSON, a missing file hashes as empty so it is picked up once it exists.
+		if (!uri || uri->string.compare(0, 5, "data:") == 0 || !mapFile((directory + uri->string).c_str(), buffer))
+			continue;
+		hash ^= contentHash(buffer.data, buffer.size) * (b + 1);
+		unmapFile(buffer);
+	}
+	return hash;
+}
+
+bool importModel(const char* path, const MappedFile& file, ImportedMesh& mesh) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::string extension = path;
+	extension = extension.substr(std::min(extension.find_last_of('.'), extension.size()));
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	mesh.corners = 0;
+	bool imported = extension == ".obj" ? importObj(file, mesh) : 
+		extension == ".gltf" || extension == ".glb" ? importGltf(path, file, mesh) : false;
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (imported)
+		std::cout << "IMPORT" << " [" << path << ", MB: " << file.size / 1.0e6 << ", MB/s: " << file.size / 1.0e6 / elapsed 
+			<< ", triangles: " << mesh.indices.size() / 3 << ", vertices: " << mesh.vertices.size() / 11 << " (from " 
+			<< mesh.corners << " corners), threads: " << jobSystem.threadCount << "]" << std::endl;
+	else
+		errorLog("AVE", "LOAD", std::string("can't import (") + path + "), only .obj, .gltf and .glb are read.\n", "");
+	return imported;
+}
+
+// Warm starts map "<model>.<hash>.mesh", cold starts import the model and write that file.
+bool loadModel(const char* path, VertexFormat format, Mesh& mesh) {
+	MappedFile source;
+	if (!mapFile(path, source)) {
+		errorLog("AVE", "LOAD", std::string("can't load (") + path + ") model.\n", "");
+		return false;
+	}
+	std::string extension = path;
+	extension = extension.substr(std::min(extension.find_last_of('.'), extension.size()));
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	unsigned long long hash = contentHash(source.data, source.size) ^ MESH_FILE_VERSION ^ ((unsigned long long)format << 32);
+	if (extension == ".gltf" || extension == ".glb")
+		hash ^= gltfBufferHash(path, source) * 31;
+	std::string meshPath = cacheFilePath(path, hash, ".mesh");
+	if (loadMesh(meshPath.c_str(), mesh)) {
+		unmapFile(source);
+		return true;
+	}
+
+	ImportedMesh imported;
+	bool importedModel = importModel(path, source, imported);
+	unmapFile(source);
+	if (!importedModel)
+		return false;
+	optimizeMesh(path, imported.vertices.data(), imported.vertices.size() / 11, vertexLayoutFull, imported.indices.data(), 
+		imported.indices.size());
+	ObjectData object = { imported.vertices.data(), imported.vertices.size() * sizeof(float), imported.indices.data(), 
+		imported.indices.size() * sizeof(GLuint), vertexLayoutFull, glm::vec3(0.0f), glm::vec3(0.0f) };
+	std::vector<unsigned char> packed;
+	packVertices(path, object, format, packed, object);
+	if (writeMesh(meshPath.c_str(), object) && loadMesh(meshPath.c_str(), mesh))
+		return true;
+
+	// The model itself is fine, only the next start has to import it again.
+	errorLog("AVE", "LOAD", "can't write (" + meshPath + "), using the imported model without a cache.\n", "");
+	mesh.file.data = NULL;
+	mesh.vertices.assign((const unsigned char*)object.vertices, (const unsigned char*)object.vertices + object.verticesSize);
+	mesh.indices.swap(imported.indices);
+	mesh.object = object;
+	mesh.object.vertices = mesh.vertices.data();
+	mesh.object.indices = mesh.indices.data();
+	objectBounds(object, mesh.object.boundsMin, mesh.object.boundsMax);
+	return true;
+}
+
+//******************************************************************************************************************************
+// Mesh Optimization
+// Misses of a FIFO post-transform cache, per triangle (ACMR) and per referenced vertex (ATVR).
+bool vertexCacheStats(const GLuint* indices, size_t indexCount, size_t vertexCount, float& acmr, float& atvr) {
+	std::vector<size_t> insertedAt(vertexCount, 0); // Miss count when the vertex entered the cache, 0 when never.
+	size_t misses = 0, referenced = 0;
+	for (size_t i = 0; i < indexCount; i++) {
+		if (indices[i] >= vertexCount)
+			return false;
+		size_t& stamp = insertedAt[indices[i]];
+		referenced += stamp == 0;
+		if (stamp == 0 || misses - stamp >= VERTEX_CACHE_SIZE)
+			stamp = ++misses;
+	}
+	acmr = indexCount ? (float)misses / (indexCount / 3) : 0.0f;
+	atvr = referenced ? (float)misses / referenced : 0.0f;
+	return true;
+}
+
+// Tipsify (Sander et al. 2007): fans around the cached vertex that stays resident longest. A new cluster starts
+// whenever the fan has to jump to a vertex that already left the cache.
+void tipsify(const GLuint* indices, size_t triangleCount, std::vector<GLuint>& out, std::vector<size_t>& clusters) {
+	// Batch local vertex ids keep the per vertex arrays as small as the batch.
+	std::vector<GLuint> vertices(indices, indices + triangleCount * 3);
+	std::sort(vertices.begin(), vertices.end());
+	vertices.erase(std::unique(vertices.begin(), vertices.end()), vertices.end());
+	size_t vertexCount = vertices.size();
+	std::vector<unsigned int> local(triangleCount * 3);
+	for (size_t i = 0; i < local.size(); i++)
+		local[i] = (unsigned int)(std::lower_bound(vertices.begin(), vertices.end(), indices[i]) - vertices.begin());
+
+	// Triangles around every vertex.
+	std::vector<unsigned int> live(vertexCount, 0), offsets(vertexCount + 1, 0), adjacency(triangleCount * 3);
+	for (unsigned int v : local)
+		live[v]++;
+	for (size_t v = 0; v < vertexCount; v++)
+		offsets[v + 1] = offsets[v] + live[v];
+	std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+	for (size_t i = 0; i < local.size(); i++)
+		adjacency[fill[local[i]]++] = (unsigned int)(i / 3);
+
+	std::vector<int> cachedAt(vertexCount, 0);
+	std::vector<char> emitted(triangleCount, 0);
+	std::vector<unsigned int> deadEnds, candidates;
+	int time = VERTEX_CACHE_SIZE + 1;
+	size_t cursor = 0;
+	long long fan = 0;
+	out.reserve(triangleCount * 3);
+	clusters.push_back(0);
+	while (fan >= 0) {
+		candidates.clear();
+		for (unsigned int k = offsets[fan]; k < offsets[fan + 1]; k++) {
+			unsigned int t = adjacency[k];
+			if (emitted[t])
+				continue;
+			emitted[t] = 1;
+			for (int c = 0; c < 3; c++) {
+				unsigned int v = local[t * 3 + c];
+				out.push_back(indices[t * 3 + c]);
+				deadEnds.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (time - cachedAt[v] > VERTEX_CACHE_SIZE)
+					cachedAt[v] = time++;
+			}
+		}
+
+		// Prefer the oldest candidate that is still cached after its remaining triangles are emitted.
+		fan = -1;
+		int best = -1;
+		for (unsigned int v : candidates) {
+			if (!live[v])
+				continue;
+			int priority = time - cachedAt[v] + 2 * (int)live[v] <= VERTEX_CACHE_SIZE ? time - cachedAt[v] : 0;
+			if (priority > best) {
+				best = priority;
+				fan = v;
+			}
+		}
+		if (fan < 0) {
+			while (fan < 0 && !deadEnds.empty()) {
+				unsigned int v = deadEnds.back();
+				deadEnds.pop_back();
+				if (live[v])
+					fan = v;
+			}
+			for (; fan < 0 && cursor < vertexCount; cursor++)
+				if (live[cursor])
+					fan = cursor;
+			if (fan >= 0 && time - cachedAt[fan] > VERTEX_CACHE_SIZE)
+				clusters.push_back(out.size() / 3);
+		}
+	}
+}
+
+// Reorders the triangles for the post-transform cache and overdraw, then the vertices for fetch locality.
+void optimizeMesh(const char* name, void* vertices, size_t vertexCount, const VertexLayout& layout, GLuint* indices, 
+	size_t indexCount) {
+	TraceZone trace("optimizeMesh");
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	size_t triangleCount = indexCount / 3;
+	float acmrBefore, atvrBefore, acmrAfter, atvrAfter;
+	if (!triangleCount || !vertexCacheStats(indices, triangleCount * 3, vertexCount, acmrBefore, atvrBefore)) {
+		errorLog("AVE", "LOAD", std::string("(") + name + ") has indices past its vertices, not optimized.\n", "");
+		return;
+	}
+
+	// Large meshes are cut into runs of triangles, every run is reordered on its own thread. Sorting the triangles
+	// along a Morton curve first keeps each run spatially connected whatever order the file had.
+	int batchCount = (int)((triangleCount + OPTIMIZE_BATCH_TRIANGLES - 1) / OPTIMIZE_BATCH_TRIANGLES);
+	const VertexAttribute* position = findAttribute(layout, 0);
+	bool hasPositions = position && position->type == GL_FLOAT && position->components >= 3;
+	const unsigned char* positions = (const unsigned char*)vertices + (position ? position->offset : 0);
+	if (batchCount > 1 && hasPositions) {
+		glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+		for (size_t v = 0; v < vertexCount; v++) {
+			glm::vec3 p = glm::make_vec3((const float*)(positions + v * layout.stride));
+			boundsMin = glm::min(boundsMin, p);
+			boundsMax = glm::max(boundsMax, p);
+		}
+		glm::vec3 scale = 1023.0f / glm::max(boundsMax - boundsMin, glm::vec3(1e-20f));
+		std::vector<std::pair<unsigned int, unsigned int>> keys(triangleCount); // Morton code, triangle
+		parallelFor(batchCount, [&](int b) {
+			size_t end = std::min((size_t)(b + 1) * OPTIMIZE_BATCH_TRIANGLES, triangleCount);
+			for (size_t t = (size_t)b * OPTIMIZE_BATCH_TRIANGLES; t < end; t++) {
+				glm::vec3 centroid(0.0f);
+				for (int c = 0; c < 3; c++)
+					centroid += glm::make_vec3((const float*)(positions + (size_t)indices[t * 3 + c] * layout.stride));
+				glm::vec3 cell = glm::clamp((centroid / 3.0f - boundsMin) * scale, glm::vec3(0.0f), glm::vec3(1023.0f));
+				unsigned int code = 0;
+				for (int bit = 0; bit < 10; bit++)
+					for (int axis = 0; axis < 3; axis++)
+						code |= (((unsigned int)cell[axis] >> bit) & 1u) << (bit * 3 + axis);
+				keys[t] = std::make_pair(code, (unsigned int)t);
+			}
+		});
+		std::sort(keys.begin(), keys.end());
+		std::vector<GLuint> sorted(triangleCount * 3);
+		for (size_t t = 0; t < triangleCount; t++)
+			memcpy(&sorted[t * 3], &indices[(size_t)keys[t].second * 3], 3 * sizeof(GLuint));
+		memcpy(indices, sorted.data(), sorted.size() * sizeof(GLuint));
+	}
+
+	std::vector<std::vector<GLuint>> batchIndices(batchCount);
+	std::vector<std::vector<size_t>> batchClusters(batchCount);
+	parallelFor(batchCount, [&](int b) {
+		TraceZone trace("tipsify");
+		size_t first = (size_t)b * OPTIMIZE_BATCH_TRIANGLES;
+		tipsify(indices + first * 3, std::min((size_t)OPTIMIZE_BATCH_TRIANGLES, triangleCount - first), batchIndices[b], 
+			batchClusters[b]);
+	});
+
+	std::vector<GLuint> ordered;
+	std::vector<MeshCluster> clusters;
+	ordered.reserve(triangleCount * 3);
+	for (int b = 0; b < batchCount; b++) {
+		size_t base = ordered.size() / 3, count = batchIndices[b].size() / 3;
+		for (size_t k = 0; k < batchClusters[b].size(); k++) {
+			size_t end = k + 1 < batchClusters[b].size() ? batchClusters[b][k + 1] : count;
+			MeshCluster cluster = {};
+			cluster.first = base + batchClusters[b][k];
+			cluster.count = end - batchClusters[b][k];
+			clusters.push_back(cluster);
+		}
+		ordered.insert(ordered.end(), batchIndices[b].begin(), batchIndices[b].end());
+		batchIndices[b] = std::vector<GLuint>();
+	}
+
+	// Overdraw: clusters facing away from the mesh center are drawn first, they tend to hide the ones behind them.
+	if (hasPositions && clusters.size() > 1) {
+		parallelFor((int)clusters.size(), [&](int c) {
+			MeshCluster& cluster = clusters[c];
+			glm::vec3 centroid(0.0f), normal(0.0f);
+			float area = 0.0f;
+			for (size_t t = cluster.first; t < cluster.first + cluster.count; t++) {
+				glm::vec3 a = glm::make_vec3((const float*)(positions + (size_t)ordered[t * 3] * layout.stride));
+				glm::vec3 b = glm::make_vec3((const float*)(positions + (size_t)ordered[t * 3 + 1] * layout.stride));
+				glm::vec3 d = glm::make_vec3((const float*)(positions + (size_t)ordered[t * 3 + 2] * layout.stride));
+				glm::vec3 n = glm::cross(b - a, d - a);
+				float triangleArea = glm::length(n) * 0.5f;
+				centroid += (a + b + d) * (triangleArea / 3.0f);
+				normal += n;
+				area += triangleArea;
+			}
+			cluster.centroid = centroid;
+			cluster.normal = normal;
+			cluster.area = area;
+		});
+
+		glm::vec3 center(0.0f);
+		float area = 0.0f;
+		for (const MeshCluster& cluster : clusters) {
+			center += cluster.centroid;
+			area += cluster.area;
+		}
+		center = area > 0.0f ? center / area : center;
+		for (MeshCluster& cluster : clusters) {
+			float length = glm::length(cluster.normal);
+			glm::vec3 centroid = cluster.area > 0.0f ? cluster.centroid / cluster.area : center;
+			cluster.sortKey = length > 0.0f ? glm::dot(centroid - center, cluster.normal / length) : 0.0f;
+		}
+		std::stable_sort(clusters.begin(), clusters.end(), [](const MeshCluster& a, const MeshCluster& b) {
+			return a.sortKey > b.sortKey;
+		});
+	}
+	GLuint* out = indices;
+	for (const MeshCluster& cluster : clusters) {
+		memcpy(out, &ordered[cluster.first * 3], cluster.count * 3 * sizeof(GLuint));
+		out += cluster.count * 3;
+	}
+
+	// Fetch: vertices in the order they are first used, unreferenced ones go last.
+	std::vector<GLuint> remap(vertexCount, UINT_MAX);
+	GLuint next = 0;
+	for (size_t i = 0; i < triangleCount * 3; i++) {
+		if (remap[indices[i]] == UINT_MAX)
+			remap[indices[i]] = next++;
+		indices[i] = remap[indices[i]];
+	}
+	for (size_t v = 0; v < vertexCount; v++)
+		if (remap[v] == UINT_MAX)
+			remap[v] = next++;
+	std::vector<unsigned char> copy((const unsigned char*)vertices, (const unsigned char*)vertices + vertexCount * layout.stride);
+	for (size_t v = 0; v < vertexCount; v++)
+		memcpy((unsigned char*)vertices + (size_t)remap[v] * layout.stride, &copy[v * layout.stride], layout.stride);
+
+	vertexCacheStats(indices, triangleCount * 3, vertexCount, acmrAfter, atvrAfter);
+	double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "OPTIMIZE" << " [" << name << ", triangles: " << triangleCount << ", ACMR: " << acmrBefore << " -> " 
+		<< acmrAfter << ", ATVR: " << atvrBefore << " -> " << atvrAfter << ", clusters: " << clusters.size() << ", batches: " 
+		<< batchCount << ", ms: " << elapsed << "]" << std::endl;
+}
+
+//******************************************************************************************************************************
+// Vertex Packing
+const VertexLayout& vertexFormatLayout(VertexFormat format) {
+	return format == VERTEX_FORMAT_PACKED16 ? vertexLayoutPacked16 : format == VERTEX_FORMAT_PACKED ? vertexLayoutPacked : 
+		vertexLayoutFull;
+}
+
+// IEEE half of four floats in the low 16 bits of each lane, round to nearest even, SSE2 has no F16C.
+__m128i floatToHalf(__m128 value) {
+	const __m128i infinity = _mm_set1_epi32(0x7C00), nanBit = _mm_set1_epi32(0x200);
+	const __m128i halfMax = _mm_set1_epi32((127 + 16) << 23); // Rounds to infinity from here on.
+	const __m128i normalMin = _mm_set1_epi32((127 - 14) << 23); // Below this the half is subnormal.
+	const __m128i subnormalMagic = _mm_set1_epi32(((127 - 15) + (23 - 10) + 1) << 23);
+	const __m128i normalBias = _mm_set1_epi32(0xFFF - ((127 - 15) << 23));
+
+	__m128 sign = _mm_and_ps(value, _mm_castsi128_ps(_mm_set1_epi32((int)0x80000000u)));
+	__m128 absolute = _mm_xor_ps(value, sign);
+	__m128i bits = _mm_castps_si128(absolute);
+	__m128i regular = _mm_cmpgt_epi32(halfMax, bits);
+	__m128i subnormal = _mm_cmpgt_epi32(normalMin, bits);
+	__m128i special = _mm_or_si128(_mm_and_si128(_mm_castps_si128(_mm_cmpunord_ps(absolute, absolute)), nanBit), infinity);
+
+	// The float adder rounds the subnormal mantissa, normal ones are rebiased and rounded with integer math.
+	__m128i subnormalBits = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(absolute, _mm_castsi128_ps(subnormalMagic))), 
+		subnormalMagic);
+	__m128i odd = _mm_srai_epi32(_mm_slli_epi32(bits, 31 - 13), 31);
+	__m128i normalBits = _mm_srli_epi32(_mm_sub_epi32(_mm_add_epi32(bits, normalBias), odd), 13);
+
+	__m128i finite = _mm_or_si128(_mm_and_si128(subnormal, subnormalBits), _mm_andnot_si128(subnormal, normalBits));
+	__m128i half = _mm_or_si128(_mm_and_si128(regular, finite), _mm_andnot_si128(regular, special));
+	return _mm_or_si128(half, _mm_srli_epi32(_mm_castps_si128(sign), 16));
+}
+
+float halfToFloat(unsigned short half) {
+	unsigned int sign = (unsigned int)(half & 0x8000u) << 16, exponent = (half >> 10) & 0x1Fu, mantissa = half & 0x3FFu;
+	float value;
+	if (exponent == 0)
+		value = mantissa * (1.0f / 16777216.0f); // Subnormal, mantissa * 2^-24.
+	else {
+		unsigned int bits = exponent == 31 ? 0x7F800000u | (mantissa << 13) : ((exponent + 112) << 23) | (mantissa << 13);
+		memcpy(&value, &bits, sizeof(value));
+	}
+	return sign ? -value : value;
+}
+
+// Octahedral normals of four vertices as GL_INT_2_10_10_10_REV: x and y in 10-bit snorm, z unused and w = 0 marking
+// the encoding (float normals read back with w = 1).
+__m128i packOctahedral(__m128 x, __m128 y, __m128 z) {
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF)), one = _mm_set1_ps(1.0f);
+	__m128 signMask = _mm_castsi128_ps(_mm_set1_epi32((int)0x80000000u));
+	__m128 length = _mm_add_ps(_mm_add_ps(_mm_and_ps(x, absMask), _mm_and_ps(y, absMask)), _mm_and_ps(z, absMask));
+	__m128 inverse = _mm_div_ps(one, _mm_max_ps(length, _mm_set1_ps(1e-20f)));
+	__m128 u = _mm_mul_ps(x, inverse), v = _mm_mul_ps(y, inverse);
+
+	// The lower hemisphere is folded over the diagonals.
+	__m128 foldU = _mm_or_ps(_mm_sub_ps(one, _mm_and_ps(v, absMask)), _mm_and_ps(u, signMask));
+	__m128 foldV = _mm_or_ps(_mm_sub_ps(one, _mm_and_ps(u, absMask)), _mm_and_ps(v, signMask));
+	__m128 lower = _mm_cmplt_ps(z, _mm_setzero_ps());
+	u = _mm_or_ps(_mm_and_ps(lower, foldU), _mm_andnot_ps(lower, u));
+	v = _mm_or_ps(_mm_and_ps(lower, foldV), _mm_andnot_ps(lower, v));
+
+	const __m128 scale = _mm_set1_ps(511.0f);
+	const __m128i mask = _mm_set1_epi32(0x3FF);
+	__m128i packedU = _mm_and_si128(_mm_cvtps_epi32(_mm_mul_ps(u, scale)), mask);
+	__m128i packedV = _mm_and_si128(_mm_cvtps_epi32(_mm_mul_ps(v, scale)), mask);
+	return _mm_or_si128(packedU, _mm_slli_epi32(packedV, 10));
+}
+
+glm::vec3 octahedralDecode(float u, float v) {
+	glm::vec3 normal(u, v, 1.0f - std::abs(u) - std::abs(v));
+	if (normal.z < 0.0f) {
+		normal.x = (1.0f - std::abs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+		normal.y = (1.0f - std::abs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+	}
+	return glm::normalize(normal);
+}
+
+// Converts vertexLayoutFull vertices to a packed format, four vertices per iteration.
+bool packVertices(const char* name, const ObjectData& object, VertexFormat format, std::vector<unsigned char>& packed, 
+	ObjectData& out) {
+	if (format == VERTEX_FORMAT_FLOAT || memcmp(&object.layout, &vertexLayoutFull, sizeof(VertexLayout)) != 0)
+		return false;
+	TraceZone trace("packVertices");
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	const VertexLayout& layout = vertexFormatLayout(format);
+	size_t vertexCount = object.verticesSize / object.layout.stride;
+	const float* source = (const float*)object.vertices;
+	size_t sourceSize = object.verticesSize; // object may alias out.
+
+	// 16-bit positions are stored relative to the bounds, the shader scales them back.
+	glm::vec3 boundsMin(vertexCount ? FLT_MAX : 0.0f), boundsMax(vertexCount ? -FLT_MAX : 0.0f);
+	for (size_t v = 0; v < vertexCount; v++) {
+		boundsMin = glm::min(boundsMin, glm::make_vec3(source + v * 11));
+		boundsMax = glm::max(boundsMax, glm::make_vec3(source + v * 11));
+	}
+	glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+	glm::vec3 quantize = 32767.0f / glm::max((boundsMax - boundsMin) * 0.5f, glm::vec3(1e-20f));
+	const __m128 centers[3] = { _mm_set1_ps(center.x), _mm_set1_ps(center.y), _mm_set1_ps(center.z) };
+	const __m128 scales[3] = { _mm_set1_ps(quantize.x), _mm_set1_ps(quantize.y), _mm_set1_ps(quantize.z) };
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), byteMax = _mm_set1_ps(255.0f);
+
+	packed.assign(vertexCount * layout.stride, 0);
+	const float padding[11] = {};
+	for (size_t first = 0; first < vertexCount; first += 4) {
+		const float* v[4];
+		for (int k = 0; k < 4; k++)
+			v[k] = first + k < vertexCount ? source + (first + k) * 11 : padding;
+		auto gather = [&](int c) { return _mm_setr_ps(v[0][c], v[1][c], v[2][c], v[3][c]); };
+
+		int position[3][4];
+		if (format == VERTEX_FORMAT_PACKED16)
+			for (int c = 0; c < 3; c++)
+				_mm_storeu_si128((__m128i*)position[c], _mm_cvtps_epi32(_mm_mul_ps(_mm_sub_ps(gather(c), centers[c]), scales[c])));
+
+		__m128i color = _mm_set1_epi32((int)0xFF000000u);
+		for (int c = 0; c < 3; c++) {
+			__m128 channel = _mm_mul_ps(_mm_min_ps(_mm_max_ps(gather(3 + c), zero), one), byteMax);
+			color = _mm_or_si128(color, _mm_slli_epi32(_mm_cvtps_epi32(channel), 8 * c));
+		}
+		__m128i texCoord = _mm_or_si128(floatToHalf(gather(6)), _mm_slli_epi32(floatToHalf(gather(7)), 16));
+		__m128i normal = packOctahedral(gather(8), gather(9), gather(10));
+
+		unsigned int colors[4], texCoords[4], normals[4];
+		_mm_storeu_si128((__m128i*)colors, color);
+		_mm_storeu_si128((__m128i*)texCoords, texCoord);
+		_mm_storeu_si128((__m128i*)normals, normal);
+		for (size_t k = 0; k < 4 && first + k < vertexCount; k++) {
+			unsigned char* vertex = &packed[(first + k) * layout.stride];
+			if (format == VERTEX_FORMAT_PACKED16) {
+				short quantized[4] = { (short)position[0][k], (short)position[1][k], (short)position[2][k], 0 };
+				memcpy(vertex, quantized, sizeof(quantized));
+			}
+			else
+				memcpy(vertex, v[k], 3 * sizeof(float));
+			memcpy(vertex + layout.attributes[1].offset, &colors[k], 4);
+			memcpy(vertex + layout.attributes[2].offset, &texCoords[k], 4);
+			memcpy(vertex + layout.attributes[3].offset, &normals[k], 4);
+		}
+	}
+
+	out = object;
+	out.vertices = packed.data();
+	out.verticesSize = packed.size();
+	out.layout = layout;
+	out.boundsMin = boundsMin;
+	out.boundsMax = boundsMax;
+	double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "PACK" << " [" << name << ", bytes/vertex: " << vertexLayoutFull.stride << " -> " << layout.stride << ", bytes: " 
+		<< sourceSize << " -> " << packed.size() << ", ms: " << elapsed << "]" << std::endl;
+	return true;
+}
+
+// Shader constants turning the stored positions back into object space.
+void positionDequantization(const ObjectData& object, glm::vec3& scale, glm::vec3& offset) {
+	const VertexAttribute* position = findAttribute(object.layout, 0);
+	bool quantized = position && position->type == GL_SHORT && position->normalized;
+	scale = quantized ? (object.boundsMax - object.boundsMin) * 0.5f : glm::vec3(1.0f);
+	offset = quantized ? (object.boundsMax + object.boundsMin) * 0.5f : glm::vec3(0.0f);
+}
+
+// One attribute as floats, with the conversions of the GL vertex fetch (missing components keep their value).
+void fetchAttribute(const unsigned char* vertex, const VertexAttribute& attribute, float* out) {
+	const unsigned char* p = vertex + attribute.offset;
+	if (attribute.type == GL_INT_2_10_10_10_REV) {
+		unsigned int packed;
+		memcpy(&packed, p, sizeof(packed));
+		for (int c = 0; c < 4; c++) {
+			int bits = c < 3 ? 10 : 2;
+			int value = (int)(packed << (32 - bits - 10 * c)) >> (32 - bits); // Sign extended.
+			out[c] = attribute.normalized ? std::max(value / (float)((1 << (bits - 1)) - 1), -1.0f) : (float)value;
+		}
+		return;
+	}
+	for (int c = 0; c < attribute.components; c++)
+		switch (attribute.type) {
+		case GL_SHORT: {
+			short value;
+			memcpy(&value, p + 2 * c, sizeof(value));
+			out[c] = attribute.normalized ? std::max(value / 32767.0f, -1.0f) : value;
+			break;
+		}
+		case GL_UNSIGNED_BYTE:
+			out[c] = attribute.normalized ? p[c] / 255.0f : p[c];
+			break;
+		case GL_HALF_FLOAT: {
+			unsigned short value;
+			memcpy(&value, p + 2 * c, sizeof(value));
+			out[c] = halfToFloat(value);
+			break;
+		}
+		default:
+			memcpy(&out[c], p + 4 * c, sizeof(float));
+		}
+}
+
+// Bytes of one attribute, 0 for a type fetchAttribute() can't read.
+GLuint attributeSize(const VertexAttribute& attribute) {
+	if (attribute.components < 1 || attribute.components > 4)
+		return 0;
+	switch (attribute.type) {
+	case GL_INT_2_10_10_10_REV:
+		return attribute.components == 4 ? 4 : 0;
+	case GL_UNSIGNED_BYTE:
+		return attribute.components;
+	case GL_SHORT:
+	case GL_HALF_FLOAT:
+		return 2 * attribute.components;
+	case GL_FLOAT:
+		return 4 * attribute.components;
+	default:
+		return 0;
+	}
+}
+
+//******************************************************************************************************************************
+// Scene Graph
+int sceneAddNode(SceneGraph& scene, int parent, const glm::mat4& local) {
+	int node = (int)scene.slot.size();
+	int slot = (int)scene.local.size();
+	scene.slot.push_back(slot);
+	scene.node.push_back(node);
+	scene.local.push_back(local);
+	scene.world.push_back(local);
+	scene.parent.push_back(parent >= 0 ? scene.slot[parent] : -1); // Always an earlier slot.
+	scene.dirty.push_back(0);
+	scene.sorted = false;
+	return node;
+}
+
+// Breadth first order: slots grouped by depth, the children of a slot adjacent and in the order of their parents.
+void sceneSort(SceneGraph& scene) {
+	TraceZone trace("sceneSort");
+	int count = (int)scene.local.size();
+	std::vector<int> childStart(count + 1, 0), children(count);
+	for (int s = 0; s < count; s++)
+		if (scene.parent[s] >= 0)
+			childStart[scene.parent[s] + 1]++;
+	for (int s = 0; s < count; s++)
+		childStart[s + 1] += childStart[s];
+	std::vector<int> fill(childStart.begin(), childStart.end() - 1);
+	for (int s = 0; s < count; s++)
+		if (scene.parent[s] >= 0)
+			children[fill[scene.parent[s]]++] = s;
+
+	std::vector<int> order; // New slot to old slot.
+	order.reserve(count);
+	for (int s = 0; s < count; s++)
+		if (scene.parent[s] < 0)
+			order.push_back(s);
+	scene.levelStart.assign(1, 0);
+	for (size_t levelBegin = 0; levelBegin < order.size();) {
+		size_t levelEnd = order.size();
+		scene.levelStart.push_back((int)levelEnd);
+		for (size_t i = levelBegin; i < levelEnd; i++)
+			order.insert(order.end(), children.begin() + childStart[order[i]], children.begin() + childStart[order[i] + 1]);
+		levelBegin = levelEnd;
+	}
+
+	std::vector<int> newSlot(count);
+	for (int s = 0; s < count; s++)
+		newSlot[order[s]] = s;
+	std::vector<glm::mat4> local(count);
+	std::vector<int> parent(count), node(count);
+	scene.depth.resize(count);
+	scene.firstChild.resize(count);
+	scene.childCount.resize(count);
+	int cursor = scene.levelStart.size() > 1 ? scene.levelStart[1] : count;
+	for (int s = 0; s < count; s++) {
+		int old = order[s];
+		local[s] = scene.local[old];
+		parent[s] = scene.parent[old] >= 0 ? newSlot[scene.parent[old]] : -1;
+		node[s] = scene.node[old];
+		scene.slot[node[s]] = s;
+		scene.depth[s] = parent[s] >= 0 ? scene.depth[parent[s]] + 1 : 0;
+		scene.firstChild[s] = cursor; // Where the children would start, also for leaves.
+		scene.childCount[s] = childStart[old + 1] - childStart[old];
+		cursor += scene.childCount[s];
+	}
+	scene.local.swap(local);
+	scene.parent.swap(parent);
+	scene.node.swap(node);
+	scene.dirty.assign(count, 0);
+	scene.levelSeeds.assign(scene.levelStart.size() - 1, std::vector<int>());
+	scene.sorted = true;
+
+	// Every world matrix is recomputed from the roots.
+	scene.dirtySlots.clear();
+	for (int s = 0; s < (scene.levelStart.size() > 1 ? scene.levelStart[1] : 0); s++) {
+		scene.dirty[s] = 1;
+		scene.dirtySlots.push_back(s);
+	}
+}
+
+void sceneSetLocal(SceneGraph& scene, int node, const glm::mat4& local) {
+	int slot = scene.slot[node];
+	scene.local[slot] = local;
+	if (!scene.dirty[slot] && scene.sorted) {
+		scene.dirty[slot] = 1;
+		scene.dirtySlots.push_back(slot);
+	}
+}
+
+const glm::mat4& sceneLocal(const SceneGraph& scene, int node) {
+	return scene.local[scene.slot[node]];
+}
+
+const glm::mat4& sceneWorld(const SceneGraph& scene, int node) {
+	return scene.world[scene.slot[node]];
+}
+
+// world = parent world * local over consecutive slots, siblings share the loaded parent columns.
+void sceneTransformRange(SceneGraph& scene, int first, int last) {
+	const float* local = glm::value_ptr(scene.local[0]);
+	float* world = glm::value_ptr(scene.world[0]);
+	int loadedParent = -1;
+	__m128 p0 = _mm_setzero_ps(), p1 = p0, p2 = p0, p3 = p0;
+	for (int s = first; s < last; s++) {
+		const float* l = local + 16 * (size_t)s;
+		float* w = world + 16 * (size_t)s;
+		int parent = scene.parent[s];
+		if (parent < 0) {
+			memcpy(w, l, 16 * sizeof(float));
+			continue;
+		}
+		if (parent != loadedParent) {
+			const float* p = world + 16 * (size_t)parent;
+			p0 = _mm_loadu_ps(p);
+			p1 = _mm_loadu_ps(p + 4);
+			p2 = _mm_loadu_ps(p + 8);
+			p3 = _mm_loadu_ps(p + 12);
+			loadedParent = parent;
+		}
+		for (int column = 0; column < 4; column++) {
+			const float* c = l + 4 * column;
+			__m128 result = _mm_mul_ps(p0, _mm_set1_ps(c[0]));
+			result = _mm_add_ps(result, _mm_mul_ps(p1, _mm_set1_ps(c[1])));
+			result = _mm_add_ps(result, _mm_mul_ps(p2, _mm_set1_ps(c[2])));
+			result = _mm_add_ps(result, _mm_mul_ps(p3, _mm_set1_ps(c[3])));
+			_mm_storeu_ps(w + 4 * column, result);
+		}
+	}
+}
+
+// Level by level, a level recomputes the dirty slots on it and the children of what changed on the level above.
+// Descendants of a slot are contiguous on every level, so the work stays ranges and is linear in the changed nodes.
+int sceneUpdate(SceneGraph& scene) {
+	TraceZone trace("sceneUpdate");
+	if (!scene.sorted)
+		sceneSort(scene);
+	for (int s : scene.dirtySlots) {
+		scene.levelSeeds[scene.depth[s]].push_back(s);
+		scene.dirty[s] = 0;
+	}
+	scene.dirtySlots.clear();
+
+	int updated = 0;
+	std::vector<std::pair<int, int>> inherited, ranges;
+	for (size_t level = 0; level < scene.levelSeeds.size(); level++) {
+		std::vector<int>& seeds = scene.levelSeeds[level];
+		if (inherited.empty() && seeds.empty())
+			continue;
+
+		// Merge the sorted inherited ranges with the seeds of this level.
+		std::sort(seeds.begin(), seeds.end());
+		ranges.clear();
+		size_t r = 0, k = 0;
+		while (r < inherited.size() || k < seeds.size()) {
+			std::pair<int, int> next;
+			if (k == seeds.size() || (r < inherited.size() && inherited[r].first <= seeds[k]))
+				next = inherited[r++];
+			else {
+				next = std::make_pair(seeds[k], seeds[k] + 1);
+				k++;
+			}
+			if (!ranges.empty() && next.first <= ranges.back().second)
+				ranges.back().second = std::max(ranges.back().second, next.second);
+			else
+				ranges.push_back(next);
+		}
+		seeds.clear();
+
+		// Big levels are cut into batches for the worker threads.
+		int levelNodes = 0;
+		for (const std::pair<int, int>& range : ranges)
+			levelNodes += range.second - range.first;
+		updated += levelNodes;
+		if (levelNodes >= 2 * SCENE_BATCH_NODES) {
+			std::vector<std::pair<int, int>> batches;
+			for (const std::pair<int, int>& range : ranges)
+				for (int first = range.first; first < range.second; first += SCENE_BATCH_NODES)
+					batches.push_back(std::make_pair(first, std::min(first + SCENE_BATCH_NODES, range.second)));
+			parallelFor((int)batches.size(), [&](int b) {
+				sceneTransformRange(scene, batches[b].first, batches[b].second);
+			});
+		}
+		else
+			for (const std::pair<int, int>& range : ranges)
+				sceneTransformRange(scene, range.first, range.second);
+
+		inherited.clear();
+		for (const std::pair<int, int>& range : ranges) {
+			int first = scene.firstChild[range.first];
+			int last = scene.firstChild[range.second - 1] + scene.childCount[range.second - 1];
+			if (first < last)
+				inherited.push_back(std::make_pair(first, last));
+		}
+	}
+	return updated;
+}
+
+// Pyramid and light turn together around the origin.
+void buildScene() {
+	scene = SceneGraph();
+	sceneTurntable = sceneAddNode(scene, -1, glm::mat4(1.0f));
+	scenePyramid = sceneAddNode(scene, sceneTurntable, glm::translate(glm::mat4(1.0f), cubePos));
+	sceneLight = sceneAddNode(scene, sceneTurntable, glm::translate(glm::mat4(1.0f), lightPos));
+	syncSceneTransforms();
+}
+
+void syncSceneTransforms() {
+	sceneUpdate(scene);
+	cubeModel = sceneWorld(scene, scenePyramid);
+	lightModel = sceneWorld(scene, sceneLight);
+}
+
+// --bench-scene N: random tree of N nodes, update time against the number of dirty nodes.
+int sceneBenchmark(const AppOptions& options) {
+	int count = std::max(options.sceneNodes, 1);
+	unsigned int seed = 12345;
+	auto random = [&seed]() {
+		seed = seed * 1664525u + 1013904223u;
+		return seed >> 8;
+	};
+
+	SceneGraph scene;
+	for (int i = 0; i < count; i++) {
+		glm::vec3 offset = glm::vec3((float)(random() % 200), (float)(random() % 200), (float)(random() % 200)) * 0.01f - 1.0f;
+		glm::mat4 local = glm::rotate(glm::translate(glm::mat4(1.0f), offset), (float)(random() % 360), glm::vec3(0.0f, 1.0f, 0.0f));
+		sceneAddNode(scene, i ? (int)(random() % i) : -1, local);
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	sceneSort(scene);
+	double sortTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "SCENE" << " [nodes: " << count << ", levels: " << scene.levelStart.size() - 1 << ", sort ms: " << sortTime 
+		<< "]" << std::endl;
+
+	const double fractions[] = { 1.0, 0.1, 0.01, 0.001, 0.0001 };
+	for (double fraction : fractions) {
+		int dirty = fraction >= 1.0 ? 0 : std::max((int)(count * fraction), 1);
+		if (fraction >= 1.0)
+			for (int s = 0; s < scene.levelStart[1]; s++)
+				sceneSetLocal(scene, scene.node[s], sceneLocal(scene, scene.node[s]));
+		for (int i = 0; i < dirty; i++) {
+			int node = (int)(random() % count);
+			sceneSetLocal(scene, node, glm::rotate(sceneLocal(scene, node), 0.01f, glm::vec3(0.0f, 1.0f, 0.0f)));
+		}
+		start = std::chrono::steady_clock::now();
+		int updated = sceneUpdate(scene);
+		double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "SCENE" << " [dirty: " << (dirty ? dirty : count) << ", updated: " << updated << ", ms: " << elapsed 
+			<< ", ns/node: " << 1.0e6 * elapsed / std::max(updated, 1) << "]" << std::endl;
+	}
+
+	// The incremental result has to match a plain walk from the roots.
+	float error = 0.0f;
+	std::vector<glm::mat4> reference(scene.local.size());
+	for (size_t s = 0; s < scene.local.size(); s++) {
+		reference[s] = scene.parent[s] >= 0 ? reference[scene.parent[s]] * scene.local[s] : scene.local[s];
+		for (int c = 0; c < 4; c++)
+			error = std::max(error, glm::length(reference[s][c] - scene.world[s][c]) / std::max(glm::length(reference[s][c]), 1.0f));
+	}
+	std::cout << "SCENE" << " [relative error: " << error << "]" << std::endl;
+	return error < 1e-3f ? 0 : -1;
+}
+
+//******************************************************************************************************************************
+// Frustum Culling
+// Planes of a clip matrix (Gribb/Hartmann), normalized so the distance of a point is its dot product with the plane.
+void frustumPlanes(const glm::mat4& matrix, glm::vec4 planes[6]) {
+	glm::vec4 rows[4];
+	for (int r = 0; r < 4; r++)
+		rows[r] = glm::vec4(matrix[0][r], matrix[1][r], matrix[2][r], matrix[3][r]);
+	for (int axis = 0; axis < 3; axis++) {
+		planes[axis * 2] = rows[3] + rows[axis];
+		planes[axis * 2 + 1] = rows[3] - rows[axis];
+	}
+	for (int p = 0; p < 6; p++)
+		planes[p] /= glm::length(glm::vec3(planes[p]));
+}
+
+// Sphere around the bounds of a mesh: xyz is the center, w the radius.
+glm::vec4 boundingSphere(const ObjectData& object) {
+	return glm::vec4((object.boundsMin + object.boundsMax) * 0.5f, glm::length(object.boundsMax - object.boundsMin) * 0.5f);
+}
+
+CullSpheres cullSpheres(const std::vector<glm::mat4>& transforms, const glm::vec4& sphere) {
+	size_t padded = (transforms.size() + 3) & ~(size_t)3;
+	CullSpheres spheres;
+	spheres.x.assign(padded, 0.0f);
+	spheres.y.assign(padded, 0.0f);
+	spheres.z.assign(padded, 0.0f);
+	spheres.radius.assign(padded, -FLT_MAX); // Padding is never visible.
+	for (size_t i = 0; i < transforms.size(); i++) {
+		const glm::mat4& transform = transforms[i];
+		glm::vec4 center = transform * glm::vec4(glm::vec3(sphere), 1.0f);
+		float scale = std::max(glm::length(glm::vec3(transform[0])), 
+			std::max(glm::length(glm::vec3(transform[1])), glm::length(glm::vec3(transform[2]))));
+		spheres.x[i] = center.x;
+		spheres.y[i] = center.y;
+		spheres.z[i] = center.z;
+		spheres.radius[i] = sphere.w * scale;
+	}
+	return spheres;
+}
+
+// Tests four spheres per iteration against all six planes, first and last are multiples of 4.
+int cullRange(const CullSpheres& spheres, const glm::vec4 planes[6], int first, int last, int* visible) {
+	__m128 planeX[6], planeY[6], planeZ[6], planeW[6];
+	for (int p = 0; p < 6; p++) {
+		planeX[p] = _mm_set1_ps(planes[p].x);
+		planeY[p] = _mm_set1_ps(planes[p].y);
+		planeZ[p] = _mm_set1_ps(planes[p].z);
+		planeW[p] = _mm_set1_ps(planes[p].w);
+	}
+
+	int count = 0;
+	for (int i = first; i < last; i += 4) {
+		__m128 x = _mm_loadu_ps(&spheres.x[i]);
+		__m128 y = _mm_loadu_ps(&spheres.y[i]);
+		__m128 z = _mm_loadu_ps(&spheres.z[i]);
+		__m128 negRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&spheres.radius[i]));
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (int p = 0; p < 6; p++) {
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, planeX[p]), _mm_mul_ps(y, planeY[p])), 
+				_mm_add_ps(_mm_mul_ps(z, planeZ[p]), planeW[p]));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negRadius));
+		}
+		int mask = _mm_movemask_ps(inside);
+		for (int lane = 0; lane < 4; lane++) {
+			visible[count] = i + lane;
+			count += (mask >> lane) & 1;
+		}
+	}
+	return count;
+}
+
+// Indices of the spheres inside the frustum of matrix, in order. Large sets are split in CULL_CHUNK_SIZE chunks over threads
+// and compacted afterwards.
+int frustumCull(const CullSpheres& spheres, const glm::mat4& matrix, std::vector<int>& visible) {
+	glm::vec4 planes[6];
+	frustumPlanes(matrix, planes);
+	int padded = (int)spheres.x.size();
+	visible.resize(padded);
+	int chunks = (padded + CULL_CHUNK_SIZE - 1) / CULL_CHUNK_SIZE;
+	if (chunks <= 1) {
+		visible.resize(cullRange(spheres, planes, 0, padded, visible.data()));
+		return (int)visible.size();
+	}
+
+	std::vector<int> counts(chunks);
+	parallelFor(chunks, [&](int chunk) {
+		int first = chunk * CULL_CHUNK_SIZE;
+		counts[chunk] = cullRange(spheres, planes, first, std::min(first + CULL_CHUNK_SIZE, padded), visible.data() + first);
+	});
+	int count = counts[0];
+	for (int chunk = 1; chunk < chunks; chunk++) {
+		std::vector<int>::iterator first = visible.begin() + chunk * CULL_CHUNK_SIZE;
+		std::copy(first, first + counts[chunk], visible.begin() + count);
+		count += counts[chunk];
+	}
+	visible.resize(count);
+	return count;
+}
+
+// The grid of pyramids drawn by display(), culled in the space of cubeModel. The hierarchy is refit when only the transforms
+// changed.
+void setInstances(const std::vector<glm::mat4>& instances) {
+	occlusionWait(occlusionCuller); // Its job points at the instances.
+	occlusionCuller.occluded.clear();
+	std::vector<glm::vec3> boundsMin(instances.size()), boundsMax(instances.size());
+	for (size_t i = 0; i < instances.size(); i++)
+		transformBounds(instances[i], pyramidBoundsMin, pyramidBoundsMax, boundsMin[i], boundsMax[i]);
+	if (!instances.empty() && instances.size() == instanceTransforms.size())
+		bvhRefit(instanceBvh, boundsMin, boundsMax);
+	else
+		bvhBuild(instanceBvh, boundsMin, boundsMax);
+	instanceTransforms = instances;
+	drawnInstances.resize(instances.size());
+	for (size_t i = 0; i < instances.size(); i++)
+		drawnInstances[i] = (int)i; // What the instance buffer holds.
+	instanceCount = (GLsizei)instances.size();
+}
+
+// Returns the number of objects culled.
+unsigned int cullDraws() {
+	if (!cullingEnabled) {
+		visibleInstances.resize(instanceTransforms.size());
+		for (size_t i = 0; i < visibleInstances.size(); i++)
+			visibleInstances[i] = (int)i;
+		lightVisible = true;
+		return 0;
+	}
+	glm::mat4 camMatrix = cameraMatrix();
+	glm::vec4 planes[6];
+	frustumPlanes(camMatrix * cubeModel, planes);
+	bvhFrustum(instanceBvh, planes, visibleInstances);
+	std::vector<int> light;
+	lightVisible = frustumCull(lightSpheres, camMatrix * lightModel, light) > 0;
+	return (unsigned int)(instanceTransforms.size() - visibleInstances.size()) + (lightVisible ? 0 : 1);
+}
+
+std::vector<glm::mat4> visibleTransforms() {
+	std::vector<glm::mat4> transforms(visibleInstances.size());
+	for (size_t i = 0; i < visibleInstances.size(); i++)
+		transforms[i] = instanceTransforms[visibleInstances[i]];
+	return transforms;
+}
+
+//******************************************************************************************************************************
+// Bounding Volume Hierarchy
+void transformBounds(const glm::mat4& transform, const glm::vec3& localMin, const glm::vec3& localMax, glm::vec3& boundsMin, 
+	glm::vec3& boundsMax) {
+	boundsMin = boundsMax = glm::vec3(transform[3]);
+	for (int c = 0; c < 3; c++) {
+		glm::vec3 a = glm::vec3(transform[c]) * localMin[c], b = glm::vec3(transform[c]) * localMax[c];
+		boundsMin += glm::min(a, b);
+		boundsMax += glm::max(a, b);
+	}
+}
+
+float bvhArea(const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	glm::vec3 size = boundsMax - boundsMin;
+	return size.x * size.y + size.y * size.z + size.z * size.x;
+}
+
+// Bounds of references[begin, end) and where the cheapest binned SAH plane splits them, -1 for a leaf. Deep nodes and
+// coincident centroids fall back to a median split so the depth stays below BVH_MAX_DEPTH.
+int bvhSplit(std::vector<BvhReference>& references, int begin, int end, int depth, glm::vec3& boundsMin, glm::vec3& boundsMax) {
+	glm::vec3 centroidMin(FLT_MAX), centroidMax(-FLT_MAX);
+	boundsMin = glm::vec3(FLT_MAX);
+	boundsMax = glm::vec3(-FLT_MAX);
+	for (int i = begin; i < end; i++) {
+		boundsMin = glm::min(boundsMin, references[i].boundsMin);
+		boundsMax = glm::max(boundsMax, references[i].boundsMax);
+		centroidMin = glm::min(centroidMin, references[i].centroid);
+		centroidMax = glm::max(centroidMax, references[i].centroid);
+	}
+	if (end - begin <= BVH_LEAF_SIZE)
+		return -1;
+
+	glm::vec3 extent = centroidMax - centroidMin;
+	float bestCost = FLT_MAX;
+	int bestAxis = -1, bestBin = 0;
+	for (int axis = 0; axis < 3 && depth < BVH_MEDIAN_DEPTH; axis++) {
+		if (extent[axis] <= 0.0f)
+			continue;
+		int counts[BVH_BINS] = {};
+		glm::vec3 binMin[BVH_BINS], binMax[BVH_BINS];
+		for (int b = 0; b < BVH_BINS; b++) {
+			binMin[b] = glm::vec3(FLT_MAX);
+			binMax[b] = glm::vec3(-FLT_MAX);
+		}
+		float scale = BVH_BINS * 0.9999f / extent[axis];
+		for (int i = begin; i < end; i++) {
+			int bin = (int)((references[i].centroid[axis] - centroidMin[axis]) * scale);
+			counts[bin]++;
+			binMin[bin] = glm::min(binMin[bin], references[i].boundsMin);
+			binMax[bin] = glm::max(binMax[bin], references[i].boundsMax);
+		}
+
+		// Sweep from the right for the right side of every plane, then from the left.
+		float rightArea[BVH_BINS];
+		int rightCount[BVH_BINS];
+		glm::vec3 sideMin(FLT_MAX), sideMax(-FLT_MAX);
+		int count = 0;
+		for (int b = BVH_BINS - 1; b > 0; b--) {
+			count += counts[b];
+			sideMin = glm::min(sideMin, binMin[b]);
+			sideMax = glm::max(sideMax, binMax[b]);
+			rightCount[b] = count;
+			rightArea[b] = count ? bvhArea(sideMin, sideMax) : 0.0f;
+		}
+		sideMin = glm::vec3(FLT_MAX);
+		sideMax = glm::vec3(-FLT_MAX);
+		count = 0;
+		for (int b = 0; b < BVH_BINS - 1; b++) {
+			count += counts[b];
+			sideMin = glm::min(sideMin, binMin[b]);
+			sideMax = glm::max(sideMax, binMax[b]);
+			if (!count || !rightCount[b + 1])
+				continue;
+			float cost = count * bvhArea(sideMin, sideMax) + rightCount[b + 1] * rightArea[b + 1];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = b + 1;
+			}
+		}
+	}
+
+	int mid = (begin + end) / 2;
+	if (bestAxis >= 0) {
+		float scale = BVH_BINS * 0.9999f / extent[bestAxis];
+		mid = (int)(std::partition(references.begin() + begin, references.begin() + end, [&](const BvhReference& reference) {
+			return (int)((reference.centroid[bestAxis] - centroidMin[bestAxis]) * scale) < bestBin;
+		}) - references.begin());
+	}
+	else {
+		int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+		std::nth_element(references.begin() + begin, references.begin() + mid, references.begin() + end, 
+			[axis](const BvhReference& a, const BvhReference& b) { return a.centroid[axis] < b.centroid[axis]; });
+	}
+	return mid;
+}
+
+// Depth-first subtree over references[begin, end), leaves point at references until bvhFlatten() gives them slots.
+int bvhBuildRecursive(std::vector<BvhReference>& references, int begin, int end, int depth, std::vector<BvhNode>& nodes) {
+	glm::vec3 boundsMin, boundsMax;
+	int mid = bvhSplit(references, begin, end, depth, boundsMin, boundsMax);
+	int index = (int)nodes.size();
+	BvhNode node = { { boundsMin.x, boundsMin.y, boundsMin.z }, begin, { boundsMax.x, boundsMax.y, boundsMax.z }, end - begin };
+	nodes.push_back(node);
+	if (mid < 0)
+		return index;
+
+	bvhBuildRecursive(references, begin, mid, depth + 1, nodes);
+	int right = bvhBuildRecursive(references, mid, end, depth + 1, nodes);
+	nodes[index].index = right;
+	nodes[index].count = 0;
+	return index;
+}
+
+// Splits the top of the tree on the calling thread until the ranges are small enough for one task each.
+int bvhBuildTop(BvhBuild& build, int begin, int end, int depth) {
+	int index = (int)build.top.size();
+	build.top.push_back(BvhBuildNode());
+	if (end - begin < BVH_TASK_OBJECTS) {
+		build.top[index].task = (int)build.tasks.size();
+		build.tasks.push_back(BvhTask());
+		build.tasks.back().begin = begin;
+		build.tasks.back().end = end;
+		build.tasks.back().depth = depth;
+		return index;
+	}
+
+	int mid = bvhSplit(build.references, begin, end, depth, build.top[index].boundsMin, build.top[index].boundsMax);
+	build.top[index].task = -1;
+	int left = bvhBuildTop(build, begin, mid, depth + 1);
+	int right = bvhBuildTop(build, mid, end, depth + 1);
+	build.top[index].left = left;
+	build.top[index].right = right;
+	return index;
+}
+
+void bvhSetSlot(Bvh& bvh, int slot, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+	bvh.boundsMin[slot] = boundsMin;
+	bvh.boundsMax[slot] = boundsMax;
+	bvh.spheres.x[slot] = center.x;
+	bvh.spheres.y[slot] = center.y;
+	bvh.spheres.z[slot] = center.z;
+	bvh.spheres.radius[slot] = glm::length(boundsMax - boundsMin) * 0.5f;
+}
+
+// Gives a leaf its BVH_LEAF_SIZE slots, the unused ones are padding that no query returns.
+void bvhAddLeaf(Bvh& bvh, const BvhBuild& build, BvhNode& node) {
+	int slot = (int)bvh.objects.size();
+	bvh.objects.resize(slot + BVH_LEAF_SIZE, -1);
+	for (int i = 0; i < node.count; i++)
+		bvh.objects[slot + i] = build.references[node.index + i].object;
+	node.index = slot;
+}
+
+void bvhFlatten(Bvh& bvh, BvhBuild& build, int top) {
+	const BvhBuildNode& buildNode = build.top[top];
+	if (buildNode.task >= 0) {
+		int base = (int)bvh.nodes.size();
+		for (BvhNode node : build.tasks[buildNode.task].nodes) {
+			if (node.count)
+				bvhAddLeaf(bvh, build, node);
+			else
+				node.index += base;
+			bvh.nodes.push_back(node);
+		}
+		return;
+	}
+
+	int index = (int)bvh.nodes.size();
+	glm::vec3 boundsMin = buildNode.boundsMin, boundsMax = buildNode.boundsMax;
+	BvhNode node = { { boundsMin.x, boundsMin.y, boundsMin.z }, 0, { boundsMax.x, boundsMax.y, boundsMax.z }, 0 };
+	bvh.nodes.push_back(node);
+	bvhFlatten(bvh, build, buildNode.left);
+	bvh.nodes[index].index = (int)bvh.nodes.size();
+	bvhFlatten(bvh, build, buildNode.right);
+}
+
+// Builds the hierarchy over object bounds, the subtrees below the top levels are built on worker threads.
+void bvhBuild(Bvh& bvh, const std::vector<glm::vec3>& boundsMin, const std::vector<glm::vec3>& boundsMax) {
+	BvhBuild build;
+	int count = (int)boundsMin.size();
+	build.references.resize(count);
+	for (int i = 0; i < count; i++) {
+		build.references[i].boundsMin = boundsMin[i];
+		build.references[i].boundsMax = boundsMax[i];
+		build.references[i].centroid = (boundsMin[i] + boundsMax[i]) * 0.5f;
+		build.references[i].object = i;
+	}
+
+	bvh = Bvh();
+	if (!count)
+		return;
+	bvhBuildTop(build, 0, count, 0);
+	parallelFor((int)build.tasks.size(), [&build](int t) {
+		BvhTask& task = build.tasks[t];
+		bvhBuildRecursive(build.references, task.begin, task.end, task.depth, task.nodes);
+	});
+	bvhFlatten(bvh, build, 0);
+
+	size_t slots = bvh.objects.size();
+	bvh.boundsMin.assign(slots, glm::vec3(FLT_MAX));
+	bvh.boundsMax.assign(slots, glm::vec3(-FLT_MAX));
+	bvh.spheres.x.assign(slots, 0.0f);
+	bvh.spheres.y.assign(slots, 0.0f);
+	bvh.spheres.z.assign(slots, 0.0f);
+	bvh.spheres.radius.assign(slots, -FLT_MAX);
+	bvh.slots.resize(count);
+	for (size_t slot = 0; slot < slots; slot++)
+		if (bvh.objects[slot] >= 0) {
+			bvh.slots[bvh.objects[slot]] = (int)slot;
+			bvhSetSlot(bvh, (int)slot, boundsMin[bvh.objects[slot]], boundsMax[bvh.objects[slot]]);
+		}
+}
+
+// Moves the objects without changing the tree: new leaf bounds, then the parents bottom up (children follow their parent).
+void bvhRefit(Bvh& bvh, const std::vector<glm::vec3>& boundsMin, const std::vector<glm::vec3>& boundsMax) {
+	int slots = (int)bvh.objects.size();
+	parallelFor((slots + BVH_TASK_OBJECTS - 1) / BVH_TASK_OBJECTS, [&](int chunk) {
+		for (int slot = chunk * BVH_TASK_OBJECTS; slot < std::min((chunk + 1) * BVH_TASK_OBJECTS, slots); slot++)
+			if (bvh.objects[slot] >= 0)
+				bvhSetSlot(bvh, slot, boundsMin[bvh.objects[slot]], boundsMax[bvh.objects[slot]]);
+	});
+
+	for (int n = (int)bvh.nodes.size() - 1; n >= 0; n--) {
+		BvhNode& node = bvh.nodes[n];
+		glm::vec3 nodeMin(FLT_MAX), nodeMax(-FLT_MAX);
+		if (node.count)
+			for (int slot = node.index; slot < node.index + node.count; slot++) {
+				nodeMin = glm::min(nodeMin, bvh.boundsMin[slot]);
+				nodeMax = glm::max(nodeMax, bvh.boundsMax[slot]);
+			}
+		else {
+			const BvhNode& left = bvh.nodes[n + 1];
+			const BvhNode& right = bvh.nodes[node.index];
+			nodeMin = glm::min(glm::make_vec3(left.boundsMin), glm::make_vec3(right.boundsMin));
+			nodeMax = glm::max(glm::make_vec3(left.boundsMax), glm::make_vec3(right.boundsMax));
+		}
+		for (int c = 0; c < 3; c++) {
+			node.boundsMin[c] = nodeMin[c];
+			node.boundsMax[c] = nodeMax[c];
+		}
+	}
+}
+
+// 0 when the node is outside the frustum, 1 when it crosses a plane, 2 when it is inside.
+int bvhFrustumTest(const BvhNode& node, const glm::vec4 planes[6]) {
+	int result = 2;
+	for (int p = 0; p < 6; p++) {
+		float farthest = planes[p].w, nearest = planes[p].w; // Corners along and against the normal.
+		for (int c = 0; c < 3; c++) {
+			float n = planes[p][c];
+			farthest += n * (n >= 0.0f ? node.boundsMax[c] : node.boundsMin[c]);
+			nearest += n * (n >= 0.0f ? node.boundsMin[c] : node.boundsMax[c]);
+		}
+		if (farthest < 0.0f)
+			return 0;
+		if (nearest < 0.0f)
+			result = 1;
+	}
+	return result;
+}
+
+// Objects whose bounding sphere is in the frustum, in slot order. Subtrees inside the frustum are taken without tests.
+int bvhFrustum(const Bvh& bvh, const glm::vec4 planes[6], std::vector<int>& visible) {
+	visible.clear();
+	int stack[BVH_MAX_DEPTH];
+	int stackSize = 0;
+	if (!bvh.nodes.empty())
+		stack[stackSize++] = 0;
+	while (stackSize) {
+		int entry = stack[--stackSize]; // Node index * 2 + 1 when the node is known to be inside.
+		const BvhNode& node = bvh.nodes[entry >> 1];
+		int inside = entry & 1;
+		if (!inside) {
+			int test = bvhFrustumTest(node, planes);
+			if (!test)
+				continue;
+			inside = test == 2;
+		}
+		if (!node.count) {
+			stack[stackSize++] = node.index * 2 + inside;
+			stack[stackSize++] = ((entry >> 1) + 1) * 2 + inside;
+			continue;
+		}
+		if (inside)
+			visible.insert(visible.end(), bvh.objects.begin() + node.index, bvh.objects.begin() + node.index + node.count);
+		else {
+			int slots[BVH_LEAF_SIZE];
+			int count = cullRange(bvh.spheres, planes, node.index, node.index + BVH_LEAF_SIZE, slots);
+			for (int i = 0; i < count; i++)
+				visible.push_back(bvh.objects[slots[i]]);
+		}
+	}
+	return (int)visible.size();
+}
+
+// Distance where the ray enters the box, false when it misses or enters beyond maxDistance.
+bool rayBox(const glm::vec3& origin, const glm::vec3& inverseDirection, const float* boundsMin, const float* boundsMax, 
+	float maxDistance, float& distance) {
+	float enter = 0.0f, exit = maxDistance;
+	for (int c = 0; c < 3; c++) {
+		float t0 = (boundsMin[c] - origin[c]) * inverseDirection[c];
+		float t1 = (boundsMax[c] - origin[c]) * inverseDirection[c];
+		enter = std::max(enter, std::min(t0, t1));
+		exit = std::min(exit, std::max(t0, t1));
+	}
+	distance = enter;
+	return enter <= exit;
+}
+
+// Nearest object whose bounds the ray hits within distance (in units of direction), -1 for none. Children are visited near
+// to far so most far subtrees are skipped.
+int bvhRay(const Bvh& bvh, const glm::vec3& origin, const glm::vec3& direction, float& distance) {
+	glm::vec3 inverseDirection = 1.0f / direction;
+	int hit = -1;
+	int stack[BVH_MAX_DEPTH];
+	int stackSize = 0;
+	float entry;
+	if (!bvh.nodes.empty() && rayBox(origin, inverseDirection, bvh.nodes[0].boundsMin, bvh.nodes[0].boundsMax, distance, entry))
+		stack[stackSize++] = 0;
+	while (stackSize) {
+		int index = stack[--stackSize];
+		const BvhNode& node = bvh.nodes[index];
+		if (node.count) {
+			for (int slot = node.index; slot < node.index + node.count; slot++)
+				if (rayBox(origin, inverseDirection, &bvh.boundsMin[slot].x, &bvh.boundsMax[slot].x, distance, entry)) {
+					distance = entry;
+					hit = bvh.objects[slot];
+				}
+			continue;
+		}
+
+		int left = index + 1, right = node.index;
+		float leftEntry, rightEntry;
+		bool leftHit = rayBox(origin, inverseDirection, bvh.nodes[left].boundsMin, bvh.nodes[left].boundsMax, distance, leftEntry);
+		bool rightHit = rayBox(origin, inverseDirection, bvh.nodes[right].boundsMin, bvh.nodes[right].boundsMax, distance, 
+			rightEntry);
+		if (leftHit && rightHit && rightEntry < leftEntry)
+			std::swap(left, right);
+		if (leftHit && rightHit)
+			stack[stackSize++] = right;
+		if (leftHit || rightHit)
+			stack[stackSize++] = leftHit ? left : right;
+	}
+	return hit;
+}
+
+// Objects whose bounds overlap the box.
+int bvhOverlap(const Bvh& bvh, const glm::vec3& boundsMin, const glm::vec3& boundsMax, std::vector<int>& objects) {
+	auto overlaps = [&](const float* otherMin, const float* otherMax) {
+		return otherMin[0] <= boundsMax.x && otherMax[0] >= boundsMin.x && otherMin[1] <= boundsMax.y && 
+			otherMax[1] >= boundsMin.y && otherMin[2] <= boundsMax.z && otherMax[2] >= boundsMin.z;
+	};
+	objects.clear();
+	int stack[BVH_MAX_DEPTH];
+	int stackSize = 0;
+	if (!bvh.nodes.empty())
+		stack[stackSize++] = 0;
+	while (stackSize) {
+		int index = stack[--stackSize];
+		const BvhNode& node = bvh.nodes[index];
+		if (!overlaps(node.boundsMin, node.boundsMax))
+			continue;
+		if (!node.count) {
+			stack[stackSize++] = node.index;
+			stack[stackSize++] = index + 1;
+			continue;
+		}
+		for (int slot = node.index; slot < node.index + node.count; slot++)
+			if (overlaps(&bvh.boundsMin[slot].x, &bvh.boundsMax[slot].x))
+				objects.push_back(bvh.objects[slot]);
+	}
+	return (int)objects.size();
+}
+
+// Instance under a window position, the ray is traced in the space of cubeModel where the instance hierarchy lives.
+int pickInstance(double x, double y, float& distance) {
+	glm::vec2 ndc((float)(2.0 * x / SCREEN_WIDTH - 1.0), (float)(1.0 - 2.0 * y / SCREEN_HEIGHT));
+	glm::mat4 inverse = glm::inverse(cameraMatrix() * cubeModel);
+	glm::vec4 nearPoint = inverse * glm::vec4(ndc, -1.0f, 1.0f);
+	glm::vec4 farPoint = inverse * glm::vec4(ndc, 1.0f, 1.0f);
+	glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+	glm::vec3 direction = glm::vec3(farPoint) / farPoint.w - origin;
+
+	float t = 1.0f;
+	int instance = bvhRay(instanceBvh, origin, direction, t);
+	distance = glm::length(glm::vec3(cubeModel * glm::vec4(origin + direction * t, 1.0f)) - camPos);
+	return instance;
+}
+
+// Edges of the bounds of the picked instance. The lines are rebuilt every frame and drawn straight from the stream buffer.
+void recordPickOutline(CommandBuffer& commands, const ProgramInfo& program) {
+	// Corner c has the maximum x when bit 0 is set, y for bit 1 and z for bit 2.
+	static const GLuint edges[24] = { 0, 1, 1, 5, 5, 4, 4, 0, 2, 3, 3, 7, 7, 6, 6, 2, 0, 2, 1, 3, 4, 6, 5, 7 };
+	glm::vec3 corners[8];
+	for (int c = 0; c < 8; c++) {
+		glm::vec3 corner(c & 1 ? pyramidBoundsMax.x : pyramidBoundsMin.x, c & 2 ? pyramidBoundsMax.y : pyramidBoundsMin.y, 
+			c & 4 ? pyramidBoundsMax.z : pyramidBoundsMin.z);
+		corners[c] = glm::vec3(instanceTransforms[pickedInstance] * glm::vec4(corner, 1.0f));
+	}
+	ModelCommand model;
+	memcpy(model.model, glm::value_ptr(cubeModel), sizeof(model.model));
+	recordCommand(commands, COMMAND_USE_PROGRAM, ProgramCommand{ &program });
+	recordCommand(commands, COMMAND_SET_MODEL, model);
+	recordStreamedDraw(commands, vertexLayoutPosition, GL_LINES, corners, sizeof(corners), edges, 24);
+}
+
+// --bench-bvh N: queries/sec of the hierarchy against a linear scan over N random boxes.
+int bvhBenchmark(const AppOptions& options) {
+	int count = std::max(options.bvhObjects, 1);
+	unsigned int seed = 12345;
+	auto random = [&seed]() {
+		seed = seed * 1664525u + 1013904223u;
+		return (seed >> 8) / 16777216.0f;
+	};
+	auto randomVec3 = [&random](float scale) { 
+		float x = random(), y = random(), z = random();
+		return (glm::vec3(x, y, z) * 2.0f - 1.0f) * scale;
+	};
+	float worldSize = std::cbrt((float)count) * 2.0f;
+	std::vector<glm::vec3> boundsMin(count), boundsMax(count);
+	for (int i = 0; i < count; i++) {
+		glm::vec3 center = randomVec3(worldSize), size = glm::vec3(0.25f) + glm::abs(randomVec3(0.5f));
+		boundsMin[i] = center - size;
+		boundsMax[i] = center + size;
+	}
+	auto now = []() { return std::chrono::steady_clock::now(); };
+	auto milliseconds = [&now](std::chrono::steady_clock::time_point start) { 
+		return std::chrono::duration<double, std::milli>(now() - start).count();
+	};
+
+	Bvh bvh;
+	std::chrono::steady_clock::time_point start = now();
+	bvhBuild(bvh, boundsMin, boundsMax);
+	double buildTime = milliseconds(start);
+	for (int i = 0; i < count; i++) {
+		glm::vec3 offset = randomVec3(0.1f);
+		boundsMin[i] += offset;
+		boundsMax[i] += offset;
+	}
+	start = now();
+	bvhRefit(bvh, boundsMin, boundsMax);
+	double refitTime = milliseconds(start);
+	std::cout << "BVH" << " [objects: " << count << ", nodes: " << bvh.nodes.size() << ", build ms: " << buildTime 
+		<< ", refit ms: " << refitTime << ", threads: " << jobSystem.threadCount << "]" << std::endl;
+
+	// Every query type runs against the hierarchy and a linear scan, mismatches are counted on the checked queries. The linear
+	// frustum test is the SIMD scan over the spheres of the hierarchy, which also keeps objects whose box is outside.
+	const int checked = 100;
+	auto report = [](const char* query, int queries, double bvhTime, double linearTime, int results, int mismatches) {
+		std::cout << "BVH" << " [query: " << query << ", queries/sec: " << 1000.0 * queries / bvhTime << ", linear queries/sec: " 
+			<< 1000.0 * queries / linearTime << ", results/query: " << (double)results / queries << ", mismatches: " << mismatches 
+			<< "]" << std::endl;
+	};
+
+	int frustumQueries = std::max(10000000 / count, 10);
+	std::vector<glm::mat4> views(frustumQueries);
+	for (glm::mat4& view : views)
+		view = glm::perspective(FOV, (float)SCREEN_WIDTH / SCREEN_HEIGHT, NEAR_PLANE, worldSize) * 
+			glm::lookAt(randomVec3(worldSize), randomVec3(worldSize), glm::vec3(0.0f, 1.0f, 0.0f));
+	std::vector<int> visible, reference;
+	int results = 0, mismatches = 0;
+	start = now();
+	for (const glm::mat4& view : views) {
+		glm::vec4 planes[6];
+		frustumPlanes(view, planes);
+		results += bvhFrustum(bvh, planes, visible);
+	}
+	double bvhTime = milliseconds(start);
+	start = now();
+	for (const glm::mat4& view : views)
+		frustumCull(bvh.spheres, view, reference);
+	double linearTime = milliseconds(start);
+	for (int q = 0; q < std::min(checked, frustumQueries); q++) {
+		glm::vec4 planes[6];
+		frustumPlanes(views[q], planes);
+		bvhFrustum(bvh, planes, visible);
+		frustumCull(bvh.spheres, views[q], reference);
+		for (int& slot : reference)
+			slot = bvh.objects[slot];
+		std::sort(visible.begin(), visible.end());
+		std::sort(reference.begin(), reference.end());
+		std::vector<int> missing;
+		std::set_difference(reference.begin(), reference.end(), visible.begin(), visible.end(), std::back_inserter(missing));
+		for (int object : missing) {
+			BvhNode box = { { boundsMin[object].x, boundsMin[object].y, boundsMin[object].z }, 0, 
+				{ boundsMax[object].x, boundsMax[object].y, boundsMax[object].z }, 1 };
+			mismatches += bvhFrustumTest(box, planes) != 0;
+		}
+		mismatches += !std::includes(reference.begin(), reference.end(), visible.begin(), visible.end());
+	}
+	report("frustum", frustumQueries, bvhTime, linearTime, results, mismatches);
+
+	const int rayQueries = 100000;
+	std::vector<glm::vec3> origins(rayQueries), directions(rayQueries);
+	for (int q = 0; q < rayQueries; q++) {
+		origins[q] = randomVec3(worldSize);
+		directions[q] = randomVec3(1.0f);
+	}
+	auto linearRay = [&](int q, float& distance) {
+		glm::vec3 inverseDirection = 1.0f / directions[q];
+		int hit = -1;
+		float entry;
+		for (int i = 0; i < count; i++)
+			if (rayBox(origins[q], inverseDirection, &boundsMin[i].x, &boundsMax[i].x, distance, entry)) {
+				distance = entry;
+				hit = i;
+			}
+		return hit;
+	};
+	results = mismatches = 0;
+	start = now();
+	for (int q = 0; q < rayQueries; q++) {
+		float distance = FLT_MAX;
+		results += bvhRay(bvh, origins[q], directions[q], distance) >= 0;
+	}
+	bvhTime = milliseconds(start);
+	int linearQueries = std::max(std::min(rayQueries, 100000000 / count), 1);
+	int linearResults = 0;
+	start = now();
+	for (int q = 0; q < linearQueries; q++) {
+		float distance = FLT_MAX;
+		linearResults += linearRay(q, distance) >= 0;
+	}
+	linearTime = milliseconds(start) * rayQueries / linearQueries;
+	for (int q = 0; q < checked; q++) {
+		float distance = FLT_MAX, referenceDistance = FLT_MAX;
+		bvhRay(bvh, origins[q], directions[q], distance);
+		linearRay(q, referenceDistance);
+		mismatches += distance != referenceDistance;
+	}
+	report("ray", rayQueries, bvhTime, linearTime, results, mismatches);
+
+	const int overlapQueries = 100000;
+	std::vector<glm::vec3> queryMin(overlapQueries), queryMax(overlapQueries);
+	for (int q = 0; q < overlapQueries; q++) {
+		queryMin[q] = randomVec3(worldSize);
+		queryMax[q] = queryMin[q] + glm::abs(randomVec3(2.0f));
+	}
+	auto linearOverlap = [&](int q, std::vector<int>& objects) {
+		objects.clear();
+		for (int i = 0; i < count; i++)
+			if (glm::all(glm::lessThanEqual(boundsMin[i], queryMax[q])) && glm::all(glm::greaterThanEqual(boundsMax[i], queryMin[q])))
+				objects.push_back(i);
+	};
+	results = mismatches = 0;
+	start = now();
+	for (int q = 0; q < overlapQueries; q++)
+		results += bvhOverlap(bvh, queryMin[q], queryMax[q], visible);
+	bvhTime = milliseconds(start);
+	start = now();
+	for (int q = 0; q < linearQueries; q++) {
+		linearOverlap(q, reference);
+		linearResults += (int)reference.size();
+	}
+	linearTime = milliseconds(start) * overlapQueries / linearQueries;
+	for (int q = 0; q < checked; q++) {
+		bvhOverlap(bvh, queryMin[q], queryMax[q], visible);
+		linearOverlap(q, reference);
+		std::sort(visible.begin(), visible.end());
+		mismatches += visible != reference;
+	}
+	report("overlap", overlapQueries, bvhTime, linearTime, results, mismatches);
+	return linearResults >= 0 ? 0 : -1; // Keeps the linear loops from being optimized out.
+}
+
+//******************************************************************************************************************************
+// Occlusion Culling
+void occlusionInit(OcclusionCuller& culler, const ObjectData& occluder, const ObjectData& light) {
+	const unsigned char* vertices = (const unsigned char*)occluder.vertices;
+	const VertexAttribute* position = findAttribute(occluder.layout, 0);
+	size_t vertexCount = occluder.layout.stride ? occluder.verticesSize / occluder.layout.stride : 0;
+	glm::vec3 positionScale, positionOffset;
+	positionDequantization(occluder, positionScale, positionOffset);
+	culler.occluderVertices.resize(position ? vertexCount : 0);
+	for (size_t v = 0; v < culler.occluderVertices.size(); v++) {
+		float aPos[4];
+		fetchAttribute(vertices + v * occluder.layout.stride, *position, aPos);
+		culler.occluderVertices[v] = glm::make_vec3(aPos) * positionScale + positionOffset;
+	}
+	const GLuint* indices = (const GLuint*)occluder.indices;
+	culler.occluderIndices.assign(indices, indices + occluder.indicesSize / sizeof(GLuint));
+	culler.lightBoundsMin = light.boundsMin;
+	culler.lightBoundsMax = light.boundsMax;
+
+	// Hi-Z levels halve (rounding up) down to 1x1.
+	int width = OCCLUSION_WIDTH, height = OCCLUSION_HEIGHT;
+	while (true) {
+		culler.levelWidth.push_back(width);
+		culler.levelHeight.push_back(height);
+		culler.levels.push_back(std::vector<float>(width * height, 1.0f));
+		if (width == 1 && height == 1)
+			break;
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+	}
+
+	culler.lightOccluded = false;
+}
+
+void occlusionTerminate(OcclusionCuller& culler) {
+	occlusionWait(culler);
+}
+
+// Until the last job has run, the instance set may change after this.
+void occlusionWait(OcclusionCuller& culler) {
+	jobWait(culler.pending);
+}
+
+// Drops what the previous frame found occluded from the frustum culling result of this frame, then submits a job for this
+// frame. Objects that entered the frustum since are kept, so a result is at most one frame late. Returns the number of
+// objects dropped.
+int occlusionCull(OcclusionCuller& culler, std::vector<int>& visible, bool& lightVisible) {
+	OcclusionJob job;
+	job.camMatrix = cameraMatrix();
+	job.model = cubeModel;
+	job.lightModel = lightModel;
+	job.camPos = camPos;
+	job.candidates = visible;
+	job.lightCandidate = lightVisible;
+	job.transforms = &instanceTransforms;
+	job.bvh = &instanceBvh;
+
+	occlusionWait(culler);
+	int occluded = 0;
+	if (culler.occluded.size() == instanceTransforms.size()) {
+		size_t kept = 0;
+		for (int instance : visible)
+			if (!culler.occluded[instance])
+				visible[kept++] = instance;
+		occluded = (int)(visible.size() - kept);
+		visible.resize(kept);
+	}
+	if (lightVisible && culler.lightOccluded) {
+		lightVisible = false;
+		occluded++;
+	}
+
+	culler.job = std::move(job);
+	jobSubmit([&culler]() {
+		TraceZone trace("occlusionRun");
+		occlusionRun(culler, culler.job, culler.occluded, culler.lightOccluded);
+	}, &culler.pending);
+	return occluded;
+}
+
+void occlusionRun(OcclusionCuller& culler, const OcclusionJob& job, std::vector<unsigned char>& occluded, bool& lightOccluded) {
+	const Bvh& bvh = *job.bvh;
+	glm::mat4 matrix = job.camMatrix * job.model;
+
+	// The nearest candidates are the occluders.
+	glm::vec3 eye = glm::vec3(glm::inverse(job.model) * glm::vec4(job.camPos, 1.0f));
+	std::vector<std::pair<float, int>> nearest(job.candidates.size());
+	for (size_t i = 0; i < job.candidates.size(); i++) {
+		int slot = bvh.slots[job.candidates[i]];
+		glm::vec3 offset = (bvh.boundsMin[slot] + bvh.boundsMax[slot]) * 0.5f - eye;
+		nearest[i] = std::make_pair(glm::dot(offset, offset), job.candidates[i]);
+	}
+	size_t occluders = std::min(nearest.size(), (size_t)OCCLUSION_OCCLUDERS);
+	std::partial_sort(nearest.begin(), nearest.begin() + occluders, nearest.end());
+
+	std::fill(culler.levels[0].begin(), culler.levels[0].end(), 1.0f);
+	for (size_t i = 0; i < occluders; i++)
+		occlusionRasterize(culler, matrix * (*job.transforms)[nearest[i].second]);
+	occlusionBuildPyramid(culler);
+
+	occluded.assign(job.transforms->size(), 0);
+	for (int instance : job.candidates) {
+		int slot = bvh.slots[instance];
+		occluded[instance] = !occlusionTest(culler, matrix, bvh.boundsMin[slot], bvh.boundsMax[slot]);
+	}
+	lightOccluded = job.lightCandidate && 
+		!occlusionTest(culler, job.camMatrix * job.lightModel, culler.lightBoundsMin, culler.lightBoundsMax);
+}
+
+// Nearest depth of the occluder per pixel, sampled at pixel centers. Triangles reaching behind the near plane are skipped,
+// which only loses occlusion.
+void occlusionRasterize(OcclusionCuller& culler, const glm::mat4& matrix) {
+	std::vector<float>& depth = culler.levels[0];
+	std::vector<glm::vec4> screen(culler.occluderVertices.size());
+	for (size_t v = 0; v < screen.size(); v++) {
+		glm::vec4 clip = matrix * glm::vec4(culler.occluderVertices[v], 1.0f);
+		glm::vec3 ndc = glm::vec3(clip) / clip.w;
+		screen[v] = glm::vec4((ndc.x * 0.5f + 0.5f) * OCCLUSION_WIDTH, (ndc.y * 0.5f + 0.5f) * OCCLUSION_HEIGHT, 
+			ndc.z * 0.5f + 0.5f, clip.w);
+	}
+
+	for (size_t i = 0; i + 2 < culler.occluderIndices.size(); i += 3) {
+		const glm::vec4& a = screen[culler.occluderIndices[i]];
+		const glm::vec4& b = screen[culler.occluderIndices[i + 1]];
+		const glm::vec4& c = screen[culler.occluderIndices[i + 2]];
+		if (a.w < NEAR_PLANE || b.w < NEAR_PLANE || c.w < NEAR_PLANE)
+			continue;
+		float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+		if (area == 0.0f)
+			continue;
+		float sign = area > 0.0f ? 1.0f : -1.0f; // Both windings, the occluders are closed.
+
+		int minX = std::max((int)std::ceil(std::min(a.x, std::min(b.x, c.x)) - 0.5f), 0);
+		int maxX = std::min((int)std::floor(std::max(a.x, std::max(b.x, c.x)) - 0.5f), OCCLUSION_WIDTH - 1);
+		int minY = std::max((int)std::ceil(std::min(a.y, std::min(b.y, c.y)) - 0.5f), 0);
+		int maxY = std::min((int)std::floor(std::max(a.y, std::max(b.y, c.y)) - 0.5f), OCCLUSION_HEIGHT - 1);
+		for (int y = minY; y <= maxY; y++)
+			for (int x = minX; x <= maxX; x++) {
+				float px = x + 0.5f, py = y + 0.5f;
+				float w0 = sign * ((c.x - b.x) * (py - b.y) - (c.y - b.y) * (px - b.x));
+				float w1 = sign * ((a.x - c.x) * (py - c.y) - (a.y - c.y) * (px - c.x));
+				float w2 = sign * ((b.x - a.x) * (py - a.y) - (b.y - a.y) * (px - a.x));
+				if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+					continue;
+				float z = (w0 * a.z + w1 * b.z + w2 * c.z) * sign / area;
+				float& texel = depth[y * OCCLUSION_WIDTH + x];
+				texel = std::min(texel, z);
+			}
+	}
+}
+
+// Every texel keeps the farthest depth of the texels below it.
+void occlusionBuildPyramid(OcclusionCuller& culler) {
+	for (size_t level = 1; level < culler.levels.size(); level++) {
+		const std::vector<float>& source = culler.levels[level - 1];
+		std::vector<float>& target = culler.levels[level];
+		int sourceWidth = culler.levelWidth[level - 1], sourceHeight = culler.levelHeight[level - 1];
+		int width = culler.levelWidth[level], height = culler.levelHeight[level];
+		for (int y = 0; y < height; y++) {
+			int y0 = y * 2, y1 = std::min(y * 2 + 1, sourceHeight - 1);
+			for (int x = 0; x < width; x++) {
+				int x0 = x * 2, x1 = std::min(x * 2 + 1, sourceWidth - 1);
+				target[y * width + x] = std::max(std::max(source[y0 * sourceWidth + x0], source[y0 * sourceWidth + x1]), 
+					std::max(source[y1 * sourceWidth + x0], source[y1 * sourceWidth + x1]));
+			}
+		}
+	}
+}
+
+// False when the box is behind the occluders: its nearest depth is farther than the farthest occluder depth over its screen
+// rectangle, read from the level where the rectangle covers at most 2x2 texels.
+bool occlusionTest(const OcclusionCuller& culler, const glm::mat4& matrix, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	glm::vec2 rectMin(FLT_MAX), rectMax(-FLT_MAX);
+	float nearest = FLT_MAX;
+	for (int corner = 0; corner < 8; corner++) {
+		glm::vec3 position(corner & 1 ? boundsMax.x : boundsMin.x, corner & 2 ? boundsMax.y : boundsMin.y, 
+			corner & 4 ? boundsMax.z : boundsMin.z);
+		glm::vec4 clip = matrix * glm::vec4(position, 1.0f);
+		if (clip.w < NEAR_PLANE)
+			return true; // Reaches behind the near plane.
+		glm::vec3 ndc = glm::vec3(clip) / clip.w;
+		rectMin = glm::min(rectMin, glm::vec2(ndc));
+		rectMax = glm::max(rectMax, glm::vec2(ndc));
+		nearest = std::min(nearest, ndc.z * 0.5f + 0.5f);
+	}
+
+	int x0 = std::max((int)std::floor((rectMin.x * 0.5f + 0.5f) * OCCLUSION_WIDTH), 0);
+	int x1 = std::min((int)std::floor((rectMax.x * 0.5f + 0.5f) * OCCLUSION_WIDTH), OCCLUSION_WIDTH - 1);
+	int y0 = std::max((int)std::floor((rectMin.y * 0.5f + 0.5f) * OCCLUSION_HEIGHT), 0);
+	int y1 = std::min((int)std::floor((rectMax.y * 0.5f + 0.5f) * OCCLUSION_HEIGHT), OCCLUSION_HEIGHT - 1);
+	if (x0 > x1 || y0 > y1)
+		return true;
+
+	int level = 0;
+	while (level + 1 < (int)culler.levels.size() && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+		level++;
+	const std::vector<float>& depth = culler.levels[level];
+	int width = culler.levelWidth[level];
+	float farthest = 0.0f;
+	for (int y = y0 >> level; y <= y1 >> level; y++)
+		for (int x = x0 >> level; x <= x1 >> level; x++)
+			farthest = std::max(farthest, depth[y * width + x]);
+	return nearest <= farthest;
+}
+
+//******************************************************************************************************************************
+// Render Queue
+// Every program, vertex array and texture bind goes through the cache, so it always knows the current GL state.
+void stateUseProgram(GLStateCache& cache, GLuint program) {
+	if (cache.program == program) {
+		frameStats.avoidedStateChanges++;
+		return;
+	}
+	DRIVER_CALL(glUseProgram(program));
+	cache.program = program;
+}
+
+void stateBindVertexArray(GLStateCache& cache, GLuint vertexArray) {
+	if (cache.vertexArray == vertexArray) {
+		frameStats.avoidedStateChanges++;
+		return;
+	}
+	DRIVER_CALL(glBindVertexArray(vertexArray));
+	cache.vertexArray = vertexArray;
+}
+
+void stateBindTexture(GLStateCache& cache, GLuint texture) {
+	if (cache.texture == texture) {
+		frameStats.avoidedStateChanges++;
+		return;
+	}
+	DRIVER_CALL(glBindTexture(GL_TEXTURE_2D, texture));
+	cache.texture = texture;
+}
+
+// Streams the DrawConstants of a draw, consecutive draws with the same model share the range.
+void stateSetModel(GLStateCache& cache, const glm::mat4& model) {
+	if (cache.drawConstants >= 0 && cache.model == model) {
+		frameStats.avoidedStateChanges++;
+		return;
+	}
+	DrawConstants constants = { model };
+	cache.drawConstants = streamWrite(streamBuffer, &constants, sizeof(constants), streamBuffer.uniformAlignment);
+	cache.model = model;
+	DRIVER_CALL(glBindBufferRange(GL_UNIFORM_BUFFER, DRAW_CONSTANTS_BINDING, streamBuffer.buffer, cache.drawConstants, 
+		sizeof(constants)));
+}
+
+// Pass, program, material, texture and vertex array from the high bits down, so draws sharing state sort next to each other,
+// then front to back. Names wider than their field only lose grouping, never correctness.
+unsigned long long drawKey(RenderPass pass, GLuint program, GLuint material, GLuint texture, GLuint vertexArray, float depth) {
+	unsigned long long quantized = (unsigned long long)(glm::clamp(depth, 0.0f, 1.0f) * 65535.0f);
+	return (unsigned long long)(pass & 0xF) << 60 | (unsigned long long)(program & 0x3FF) << 50 | 
+		(unsigned long long)(material & 0xFFF) << 38 | (unsigned long long)(texture & 0xFFF) << 26 | 
+		(unsigned long long)(vertexArray & 0x3FF) << 16 | quantized;
+}
+
+// Distance of the model origin from the camera, 0 to 1 over the depth range.
+float viewDepth(const glm::mat4& model) {
+	return glm::length(glm::vec3(model[3]) - camPos) / FAR_PLANE;
+}
+
+void queueDraw(RenderQueue& queue, RenderPass pass, GLuint material, const DrawItem& item) {
+	queue.items.push_back(item);
+	queue.items.back().key = drawKey(pass, item.program->id, material, (GLuint)(item.texture + 1), item.vertexArray, 
+		viewDepth(item.model));
+}
+
+// Redundant binds are recorded too, the state cache drops them during the replay.
+void submitQueue(RenderQueue& queue, CommandBuffer& commands) {
+	std::stable_sort(queue.items.begin(), queue.items.end(), [](const DrawItem& a, const DrawItem& b) { return a.key < b.key; });
+	for (const DrawItem& item : queue.items) {
+		ProfileZone zone(commands, item.scope);
+		recordCommand(commands, COMMAND_USE_PROGRAM, ProgramCommand{ item.program });
+		if (item.texture >= 0)
+			recordCommand(commands, COMMAND_BIND_TEXTURE, TextureCommand{ item.texture });
+		recordCommand(commands, COMMAND_BIND_VERTEX_ARRAY, VertexArrayCommand{ item.vertexArray });
+		ModelCommand model;
+		memcpy(model.model, glm::value_ptr(item.model), sizeof(model.model));
+		recordCommand(commands, COMMAND_SET_MODEL, model);
+		recordCommand(commands, COMMAND_DRAW, DrawCommand{ item.mesh, item.instances });
+	}
+	queue.items.clear();
+}
+
+//******************************************************************************************************************************
+// Geometry Heap
+int lowestBit(unsigned int mask) {
+#ifdef _WIN32
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+int highestBit(unsigned int value) {
+#ifdef _WIN32
+	unsigned long index;
+	_BitScanReverse(&index, value);
+	return (int)index;
+#else
+	return 31 - __builtin_clz(value);
+#endif
+}
+
+void heapInit(OffsetHeap& heap, GLuint capacity) {
+	heap.nodes.clear();
+	heap.spare.clear();
+	heap.firstLevel = 0;
+	for (int level = 0; level < HEAP_FIRST_LEVELS; level++)
+		heap.secondLevel[level] = 0;
+	for (int bin = 0; bin < HEAP_BINS; bin++)
+		heap.freeHeads[bin] = -1;
+	heap.capacity = capacity;
+	heap.freeUnits = capacity;
+	heap.nodes.push_back({ 0, capacity, -1, -1, -1, -1, false });
+	heap.first = heap.last = 0;
+	heapInsertFree(heap, 0);
+}
+
+// Blocks of 0 to 7 units have a bin each, larger ones go by power of two (first level) and the next three bits (second
+// level). Rounding up gives the first bin whose blocks all fit the size.
+void heapBin(GLuint size, bool roundUp, int& firstLevel, int& secondLevel) {
+	const GLuint secondLevels = 1u << HEAP_SECOND_LEVEL_BITS;
+	if (size < secondLevels) {
+		firstLevel = 0;
+		secondLevel = (int)size;
+		return;
+	}
+	if (roundUp) {
+		GLuint step = (1u << (highestBit(size) - HEAP_SECOND_LEVEL_BITS)) - 1;
+		size = size > UINT_MAX - step ? UINT_MAX : size + step;
+	}
+	int bit = highestBit(size);
+	firstLevel = bit - HEAP_SECOND_LEVEL_BITS + 1;
+	secondLevel = (int)((size >> (bit - HEAP_SECOND_LEVEL_BITS)) & (secondLevels - 1));
+}
+
+int heapNewNode(OffsetHeap& heap) {
+	if (!heap.spare.empty()) {
+		int index = heap.spare.back();
+		heap.spare.pop_back();
+		return index;
+	}
+	heap.nodes.push_back({});
+	return (int)heap.nodes.size() - 1;
+}
+
+void heapInsertFree(OffsetHeap& heap, int index) {
+	HeapNode& node = heap.nodes[index];
+	int firstLevel, secondLevel;
+	heapBin(node.size, false, firstLevel, secondLevel);
+	int bin = firstLevel << HEAP_SECOND_LEVEL_BITS | secondLevel;
+	node.prevFree = -1;
+	node.nextFree = heap.freeHeads[bin];
+	if (node.nextFree >= 0)
+		heap.nodes[node.nextFree].prevFree = index;
+	heap.freeHeads[bin] = index;
+	heap.firstLevel |= 1u << firstLevel;
+	heap.secondLevel[firstLevel] |= 1u << secondLevel;
+}
+
+void heapRemoveFree(OffsetHeap& heap, int index) {
+	HeapNode& node = heap.nodes[index];
+	if (node.prevFree >= 0)
+		heap.nodes[node.prevFree].nextFree = node.nextFree;
+	if (node.nextFree >= 0)
+		heap.nodes[node.nextFree].prevFree = node.prevFree;
+	if (node.prevFree >= 0)
+		return;
+
+	int firstLevel, secondLevel;
+	heapBin(node.size, false, firstLevel, secondLevel);
+	int bin = firstLevel << HEAP_SECOND_LEVEL_BITS | secondLevel;
+	heap.freeHeads[bin] = node.nextFree;
+	if (node.nextFree < 0) {
+		heap.secondLevel[firstLevel] &= ~(1u << secondLevel);
+		if (!heap.secondLevel[firstLevel])
+			heap.firstLevel &= ~(1u << firstLevel);
+	}
+}
+
+// Good fit in constant time: the first non-empty bin at or above the rounded up size, found with two bit scans. Only when
+// that misses, the bin of the size itself is searched for a block that fits, so a heap with a large enough block never fails.
+int heapAllocate(OffsetHeap& heap, GLuint size) {
+	size = std::max(size, 1u);
+	int firstLevel, secondLevel;
+	heapBin(size, true, firstLevel, secondLevel);
+	unsigned int mask = firstLevel < HEAP_FIRST_LEVELS ? heap.secondLevel[firstLevel] & (~0u << secondLevel) : 0;
+	if (!mask) {
+		unsigned int levels = firstLevel + 1 < HEAP_FIRST_LEVELS ? heap.firstLevel & (~0u << (firstLevel + 1)) : 0;
+		if (levels) {
+			firstLevel = lowestBit(levels);
+			mask = heap.secondLevel[firstLevel];
+		}
+	}
+
+	int index;
+	if (mask)
+		index = heap.freeHeads[firstLevel << HEAP_SECOND_LEVEL_BITS | lowestBit(mask)];
+	else {
+		heapBin(size, false, firstLevel, secondLevel);
+		index = heap.freeHeads[firstLevel << HEAP_SECOND_LEVEL_BITS | secondLevel];
+		while (index >= 0 && heap.nodes[index].size < size)
+			index = heap.nodes[index].nextFree;
+		if (index < 0)
+			return -1;
+	}
+	heapRemoveFree(heap, index);
+	if (heap.nodes[index].size > size) {
+		int rest = heapNewNode(heap);
+		HeapNode& node = heap.nodes[index];
+		heap.nodes[rest] = { node.offset + size, node.size - size, index, node.nextPhysical, -1, -1, false };
+		if (node.nextPhysical >= 0)
+			heap.nodes[node.nextPhysical].prevPhysical = rest;
+		else
+			heap.last = rest;
+		node.nextPhysical = rest;
+		node.size = size;
+		heapInsertFree(heap, rest);
+	}
+	heap.nodes[index].used = true;
+	heap.freeUnits -= size;
+	return index;
+}
 
-GLfloat objectPyramidVertices[] =
-{ //     COORDINATES     /        COLORS          /    TexCoord   /        NORMALS       //
-	-0.5f, 0.0f,  0.5f,     0.83f, 0.70f, 0.44f, 	 0.0f, 0.0f,      0.0f, -1.0f, 0.0f, // Bottom side
-	-0.5f, 0.0f, -0.5f,     0.83f, 0.70f, 0.44f,	 0.0f, 5.0f,      0.0f, -1.0f, 0.0f, // Bottom side
-	 0.5f, 0.0f, -0.5f,     0.83f, 0.70f, 0.44f,	 5.0f, 5.0f,      0.0f, -1.0f, 0.0f, // Bottom side
-	 0.5f, 0.0f,  0.5f,     0.83f, 0.70f, 0.44f,	 5.0f, 0.0f,      0.0f, -1.0f, 0.0f, // Bottom side
+// Merges the block with free neighbours, so no two free blocks are ever adjacent.
+void heapFree(OffsetHeap& heap, int index) {
+	if (index < 0 || !heap.nodes[index].used)
+		return;
+	HeapNode& node = heap.nodes[index];
+	node.used = false;
+	heap.freeUnits += node.size;
 
-	-0.5f, 0.0f,  0.5f,     0.83f, 0.70f, 0.44f, 	 0.0f, 0.0f,     -0.8f, 0.5f,  0.0f, // Left Side
-	-0.5f, 0.0f, -0.5f,     0.83f, 0.70f, 0.44f,	 5.0f, 0.0f,     -0.8f, 0.5f,  0.0f, // Left Side
-	 0.0f, 0.8f,  0.0f,     0.92f, 0.86f, 0.76f,	 2.5f, 5.0f,     -0.8f, 0.5f,  0.0f, // Left Side
+	int prev = node.prevPhysical;
+	if (prev >= 0 && !heap.nodes[prev].used) {
+		heapRemoveFree(heap, prev);
+		node.offset = heap.nodes[prev].offset;
+		node.size += heap.nodes[prev].size;
+		node.prevPhysical = heap.nodes[prev].prevPhysical;
+		if (node.prevPhysical >= 0)
+			heap.nodes[node.prevPhysical].nextPhysical = index;
+		else
+			heap.first = index;
+		heap.spare.push_back(prev);
+	}
+	int next = node.nextPhysical;
+	if (next >= 0 && !heap.nodes[next].used) {
+		heapRemoveFree(heap, next);
+		node.size += heap.nodes[next].size;
+		node.nextPhysical = heap.nodes[next].nextPhysical;
+		if (node.nextPhysical >= 0)
+			heap.nodes[node.nextPhysical].prevPhysical = index;
+		else
+			heap.last = index;
+		heap.spare.push_back(next);
+	}
+	heapInsertFree(heap, index);
+}
 
-	-0.5f, 0.0f, -0.5f,     0.83f, 0.70f, 0.44f,	 5.0f, 0.0f,      0.0f, 0.5f, -0.8f, // Non-facing side
-	 0.5f, 0.0f, -0.5f,     0.83f, 0.70f, 0.44f,	 0.0f, 0.0f,      0.0f, 0.5f, -0.8f, // Non-facing side
-	 0.0f, 0.8f,  0.0f,     0.92f, 0.86f, 0.76f,	 2.5f, 5.0f,      0.0f, 0.5f, -0.8f, // Non-facing side
+void heapGrow(OffsetHeap& heap, GLuint capacity) {
+	GLuint extra = capacity - heap.capacity;
+	if (heap.last >= 0 && !heap.nodes[heap.last].used) {
+		heapRemoveFree(heap, heap.last);
+		heap.nodes[heap.last].size += extra;
+		heapInsertFree(heap, heap.last);
+	}
+	else {
+		int tail = heapNewNode(heap);
+		heap.nodes[tail] = { heap.capacity, extra, heap.last, -1, -1, -1, false };
+		if (heap.last >= 0)
+			heap.nodes[heap.last].nextPhysical = tail;
+		else
+			heap.first = tail;
+		heap.last = tail;
+		heapInsertFree(heap, tail);
+	}
+	heap.capacity = capacity;
+	heap.freeUnits += extra;
+}
 
-	 0.5f, 0.0f, -0.5f,     0.83f, 0.70f, 0.44f,	 0.0f, 0.0f,      0.8f, 0.5f,  0.0f, // Right side
-	 0.5f, 0.0f,  0.5f,     0.83f, 0.70f, 0.44f,	 5.0f, 0.0f,      0.8f, 0.5f,  0.0f, // Right side
-	 0.0f, 0.8f,  0.0f,     0.92f, 0.86f, 0.76f,	 2.5f, 5.0f,      0.8f, 0.5f,  0.0f, // Right side
+// Slides every live block to the front, leaving the free space in one block at the end. Node indices stay valid as handles.
+// moves lists every live range with its old and new offset, ranges contiguous in both merged into one.
+void heapCompact(OffsetHeap& heap, std::vector<HeapMove>& moves) {
+	moves.clear();
+	GLuint offset = 0;
+	int previous = -1;
+	for (int index = heap.first; index >= 0;) {
+		int next = heap.nodes[index].nextPhysical;
+		HeapNode& node = heap.nodes[index];
+		if (!node.used) {
+			heapRemoveFree(heap, index);
+			heap.spare.push_back(index);
+		}
+		else {
+			if (!moves.empty() && moves.back().from + moves.back().size == node.offset && 
+				moves.back().to + moves.back().size == offset)
+				moves.back().size += node.size;
+			else
+				moves.push_back({ node.offset, offset, node.size });
+			node.offset = offset;
+			offset += node.size;
+			node.prevPhysical = previous;
+			if (previous >= 0)
+				heap.nodes[previous].nextPhysical = index;
+			else
+				heap.first = index;
+			previous = index;
+		}
+		index = next;
+	}
 
-	 0.5f, 0.0f,  0.5f,     0.83f, 0.70f, 0.44f,	 5.0f, 0.0f,      0.0f, 0.5f,  0.8f, // Facing side
-	-0.5f, 0.0f,  0.5f,     0.83f, 0.70f, 0.44f, 	 0.0f, 0.0f,      0.0f, 0.5f,  0.8f, // Facing side
-	 0.0f, 0.8f,  0.0f,     0.92f, 0.86f, 0.76f,	 2.5f, 5.0f,      0.0f, 0.5f,  0.8f  // Facing side
-};
+	heap.last = previous;
+	if (previous >= 0)
+		heap.nodes[previous].nextPhysical = -1;
+	else
+		heap.first = -1;
+	if (offset < heap.capacity) {
+		int tail = heapNewNode(heap);
+		heap.nodes[tail] = { offset, heap.capacity - offset, previous, -1, -1, -1, false };
+		if (previous >= 0)
+			heap.nodes[previous].nextPhysical = tail;
+		else
+			heap.first = tail;
+		heap.last = tail;
+		heapInsertFree(heap, tail);
+	}
+}
 
-// Indices for vertices order
-GLuint objectPyramidIndices[] =
-{
-	0, 1, 2, // Bottom side
-	0, 2, 3, // Bottom side
-	4, 6, 5, // Left side
-	7, 9, 8, // Non-facing side
-	10, 12, 11, // Right side
-	13, 15, 14 // Facing side
-};
+// Compacts the heap and grows it until one free block holds size units. False when that needs more than UINT_MAX units.
+bool heapMakeRoom(OffsetHeap& heap, GLuint size, std::vector<HeapMove>& moves) {
+	heapCompact(heap, moves);
+	if (heapLargestFree(heap) >= size)
+		return true;
+	unsigned long long capacity = std::max((unsigned long long)heap.capacity * 2, (unsigned long long)heap.capacity + size);
+	if ((unsigned long long)heap.capacity + size - heap.freeUnits > UINT_MAX)
+		return false;
+	heapGrow(heap, (GLuint)std::min(capacity, (unsigned long long)UINT_MAX));
+	return heapLargestFree(heap) >= size;
+}
 
-GLfloat objectLightVertices[] = {
-	//     COORDINATES        
-	-0.1f, -0.1f,  0.1f,      
-	-0.1f, -0.1f, -0.1f,      
-	 0.1f, -0.1f, -0.1f,      
-	 0.1f, -0.1f,  0.1f,      
-	-0.1f,  0.1f,  0.1f,      
-	-0.1f,  0.1f, -0.1f,     
-	 0.1f,  0.1f, -0.1f,    
-	 0.1f,  0.1f,  0.1f
-};
+// Every block of the highest non-empty bin is at least as large as any block below it.
+GLuint heapLargestFree(const OffsetHeap& heap) {
+	if (!heap.firstLevel)
+		return 0;
+	int firstLevel = highestBit(heap.firstLevel);
+	int secondLevel = highestBit(heap.secondLevel[firstLevel]);
+	GLuint largest = 0;
+	for (int index = heap.freeHeads[firstLevel << HEAP_SECOND_LEVEL_BITS | secondLevel]; index >= 0; 
+		index = heap.nodes[index].nextFree)
+		largest = std::max(largest, heap.nodes[index].size);
+	return largest;
+}
 
-GLuint objectLightIndices[] =
-{
-	0, 1, 2,
-	0, 2, 3,
-	0, 4, 7,
-	0, 7, 3,
-	3, 7, 6,
-	3, 6, 2,
-	2, 6, 5,
-	2, 5, 1,
-	1, 5, 4,
-	1, 4, 0,
-	4, 5, 6,
-	4, 6, 7
-};
+void geometryInit(Geometry& geometry) {
+	heapInit(geometry.indexHeap, GEOMETRY_INDICES);
+	glGenBuffers(1, &geometry.indexBuffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, geometry.indexBuffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)GEOMETRY_INDICES * sizeof(GLuint), NULL, GL_STATIC_DRAW);
+	CHECK_GL_ERRORS();
+}
 
-int main() {
-	const char* screenTitle = "Float Arts";
-	int viewPortX1 = 0, viewPortY1 = 0, viewPortX2 = SCREEN_WIDTH, viewPortY2 = SCREEN_HEIGHT;
+void geometryTerminate(Geometry& geometry) {
+	for (GeometryPool& pool : geometry.pools) {
+		if (glState.vertexArray == pool.vertexArray)
+			glState.vertexArray = 0; // Deleting unbinds it.
+		glDeleteVertexArrays(1, &pool.vertexArray);
+		glDeleteBuffers(1, &pool.buffer);
+	}
+	glDeleteBuffers(1, &geometry.indexBuffer);
+	geometry.pools.clear();
+	geometry.meshes.clear();
+}
 
-	if (!glfwInit()) {
-		errorLog("PVE", "INIT", "can't initilize glfw.", "");
-		return -1;
+// Copies the mesh into the buffers of its vertex format, which get a pool the first time the format shows up.
+int geometryAdd(Geometry& geometry, const ObjectData& object) {
+	TraceZone trace("geometryAdd");
+	const VertexLayout& layout = object.layout;
+	int pool = 0;
+	while (pool < (int)geometry.pools.size() && !(geometry.pools[pool].layout.stride == layout.stride && 
+		geometry.pools[pool].layout.attributeCount == layout.attributeCount && memcmp(geometry.pools[pool].layout.attributes, 
+		layout.attributes, layout.attributeCount * sizeof(VertexAttribute)) == 0))
+		pool++;
+	if (pool == (int)geometry.pools.size()) {
+		geometry.pools.push_back({});
+		GeometryPool& created = geometry.pools.back();
+		created.layout = layout;
+		heapInit(created.heap, GEOMETRY_VERTICES);
+		glGenVertexArrays(1, &created.vertexArray);
+		glGenBuffers(1, &created.buffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, created.buffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)GEOMETRY_VERTICES * layout.stride, NULL, GL_STATIC_DRAW);
+		geometryBindPool(geometry, created);
 	}
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
-	GLFWwindow* window = glfwCreateWindow(SCREEN_WIDTH, SCREEN_HEIGHT, screenTitle, NULL, NULL);
-	if (window == NULL) {
-		errorLog("PVE", "INIT", "can't create window.", "");
-		glfwTerminate();
+	GpuMesh mesh;
+	mesh.pool = pool;
+	mesh.indexCount = (GLsizei)(object.indicesSize / sizeof(GLuint));
+	mesh.vertices = geometryAllocate(geometry, pool, (GLuint)(object.verticesSize / layout.stride));
+	mesh.indices = geometryAllocate(geometry, -1, (GLuint)mesh.indexCount);
+	if (mesh.vertices < 0 || mesh.indices < 0) {
+		heapFree(geometry.pools[pool].heap, mesh.vertices);
+		heapFree(geometry.indexHeap, mesh.indices);
+		errorLog("AVE", "LOAD", "mesh doesn't fit in the geometry buffers.\n", "");
 		return -1;
 	}
-	glfwMakeContextCurrent(window);
 
-	gladLoadGL();
-	glViewport(viewPortX1, viewPortY1, viewPortX2, viewPortY2);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, geometry.pools[pool].buffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)geometry.pools[pool].heap.nodes[mesh.vertices].offset * layout.stride, 
+		object.verticesSize, object.vertices);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, geometry.indexBuffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)geometry.indexHeap.nodes[mesh.indices].offset * sizeof(GLuint), 
+		object.indicesSize, object.indices);
+	CHECK_GL_ERRORS();
 
-	// Shader program and Bindings
-	GLuint program = programInit(vertexShaderCode, fragmentShaderCode);
-	GLuint VAO, VBO, EBO;
-	//ObjectData floatArtsCube = { objectCubeVerticesFull, sizeof(objectCubeVerticesFull), objectCubeIndices, sizeof(objectCubeIndices) };
-	ObjectData pyramid = { objectPyramidVertices, sizeof(objectPyramidVertices), objectPyramidIndices, sizeof(objectPyramidIndices) };
-	//std::tie(VAO, VBO, EBO) = createObject(floatArtsCube, 3, 11);
-	std::tie(VAO, VBO, EBO) = createObject(pyramid, 3, 11);
-	checkOpenGLError();
-
-	GLuint lightShader = programInit(vertexShaderLightCode, fragmentShaderLightCode);
-	GLuint LVAO, LVBO, LEBO;
-	ObjectData lightCube = { objectLightVertices, sizeof(objectLightVertices), objectLightIndices, sizeof(objectCubeIndices) };
-	std::tie(LVAO, LVBO, LEBO) = createObject(lightCube, 0, 3);
-	checkOpenGLError();
-
-	// Uniforms
-	GLuint uniformTexture0 = glGetUniformLocation(program, "tex0");
-	GLuint uniformCamMatrix = glGetUniformLocation(program, "camMatrix");
-
-	GLuint uniformLightColor_L = glGetUniformLocation(lightShader, "lightColor");
-	GLuint uniformCamMatrix_L = glGetUniformLocation(lightShader, "camMatrix");
-	GLuint uniformModel_L = glGetUniformLocation(lightShader, "model");
+	geometry.meshes.push_back(mesh);
+	return (int)geometry.meshes.size() - 1;
+}
 
-	// Light
-	lightModel = glm::translate(lightModel, lightPos);
-	cubeModel = glm::translate(cubeModel, cubePos);
+void geometryRemove(Geometry& geometry, int mesh) {
+	GpuMesh& removed = geometry.meshes[mesh];
+	if (removed.pool < 0)
+		return;
+	heapFree(geometry.pools[removed.pool].heap, removed.vertices);
+	heapFree(geometry.indexHeap, removed.indices);
+	removed.pool = -1;
+	removed.indexCount = 0;
+}
+
+// Vertex range of pool, or index range with pool -1. When no free block fits, the heap is compacted into a new buffer, which
+// is also grown if the free space in total isn't enough.
+int geometryAllocate(Geometry& geometry, int pool, GLuint size) {
+	OffsetHeap& heap = pool >= 0 ? geometry.pools[pool].heap : geometry.indexHeap;
+	int node = heapAllocate(heap, size);
+	if (node >= 0)
+		return node;
 
-	glUseProgram(lightShader);
-	glUniformMatrix4fv(uniformModel_L, 1, GL_FALSE, glm::value_ptr(lightModel));
-	glUniform4f(uniformLightColor_L, lightColor.x, lightColor.y, lightColor.z, lightColor.w);
+	TraceZone trace("geometryDefragment");
+	std::vector<HeapMove> moves;
+	GLuint fragmented = heap.freeUnits;
+	bool room = heapMakeRoom(heap, size, moves);
+	if (pool >= 0) {
+		GeometryPool& grown = geometry.pools[pool];
+		grown.buffer = geometryRelocate(grown.buffer, grown.layout.stride, heap.capacity, moves);
+		geometryBindPool(geometry, grown);
+	}
+	else {
+		geometry.indexBuffer = geometryRelocate(geometry.indexBuffer, sizeof(GLuint), heap.capacity, moves);
+		for (GeometryPool& bound : geometry.pools)
+			geometryBindPool(geometry, bound);
+	}
+	std::cout << "GEOMETRY" << " [" << (pool >= 0 ? "vertices" : "indices") << ", free: " << fragmented << ", requested: " 
+		<< size << ", copies: " << moves.size() << ", capacity: " << heap.capacity << "]" << std::endl;
+	return room ? heapAllocate(heap, size) : -1;
+}
 
-	glUseProgram(program);
-	glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, glm::value_ptr(cubeModel));
-	glUniform4f(glGetUniformLocation(program, "lightColor"), lightColor.x, lightColor.y, lightColor.z, lightColor.w);
-	glUniform3f(glGetUniformLocation(program, "lightPos"), lightPos.x, lightPos.y, lightPos.z);
+// New buffer of capacity units with the moved ranges copied in, the old one is deleted.
+GLuint geometryRelocate(GLuint buffer, GLuint unitSize, GLuint capacity, const std::vector<HeapMove>& moves) {
+	GLuint relocated;
+	glGenBuffers(1, &relocated);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, relocated);
+	glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)capacity * unitSize, NULL, GL_STATIC_DRAW);
+	glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+	for (const HeapMove& move : moves)
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (GLintptr)move.from * unitSize, 
+			(GLintptr)move.to * unitSize, (GLsizeiptr)move.size * unitSize);
+	glDeleteBuffers(1, &buffer);
+	CHECK_GL_ERRORS();
+	return relocated;
+}
 
-	// Textures
-	int textureFA_Height, textureFA_Width, textureFA_Col;
-	stbi_set_flip_vertically_on_load(1);
-	unsigned char* lastLoadedTexture = stbi_load("matin_on_the_code.png", &textureFA_Width, &textureFA_Height, &textureFA_Col, 0);
-	if (!lastLoadedTexture) {
-		errorLog("AVE", "LOAD", "can't load (FloatArts.png) texture.", "");
-		glfwTerminate();
-		return -1;
+// Points the attributes of the pool at its vertex buffer and the shared index buffer. Instance attributes set up on the same
+// vertex array are left alone.
+void geometryBindPool(Geometry& geometry, GeometryPool& pool) {
+	stateBindVertexArray(glState, pool.vertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, pool.buffer);
+	for (GLuint i = 0; i < pool.layout.attributeCount; i++) {
+		const VertexAttribute& attribute = pool.layout.attributes[i];
+		glVertexAttribPointer(attribute.location, attribute.components, attribute.type, (GLboolean)attribute.normalized, 
+			pool.layout.stride, (void*)(size_t)attribute.offset);
+		glEnableVertexAttribArray(attribute.location);
 	}
-	glGenTextures(1, &textureFloatArts);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, textureFloatArts);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); // GL_NEAREST, GL_LINEAR
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT); // S R T : X Y Z
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, textureFA_Width, textureFA_Height, 0, GL_RGBA, GL_UNSIGNED_BYTE, lastLoadedTexture);
-	glGenerateMipmap(GL_TEXTURE_2D);
-	stbi_image_free(lastLoadedTexture);
-	glBindTexture(GL_TEXTURE_2D, 0);
-
-	glUseProgram(program);
-	glUniform1i(uniformTexture0, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.indexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	stateBindVertexArray(glState, 0);
+	CHECK_GL_ERRORS();
+}
 
-	glfwSwapInterval(1);
-	glEnable(GL_DEPTH_TEST);
-	while (!glfwWindowShouldClose(window)) {
-		display(window, program, lightShader, VAO, LVAO, glfwGetTime(), uniformCamMatrix);
-		checkOpenGLError();
+GLuint geometryVertexArray(const Geometry& geometry, int mesh) {
+	return geometry.pools[geometry.meshes[mesh].pool].vertexArray;
+}
+
+// Random allocations fill the heap, a random half is freed and refilled, then the heap is compacted. The physical list and
+// the free lists are checked against each other after every phase.
+int heapBenchmark(const AppOptions& options) {
+	int count = std::max(options.heapAllocations, 1);
+	unsigned int seed = 12345;
+	auto random = [&seed]() {
+		seed = seed * 1664525u + 1013904223u;
+		return (seed >> 8) / 16777216.0f;
+	};
+	auto randomSize = [&random]() { 
+		float r = random();
+		return 1 + (GLuint)(r * r * r * 4096.0f); // Mostly small meshes, a few large ones.
+	};
+	auto now = []() { return std::chrono::steady_clock::now(); };
+	auto nanoseconds = [&now](std::chrono::steady_clock::time_point start, int operations) { 
+		return std::chrono::duration<double, std::nano>(now() - start).count() / std::max(operations, 1);
+	};
+	auto fragmentation = [](const OffsetHeap& heap) { 
+		return heap.freeUnits ? 1.0 - (double)heapLargestFree(heap) / heap.freeUnits : 0.0;
+	};
+	int errors = 0;
+	auto check = [&errors](const OffsetHeap& heap) {
+		GLuint offset = 0, freeUnits = 0;
+		int freeNodes = 0, listed = 0;
+		bool previousFree = false;
+		for (int index = heap.first; index >= 0; index = heap.nodes[index].nextPhysical) {
+			const HeapNode& node = heap.nodes[index];
+			errors += node.offset != offset || (!node.used && previousFree);
+			offset += node.size;
+			if (!node.used) {
+				freeUnits += node.size;
+				freeNodes++;
+			}
+			previousFree = !node.used;
+		}
+		for (int bin = 0; bin < HEAP_BINS; bin++)
+			for (int index = heap.freeHeads[bin]; index >= 0; index = heap.nodes[index].nextFree)
+				listed++;
+		errors += offset != heap.capacity || freeUnits != heap.freeUnits || freeNodes != listed;
+	};
+
+	std::vector<GLuint> sizes(count);
+	unsigned long long total = 0;
+	for (GLuint& size : sizes) {
+		size = randomSize();
+		total += size;
 	}
+	// Good fit rounds requests up to the next bin, a heap of exactly the total size can't take every block.
+	OffsetHeap heap;
+	heapInit(heap, (GLuint)std::min(total + total / 8, (unsigned long long)UINT_MAX));
 
-	terminateObject(VAO, VBO, EBO);
-	terminateProgram(program);
-	terminateProgram(lightShader);
-	terminateObject(LVAO, LVBO, LEBO);
+	std::vector<int> live(count);
+	std::chrono::steady_clock::time_point start = now();
+	for (int i = 0; i < count; i++)
+		live[i] = heapAllocate(heap, sizes[i]);
+	double allocateTime = nanoseconds(start, count);
+	check(heap);
+	int failed = 0;
+	for (int i = 0; i < count; i++) {
+		failed += live[i] < 0;
+		total -= live[i] < 0 ? sizes[i] : 0;
+	}
+	errors += heap.freeUnits != heap.capacity - total;
 
-	glDeleteTextures(1, &textureFloatArts);
-	glfwDestroyWindow(window);
-	glfwTerminate();
-	return 0;
+	for (int i = count - 1; i > 0; i--)
+		std::swap(live[i], live[(int)(random() * (i + 1)) % (i + 1)]);
+	int freed = count / 2;
+	start = now();
+	for (int i = 0; i < freed; i++)
+		heapFree(heap, live[i]);
+	double freeTime = nanoseconds(start, freed);
+	live.erase(live.begin(), live.begin() + freed);
+	check(heap);
+	double fragmented = fragmentation(heap);
+
+	int failedRefills = 0;
+	start = now();
+	for (int i = 0; i < freed; i++) {
+		int node = heapAllocate(heap, randomSize());
+		if (node >= 0)
+			live.push_back(node);
+		else
+			failedRefills++;
+	}
+	double refillTime = nanoseconds(start, freed);
+	check(heap);
+
+	std::vector<HeapMove> moves;
+	start = now();
+	heapCompact(heap, moves);
+	double compactTime = std::chrono::duration<double, std::milli>(now() - start).count();
+	check(heap);
+
+	// Growing for a request whose rounded up bin is above the grown free block: 60 of 64 units used and 97 requested leaves
+	// a block of 101, and an empty 64k heap asked for 1,100,000. Both have to fit after heapMakeRoom().
+	const GLuint growCases[][3] = { { 64, 60, 97 }, { 65536, 0, 1100000 } };
+	int failedGrows = 0;
+	for (const GLuint* growCase : growCases) {
+		OffsetHeap grown;
+		heapInit(grown, growCase[0]);
+		if (growCase[1])
+			heapAllocate(grown, growCase[1]);
+		std::vector<HeapMove> growMoves;
+		failedGrows += heapAllocate(grown, growCase[2]) >= 0 || !heapMakeRoom(grown, growCase[2], growMoves) || 
+			heapAllocate(grown, growCase[2]) < 0;
+		check(grown);
+	}
+	errors += failedGrows;
+
+	std::cout << "HEAP" << " [allocations: " << count << ", units: " << heap.capacity << ", ns/allocate: " << allocateTime 
+		<< ", failed: " << failed << ", ns/free: " << freeTime << ", ns/refill: " << refillTime << ", failed refills: " 
+		<< failedRefills << ", fragmentation: " 
+		<< fragmented << ", compact ms: " << compactTime << ", copies: " << moves.size() << ", fragmentation after: " 
+		<< fragmentation(heap) << ", failed grows: " << failedGrows << ", errors: " << errors << "]" << std::endl;
+	return errors ? -1 : 0;
 }
 
 //******************************************************************************************************************************
-void display(GLFWwindow* window, GLuint program, GLuint lightShader, GLuint VAO, GLuint LVAO, double currentTime, 
-	GLuint uniformCamMatrix) {
-	glClearColor(screenColor[0], screenColor[1], screenColor[2], screenColor[3]);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+// Stream Buffer
+void streamBufferInit(StreamBuffer& ring, size_t size, bool allowPersistent) {
+	bool core = GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 4);
+	if (allowPersistent && (core || glExtensionSupported("GL_ARB_buffer_storage")))
+		ring.bufferStorage = (PFNGLBUFFERSTORAGEPROC)glProcAddress("glBufferStorage");
+	ring.persistent = ring.bufferStorage != NULL;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &ring.uniformAlignment);
+	streamCreateStorage(ring, size);
+	glGenVertexArrays(1, &ring.vertexArray);
+	ring.enabledAttributes = 0;
+	std::cout << "STREAM" << " [mode: " << (ring.persistent ? "persistent" : "orphaning") << ", bytes: " << ring.size 
+		<< ", uniform alignment: " << ring.uniformAlignment << "]" << std::endl;
+}
 
-	inputs(window);
-	// Camera
-	glm::mat4 view = glm::mat4(1.0f);
-	glm::mat4 proj = glm::mat4(1.0f);
-	view = glm::lookAt(camPos, camPos + orientation, up);
-	proj = glm::perspective(FOV, (float)SCREEN_WIDTH / SCREEN_HEIGHT, NEAR_PLANE, FAR_PLANE);
+void streamBufferTerminate(StreamBuffer& ring) {
+	for (StreamRegion& region : ring.regions)
+		glDeleteSync(region.fence);
+	ring.regions.clear();
+	if (!ring.retired.empty())
+		glDeleteBuffers((GLsizei)ring.retired.size(), ring.retired.data());
+	ring.retired.clear();
+	glDeleteBuffers(1, &ring.buffer); // Unmaps a persistent buffer.
+	ring.buffer = 0;
+	glDeleteVertexArrays(1, &ring.vertexArray);
+	ring.vertexArray = 0;
+}
 
-	glUseProgram(program);
-	glUniform3f(glGetUniformLocation(program, "cam_pos"), camPos.x, camPos.y, camPos.z);
-	glUniformMatrix4fv(uniformCamMatrix, 1, GL_FALSE, glm::value_ptr(proj * view));
+// Fresh buffer of size bytes. The old one is retired rather than deleted, the current frame may still have ranges of it
+// bound, and its fences don't say anything about the new one.
+void streamCreateStorage(StreamBuffer& ring, size_t size) {
+	if (ring.buffer)
+		ring.retired.push_back(ring.buffer);
+	for (StreamRegion& region : ring.regions)
+		glDeleteSync(region.fence);
+	ring.regions.clear();
 
-	//***********************************************************************************
-	model = glm::rotate(model, glm::radians(rotation), glm::vec3(0.0f, 1.0f, 0.0f));
-	lModel = glm::rotate(lModel, glm::radians(rotation), glm::vec3(0.0f, 1.0f, 0.0f));
-	//rotation = rotatingSpeed; // static rotation
+	glGenBuffers(1, &ring.buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+	if (ring.persistent) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		ring.bufferStorage(GL_COPY_WRITE_BUFFER, size, NULL, flags);
+		ring.mapped = (unsigned char*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, flags);
+	}
+	else
+		glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, GL_STREAM_DRAW);
+	ring.size = size;
+	ring.head = 0;
+	ring.frameBegin = 0;
+}
 
-	//double crntTime = glfwGetTime();
-	//if (crntTime - lastTime >= 1 / 60) { 
-	//	if (rotation <= 10400)
-	//		rotation += rotatingSpeed;
-	//	lastTime = crntTime;
-	//}
+// GL thread, before the first write of a frame.
+void streamFrameBegin(StreamBuffer& ring) {
+	if (!ring.retired.empty()) {
+		glDeleteBuffers((GLsizei)ring.retired.size(), ring.retired.data());
+		ring.retired.clear();
+	}
+	while (!ring.regions.empty() && glClientWaitSync(ring.regions.front().fence, 0, 0) != GL_TIMEOUT_EXPIRED) {
+		glDeleteSync(ring.regions.front().fence);
+		ring.regions.pop_front();
+	}
 
-	cubeModel = glm::translate(model, cubePos);
-	glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, glm::value_ptr(cubeModel));
+	if (ring.lastFrameBytes * STREAM_FRAMES > ring.size) {
+		size_t size = ring.size;
+		while (size < ring.lastFrameBytes * STREAM_FRAMES)
+			size *= 2;
+		streamCreateStorage(ring, size);
+	}
+	else if (!ring.persistent && ring.head + ring.lastFrameBytes > ring.size) {
+		// The driver hands out new storage and frees the old one once the GPU is done with it, none of the fences matter.
+		DRIVER_CALL(glBindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer));
+		DRIVER_CALL(glBufferData(GL_COPY_WRITE_BUFFER, ring.size, NULL, GL_STREAM_DRAW));
+		for (StreamRegion& region : ring.regions)
+			glDeleteSync(region.fence);
+		ring.regions.clear();
+		ring.head = 0;
+	}
+	ring.frameBegin = ring.head;
+	ring.frameBytes = 0;
+}
 
-	lightModel = glm::translate(lModel, lightPos);
-	glUseProgram(lightShader);
-	glUniformMatrix4fv(glGetUniformLocation(lightShader, "model"), 1, GL_FALSE, glm::value_ptr(lightModel));
-	glUseProgram(program); // Back to main program.
-	//***********************************************************************************
+// GL thread, after the last command that reads the data of the frame.
+void streamFrameEnd(StreamBuffer& ring) {
+	if (ring.frameBytes > 0)
+		ring.regions.push_back({ ring.frameBegin, ring.head, DRIVER_CALL(glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0)) });
+	ring.lastFrameBytes = ring.frameBytes;
+}
 
-	glBindTexture(GL_TEXTURE_2D, textureFloatArts);
-	glBindVertexArray(VAO);
-	glDrawElements(GL_TRIANGLES, sizeof(objectPyramidIndices) / sizeof(int), GL_UNSIGNED_INT, 0);
+// Copies size bytes into the ring and returns their offset in ring.buffer, valid until the frame ends.
+GLintptr streamWrite(StreamBuffer& ring, const void* data, size_t size, size_t alignment) {
+	size_t offset = (ring.head + alignment - 1) / alignment * alignment;
+	if (offset + size > ring.size)
+		offset = 0;
+	if (size > ring.size || (ring.frameBytes > 0 && streamOverlaps(ring.frameBegin, ring.head, offset, size))) {
+		// The frame alone fills the ring.
+		size_t grown = ring.size * 2;
+		while (grown < size * STREAM_FRAMES)
+			grown *= 2;
+		streamCreateStorage(ring, grown);
+		ring.frameBegin = 0;
+		offset = 0;
+	}
+	streamWait(ring, offset, size);
+	ring.frameBytes += offset >= ring.head ? offset + size - ring.head : ring.size - ring.head + offset + size;
+	ring.head = offset + size;
 
-	glUseProgram(lightShader);
-	glUniformMatrix4fv(glGetUniformLocation(lightShader, "camMatrix"), 1, GL_FALSE, glm::value_ptr(proj * view));
-	glBindVertexArray(LVAO);
-	glDrawElements(GL_TRIANGLES, sizeof(objectPyramidIndices) / sizeof(int), GL_UNSIGNED_INT, 0);
+	if (ring.persistent)
+		memcpy(ring.mapped + offset, data, size);
+	else {
+		// Fences or orphaning keep the range free of GPU reads, the driver doesn't have to check.
+		DRIVER_CALL(glBindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer));
+		void* memory = DRIVER_CALL(glMapBufferRange(GL_COPY_WRITE_BUFFER, offset, size, 
+			GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT));
+		memcpy(memory, data, size);
+		DRIVER_CALL(glUnmapBuffer(GL_COPY_WRITE_BUFFER));
+	}
+	return (GLintptr)offset;
+}
 
-	glfwSwapBuffers(window);
-	glfwPollEvents();
+// Points the attributes of layout and the index source at the ring buffer. Offsets are left to the base vertex and the index
+// pointer of the draw, so one vertex array serves every streamed draw of a layout.
+void streamBindVertices(StreamBuffer& ring, GLStateCache& cache, const VertexLayout& layout) {
+	stateBindVertexArray(cache, ring.vertexArray);
+	DRIVER_CALL(glBindBuffer(GL_ARRAY_BUFFER, ring.buffer));
+	GLuint enabled = 0;
+	for (GLuint i = 0; i < layout.attributeCount; i++) {
+		const VertexAttribute& attribute = layout.attributes[i];
+		DRIVER_CALL(glVertexAttribPointer(attribute.location, attribute.components, attribute.type, 
+			(GLboolean)attribute.normalized, layout.stride, (void*)(size_t)attribute.offset));
+		enabled |= 1u << attribute.location;
+	}
+	for (GLuint location = 0; location < 32; location++)
+		if ((enabled ^ ring.enabledAttributes) & (1u << location)) {
+			if (enabled & (1u << location))
+				DRIVER_CALL(glEnableVertexAttribArray(location));
+			else
+				DRIVER_CALL(glDisableVertexAttribArray(location));
+		}
+	ring.enabledAttributes = enabled;
+	DRIVER_CALL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ring.buffer));
+	DRIVER_CALL(glBindBuffer(GL_ARRAY_BUFFER, 0));
 }
 
-GLuint programInit(const char* vertexShaderCode, const char* fragmentShaderCode) {
-	GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER),
-		fragmentShader = glCreateShader(GL_FRAGMENT_SHADER),
-		shaderProgram = glCreateProgram();
+// Whether [offset, offset + size) touches the region from begin to end, which wraps around when end < begin.
+bool streamOverlaps(size_t begin, size_t end, size_t offset, size_t size) {
+	if (begin <= end)
+		return offset < end && begin < offset + size;
+	return offset < end || begin < offset + size;
+}
 
-	glShaderSource(vertexShader, 1, &vertexShaderCode, NULL);
-	glCompileShader(vertexShader);
-	checkShaderCompileErrors(vertexShader);
+// Fences signal in order, so waiting for the newest region in the way frees all older ones too.
+void streamWait(StreamBuffer& ring, size_t offset, size_t size) {
+	int last = -1;
+	for (int i = 0; i < (int)ring.regions.size(); i++)
+		if (streamOverlaps(ring.regions[i].begin, ring.regions[i].end, offset, size))
+			last = i;
+	if (last < 0)
+		return;
 
-	glShaderSource(fragmentShader, 1, &fragmentShaderCode, NULL);
-	glCompileShader(fragmentShader);
-	checkShaderCompileErrors(fragmentShader);
+	GLsync fence = ring.regions[last].fence;
+	if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+		TraceZone trace("streamWait");
+		frameStats.streamStalls++;
+		while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+			;
+	}
+	for (int i = 0; i <= last; i++)
+		glDeleteSync(ring.regions[i].fence);
+	ring.regions.erase(ring.regions.begin(), ring.regions.begin() + last + 1);
+}
 
-	glAttachShader(shaderProgram, vertexShader);
-	glAttachShader(shaderProgram, fragmentShader);
-	glLinkProgram(shaderProgram);
-	checkProgramLinkErrors(shaderProgram);
+//******************************************************************************************************************************
+// Command Buffer
+void commandsReset(CommandBuffer& commands) {
+	commands.used = 0;
+	commands.started = std::chrono::steady_clock::now();
+	commands.culledObjects = 0;
+	commands.occludedObjects = 0;
+}
 
-	glDeleteShader(vertexShader);
-	glDeleteShader(fragmentShader);
+// Appends the command and size bytes of data after it. Commands are copied in and out with memcpy, so they don't need to be
+// aligned in the buffer.
+template <typename T>
+void recordCommand(CommandBuffer& commands, CommandType type, const T& command, const void* data, size_t size) {
+	static_assert(std::is_trivially_copyable<T>::value, "commands are copied with memcpy");
+	CommandHeader header = { type, (unsigned int)(sizeof(CommandHeader) + sizeof(T) + size) };
+	if (commands.used + header.size > commands.memory.size())
+		commands.memory.resize(std::max(commands.memory.size() * 2, commands.used + header.size));
+	unsigned char* memory = commands.memory.data() + commands.used;
+	memcpy(memory, &header, sizeof(CommandHeader));
+	memcpy(memory + sizeof(CommandHeader), &command, sizeof(T));
+	if (size)
+		memcpy(memory + sizeof(CommandHeader) + sizeof(T), data, size);
+	commands.used += header.size;
+}
 
-	return shaderProgram;
+void recordBufferUpdate(CommandBuffer& commands, GLuint buffer, const void* data, size_t size) {
+	recordCommand(commands, COMMAND_UPDATE_BUFFER, BufferCommand{ buffer, (GLsizeiptr)size }, data, size);
 }
 
-void terminateProgram(GLuint program) {
-	glDeleteProgram(program);
+void recordConstants(CommandBuffer& commands, GLuint binding, const void* data, size_t size) {
+	recordCommand(commands, COMMAND_BIND_CONSTANTS, ConstantsCommand{ binding, (GLsizeiptr)size }, data, size);
 }
 
-std::tuple<GLuint, GLuint, GLuint> createObject(ObjectData object, int layers, int length) {
-	GLuint VAO, VBO, EBO;
-	glGenVertexArrays(1, &VAO);
-	glGenBuffers(1, &VBO);
-	glGenBuffers(1, &EBO);
+// Geometry that only lives for this frame. It is copied into the stream buffer on replay and drawn from there, no mesh or
+// buffer of its own.
+void recordStreamedDraw(CommandBuffer& commands, const VertexLayout& layout, GLenum mode, const void* vertices, size_t vertexBytes, 
+	const GLuint* indices, GLsizei indexCount) {
+	std::vector<unsigned char> data(vertexBytes + indexCount * sizeof(GLuint));
+	memcpy(data.data(), vertices, vertexBytes);
+	memcpy(data.data() + vertexBytes, indices, indexCount * sizeof(GLuint));
+	recordCommand(commands, COMMAND_DRAW_STREAMED, StreamedDrawCommand{ &layout, mode, (GLsizeiptr)vertexBytes, indexCount }, 
+		data.data(), data.size());
+}
+
+void recordCallback(CommandBuffer& commands, void (*function)(void* data), void* data) {
+	recordCommand(commands, COMMAND_CALLBACK, CallbackCommand{ function, data });
+}
+
+// GL thread. Binds go through the cache, which only the GL thread touches.
+void executeCommands(const CommandBuffer& commands, GLStateCache& cache) {
+	size_t offset = 0;
+	while (offset < commands.used) {
+		const unsigned char* memory = commands.memory.data() + offset;
+		CommandHeader header;
+		memcpy(&header, memory, sizeof(CommandHeader));
+		const unsigned char* payload = memory + sizeof(CommandHeader);
+		switch (header.type) {
+		case COMMAND_CLEAR: {
+			ClearCommand command;
+			memcpy(&command, payload, sizeof(command));
+			DRIVER_CALL(glClearColor(command.color[0], command.color[1], command.color[2], command.color[3]));
+			DRIVER_CALL(glClear(command.mask));
+			break;
+		}
+		case COMMAND_USE_PROGRAM: {
+			ProgramCommand command;
+			memcpy(&command, payload, sizeof(command));
+			stateUseProgram(cache, command.program->id);
+			break;
+		}
+		case COMMAND_BIND_TEXTURE: {
+			TextureCommand command;
+			memcpy(&command, payload, sizeof(command));
+			stateBindTexture(cache, streamedTexture(textureStreamer, command.texture));
+			break;
+		}
+		case COMMAND_BIND_VERTEX_ARRAY: {
+			VertexArrayCommand command;
+			memcpy(&command, payload, sizeof(command));
+			stateBindVertexArray(cache, command.vertexArray);
+			break;
+		}
+		case COMMAND_SET_MODEL: {
+			ModelCommand command;
+			memcpy(&command, payload, sizeof(command));
+			stateSetModel(cache, glm::make_mat4(command.model));
+			break;
+		}
+		case COMMAND_DRAW: {
+			DrawCommand command;
+			memcpy(&command, payload, sizeof(command));
+			const GpuMesh& mesh = geometry.meshes[command.mesh];
+			GLint baseVertex = (GLint)geometry.pools[mesh.pool].heap.nodes[mesh.vertices].offset;
+			const void* firstIndex = (const void*)((size_t)geometry.indexHeap.nodes[mesh.indices].offset * sizeof(GLuint));
+			if (command.instances)
+				DRIVER_CALL(glDrawElementsInstancedBaseVertex(GL_TRIANGLES, mesh.indexCount, GL_UNSIGNED_INT, firstIndex, 
+					command.instances, baseVertex));
+			else
+				DRIVER_CALL(glDrawElementsBaseVertex(GL_TRIANGLES, mesh.indexCount, GL_UNSIGNED_INT, firstIndex, baseVertex));
+			frameStats.drawCalls++;
+			break;
+		}
+		case COMMAND_DRAW_STREAMED: {
+			StreamedDrawCommand command;
+			memcpy(&command, payload, sizeof(command));
+			// One write, so vertices and indices always end up in the same buffer even when the ring grows. Aligned to the
+			// stride the base vertex lands on the first vertex, and strides are whole GLuints so the indices right after the
+			// vertices are aligned too.
+			GLuint stride = command.layout->stride;
+			GLintptr vertexOffset = streamWrite(streamBuffer, payload + sizeof(command), 
+				command.vertexBytes + command.indexCount * sizeof(GLuint), stride);
+			GLintptr indexOffset = vertexOffset + command.vertexBytes;
+			streamBindVertices(streamBuffer, cache, *command.layout);
+			DRIVER_CALL(glDrawElementsBaseVertex(command.mode, command.indexCount, GL_UNSIGNED_INT, (const void*)indexOffset, 
+				(GLint)(vertexOffset / stride)));
+			frameStats.drawCalls++;
+			break;
+		}
+		case COMMAND_UPDATE_BUFFER: {
+			BufferCommand command;
+			memcpy(&command, payload, sizeof(command));
+			if (command.size == 0)
+				break;
+			GLintptr offset = streamWrite(streamBuffer, payload + sizeof(command), command.size, STREAM_VERTEX_ALIGNMENT);
+			DRIVER_CALL(glBindBuffer(GL_COPY_READ_BUFFER, streamBuffer.buffer));
+			DRIVER_CALL(glBindBuffer(GL_COPY_WRITE_BUFFER, command.buffer));
+			DRIVER_CALL(glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, offset, 0, command.size));
+			break;
+		}
+		case COMMAND_BIND_CONSTANTS: {
+			ConstantsCommand command;
+			memcpy(&command, payload, sizeof(command));
+			GLintptr offset = streamWrite(streamBuffer, payload + sizeof(command), command.size, streamBuffer.uniformAlignment);
+			DRIVER_CALL(glBindBufferRange(GL_UNIFORM_BUFFER, command.binding, streamBuffer.buffer, offset, command.size));
+			break;
+		}
+		case COMMAND_PROFILE_BEGIN: {
+			ProfileCommand command;
+			memcpy(&command, payload, sizeof(command));
+			profilerBegin(profiler, command.scope);
+			break;
+		}
+		case COMMAND_PROFILE_END: {
+			ProfileCommand command;
+			memcpy(&command, payload, sizeof(command));
+			profilerEnd(profiler, command.scope);
+			break;
+		}
+		case COMMAND_CALLBACK: {
+			CallbackCommand command;
+			memcpy(&command, payload, sizeof(command));
+			command.function(command.data);
+			break;
+		}
+		case COMMAND_SWAP: {
+			SwapCommand command;
+			memcpy(&command, payload, sizeof(command));
+			DRIVER_CALL(glfwSwapBuffers(command.window));
+			break;
+		}
+		}
+		offset += header.size;
+	}
+}
 
-	glBindVertexArray(VAO);
+// The context moves to the render thread until renderStop().
+void renderStart(Renderer& renderer, GLFWwindow* window) {
+	renderer.window = window;
+	renderer.finished = false;
+	renderer.submitted = -1;
+	glfwMakeContextCurrent(NULL);
+	renderer.thread = std::thread(renderThread, std::ref(renderer));
+	renderer.running = true;
+}
 
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-	glBufferData(GL_ARRAY_BUFFER, object.verticesSize, object.vertices, GL_STATIC_DRAW);
-	checkOpenGLError();
+void renderStop(Renderer& renderer) {
+	if (!renderer.running)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(renderer.mutex);
+		renderer.finished = true;
+	}
+	renderer.changed.notify_all();
+	renderer.thread.join();
+	renderer.running = false;
+	glfwMakeContextCurrent(renderer.window);
+}
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, object.indicesSize, object.indices, GL_STATIC_DRAW);
-	checkOpenGLError();
+void renderThread(Renderer& renderer) {
+	traceThreadName("render");
+	glfwMakeContextCurrent(renderer.window);
+	std::unique_lock<std::mutex> lock(renderer.mutex);
+	while (true) {
+		renderer.changed.wait(lock, [&renderer]() { return renderer.finished || renderer.submitted >= 0; });
+		if (renderer.submitted < 0)
+			break;
 
-	if (layers >= 0) {
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, length * sizeof(float), (void*)0); // vertices
-		glEnableVertexAttribArray(0);
-		checkOpenGLError();
+		CommandBuffer& commands = renderer.buffers[renderer.submitted];
+		lock.unlock();
+		renderReplay(renderer, commands);
+		lock.lock();
+		renderer.submitted = -1;
+		renderer.changed.notify_all();
 	}
+	lock.unlock();
+	glfwMakeContextCurrent(NULL);
+}
+
+// Buffer for the next frame, the render thread is done with it.
+CommandBuffer& renderCommands(Renderer& renderer) {
+	CommandBuffer& commands = renderer.buffers[renderer.recording];
+	commandsReset(commands);
+	return commands;
+}
 
-	if (layers >= 1) {
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, length * sizeof(float), (void*)(3 * sizeof(float))); // colors
-		glEnableVertexAttribArray(1);
-		checkOpenGLError();
+// Hands the recorded frame over once the render thread has finished the previous one, so the main thread runs at most one
+// frame ahead.
+void renderSubmit(Renderer& renderer) {
+	CommandBuffer& commands = renderer.buffers[renderer.recording];
+	if (!renderer.running) {
+		renderReplay(renderer, commands);
+		return;
+	}
+	{
+		TraceZone trace("renderSubmit");
+		std::unique_lock<std::mutex> lock(renderer.mutex);
+		renderer.changed.wait(lock, [&renderer]() { return renderer.submitted < 0; });
+		renderer.submitted = renderer.recording;
 	}
+	renderer.changed.notify_all();
+	renderer.recording = (renderer.recording + 1) % RENDER_BUFFERS;
+}
+
+// Waits for the submitted frame, the GL state can be read after this.
+void renderFinish(Renderer& renderer) {
+	if (!renderer.running)
+		return;
+	std::unique_lock<std::mutex> lock(renderer.mutex);
+	renderer.changed.wait(lock, [&renderer]() { return renderer.submitted < 0; });
+}
 
-	if (layers >= 2) {
-		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, length * sizeof(float), (void*)(6 * sizeof(float))); // Textures
-		glEnableVertexAttribArray(2);
-		checkOpenGLError();
+void renderReplay(Renderer& renderer, CommandBuffer& commands) {
+	TraceZone trace("renderReplay");
+	lastFrameStats = frameStats;
+	frameStats = {};
+	frameStats.culledObjects = commands.culledObjects;
+	frameStats.occludedObjects = commands.occludedObjects;
+	profilerFrame(profiler);
+	streamFrameBegin(streamBuffer);
+	glState.drawConstants = -1;
+	executeCommands(commands, glState);
+	streamFrameEnd(streamBuffer);
+	CHECK_GL_ERRORS();
+	if (renderer.collect) {
+		CompletedFrame frame = { frameStats, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - 
+			commands.started).count() };
+		std::lock_guard<std::mutex> lock(renderer.mutex);
+		renderer.completed.push_back(frame);
 	}
+}
+
+//******************************************************************************************************************************
+// Simulation
+// Starts from the current camera, the render thread interpolates from here on.
+void simulationStart(Simulation& simulation) {
+	SimulationSnapshot state = { 0, std::chrono::steady_clock::now(), camPos, orientation, turntableAngle };
+	for (SimulationSnapshot& slot : simulation.slots)
+		slot = state;
+	simulation.previous = state;
+	simulation.current = state;
+	simulation.input = {};
+	simulation.latest = 0;
+	simulation.writing = 1;
+	simulation.reading = 2;
+	simulation.finished = false;
+	simulation.thread = std::thread(simulationThread, std::ref(simulation));
+	simulation.running = true;
+}
 
-	if (layers >= 3) {
-		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, length * sizeof(float), (void*)(8 * sizeof(float))); // Normals
-		glEnableVertexAttribArray(3);
-		checkOpenGLError();
+void simulationStop(Simulation& simulation) {
+	if (!simulation.running)
+		return;
+	simulation.finished = true;
+	simulation.thread.join();
+	simulation.running = false;
+}
+
+// Ticks on a fixed schedule. After a stall of more than SIMULATION_MAX_LAG ticks the lost ones are dropped instead of run back 
+// to back.
+void simulationThread(Simulation& simulation) {
+	traceThreadName("simulation");
+	std::chrono::steady_clock::duration step = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		std::chrono::duration<double>(1.0 / SIMULATION_HZ));
+	SimulationSnapshot state = simulation.current;
+	std::chrono::steady_clock::time_point next = state.time + step;
+	while (!simulation.finished) {
+		std::this_thread::sleep_until(next);
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (now - next > step * SIMULATION_MAX_LAG)
+			next = now;
+
+		SimulationInput input;
+		{
+			std::lock_guard<std::mutex> lock(simulation.mutex);
+			input = simulation.input;
+			simulation.input.lookX = 0.0f;
+			simulation.input.lookY = 0.0f;
+		}
+		{
+			TraceZone trace("simulationStep");
+			simulationStep(state, input);
+		}
+		state.tick++;
+		state.time = next;
+		simulationPublish(simulation, state);
+		next += step;
 	}
+}
 
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+void simulationStep(SimulationSnapshot& state, const SimulationInput& input) {
+	glm::vec3 right = glm::normalize(glm::cross(state.orientation, up));
+	float speed = input.fast ? camSpeed * 4.0f : camSpeed;
+	state.camPos += speed * (input.move.x * right + input.move.y * up + input.move.z * state.orientation);
+
+	glm::vec3 newOrientation = glm::rotate(state.orientation, glm::radians(-input.lookX), right);
+	if (abs(glm::angle(newOrientation, up) - glm::radians(90.0f)) <= glm::radians(85.0f))
+		state.orientation = newOrientation;
+	state.orientation = glm::rotate(state.orientation, glm::radians(-input.lookY), up);
+
+	state.turntableAngle = std::fmod(state.turntableAngle + rotation / SIMULATION_HZ, 360.0f);
+}
 
-	return std::make_tuple(VAO, VBO, EBO);
+void simulationPublish(Simulation& simulation, const SimulationSnapshot& state) {
+	simulation.slots[simulation.writing] = state;
+	simulation.writing = simulation.latest.exchange(simulation.writing | SIMULATION_FRESH, std::memory_order_acq_rel) & 
+		~SIMULATION_FRESH;
 }
 
-void terminateObject(GLuint VAO, GLuint VBO, GLuint EBO) {
-	glDeleteVertexArrays(1, &VAO);
-	glDeleteBuffers(1, &VBO);
-	glDeleteBuffers(1, &EBO);
+// Held keys replace the last sample, mouse movement adds up until a tick takes it.
+void simulationInput(Simulation& simulation, const SimulationInput& input) {
+	std::lock_guard<std::mutex> lock(simulation.mutex);
+	simulation.input.move = input.move;
+	simulation.input.fast = input.fast;
+	simulation.input.lookX += input.lookX;
+	simulation.input.lookY += input.lookY;
 }
 
-void inputs(GLFWwindow* window) {
+// Takes the newest snapshot if there is one and renders one tick behind it, between the last two snapshots. Sets the camera 
+// and the turntable angle.
+void simulationInterpolate(Simulation& simulation) {
+	if (simulation.latest.load(std::memory_order_relaxed) & SIMULATION_FRESH) {
+		simulation.reading = simulation.latest.exchange(simulation.reading, std::memory_order_acq_rel) & ~SIMULATION_FRESH;
+		simulation.previous = simulation.current;
+		simulation.current = simulation.slots[simulation.reading];
+	}
+	const SimulationSnapshot& previous = simulation.previous;
+	const SimulationSnapshot& current = simulation.current;
+
+	std::chrono::duration<float> span = current.time - previous.time;
+	std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - std::chrono::duration<double>(1.0 / SIMULATION_HZ) - 
+		previous.time;
+	float t = span.count() > 0.0f ? std::min(std::max(elapsed.count() / span.count(), 0.0f), 1.0f) : 1.0f;
+
+	camPos = glm::mix(previous.camPos, current.camPos, t);
+	orientation = glm::normalize(glm::mix(previous.orientation, current.orientation, t));
+	float angle = current.turntableAngle - previous.turntableAngle; // Across the wrap at 360.
+	angle -= 360.0f * std::floor(angle / 360.0f + 0.5f);
+	turntableAngle = previous.turntableAngle + angle * t;
+}
+
+void inputs(GLFWwindow* window, CommandBuffer& commands) {
+	TraceZone trace("inputs");
+	// The camera moves on the simulation thread, this only samples the input.
+	SimulationInput input = {};
 	if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-		camPos += camSpeed * orientation;
+		input.move.z += 1.0f;
 	if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-		camPos += camSpeed * -glm::normalize(glm::cross(orientation, up));
+		input.move.x -= 1.0f;
 	if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-		camPos += camSpeed * -orientation;
+		input.move.z -= 1.0f;
 	if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-		camPos += camSpeed * glm::normalize(glm::cross(orientation, up));
+		input.move.x += 1.0f;
 	if (glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS)
-		camPos += camSpeed * up;
+		input.move.y += 1.0f;
 	if (glfwGetKey(window, GLFW_KEY_LEFT_CONTROL) == GLFW_PRESS)
-		camPos += camSpeed * -up;
-
-	if (glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS)
-		camSpeed = 0.4f;
+		input.move.y -= 1.0f;
 
-	else if (glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_RELEASE)
-		camSpeed = 0.1f;
+	input.fast = glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS;
 
 	if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS)
 	{
@@ -589,19 +8115,8 @@ void inputs(GLFWwindow* window) {
 		double mouseY;
 		glfwGetCursorPos(window, &mouseX, &mouseY);
 
-		float rotX = sensitivity * (float)(mouseY - (SCREEN_HEIGHT / 2)) / SCREEN_HEIGHT;
-		float rotY = sensitivity * (float)(mouseX - (SCREEN_WIDTH / 2)) / SCREEN_WIDTH;
-
-		glm::vec3 newOrientation = glm::rotate(orientation, glm::radians(-rotX), glm::normalize(glm::cross(orientation, up)));
-
-		//std::cout << "abs(glm::angle(newOrientation, up) - glm::radians(90.0f): " << abs(glm::angle(newOrientation, up) - glm::radians(90.0f)) << std::endl;
-		//std::cout << "orientation X/Y/Z" << orientation.x << "/" << orientation.y << "/" << orientation.z << std::endl;
-		if (abs(glm::angle(newOrientation, up) - glm::radians(90.0f)) <= glm::radians(85.0f))
-		{
-			orientation = newOrientation;
-		}
-
-		orientation = glm::rotate(orientation, glm::radians(-rotY), up);
+		input.lookX = sensitivity * (float)(mouseY - (SCREEN_HEIGHT / 2)) / SCREEN_HEIGHT;
+		input.lookY = sensitivity * (float)(mouseX - (SCREEN_WIDTH / 2)) / SCREEN_WIDTH;
 
 		glfwSetCursorPos(window, (SCREEN_WIDTH / 2), (SCREEN_HEIGHT / 2));
 	}
@@ -610,6 +8125,51 @@ void inputs(GLFWwindow* window) {
 		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
 		firstClick = true;
 	}
+	simulationInput(simulation, input);
+
+	// F1 prints the counters of the last complete frame. The counters and the profiler belong to the GL thread, so logging is
+	// recorded into the frame.
+	if (glfwGetKey(window, GLFW_KEY_F1) == GLFW_PRESS) {
+		if (!statsKeyDown)
+			recordCallback(commands, [](void*) { statsLog(lastFrameStats); }, NULL);
+		statsKeyDown = true;
+	}
+	else
+		statsKeyDown = false;
+
+	// F2 prints the per-pass timings averaged over the last PROFILER_HISTORY frames.
+	if (glfwGetKey(window, GLFW_KEY_F2) == GLFW_PRESS) {
+		if (!profileKeyDown)
+			recordCallback(commands, [](void*) { profilerLog(profiler); }, NULL);
+		profileKeyDown = true;
+	}
+	else
+		profileKeyDown = false;
+
+	// Right click prints and outlines the instance under the cursor.
+	if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS) {
+		if (!pickKeyDown) {
+			double x, y;
+			float distance;
+			glfwGetCursorPos(window, &x, &y);
+			int instance = pickInstance(x, y, distance);
+			pickedInstance = instance;
+			if (instance >= 0)
+				std::cout << "PICK" << " [instance: " << instance << ", distance: " << distance << "]" << std::endl;
+			else
+				std::cout << "PICK" << " [nothing]" << std::endl;
+		}
+		pickKeyDown = true;
+	}
+	else
+		pickKeyDown = false;
+}
+
+void statsLog(const FrameStats& stats) {
+	std::cout << "FRAME" << " [driver calls: " << stats.driverCalls << ", uniform calls: " << stats.uniformCalls
+		<< ", draw calls: " << stats.drawCalls << ", culled: " << stats.culledObjects << ", occluded: " << stats.occludedObjects 
+		<< ", avoided state changes: " << stats.avoidedStateChanges << ", stream stalls: " << stats.streamStalls << "]" 
+		<< std::endl;
 }
 
 void checkShaderCompileErrors(GLuint shader) {
@@ -644,8 +8204,12 @@ const char* getGLErrorString(GLenum err) {
 }
 
 void checkOpenGLError() {
+	debugOutputFlush();
+	if (debugOutput.enabled)
+		return;
+
 	GLenum err;
-	while ((err = glGetError()) != GL_NO_ERROR) {
+	while (DRIVER_CALL(err = glGetError()) != GL_NO_ERROR) {
 		errorLog("AVE", "NONE", getGLErrorString(err), "OpenGL ERROR");
 	}
 }